@@ -1,5 +1,5 @@
 /*
- * Copyright 2013, 2020 Ian Pilcher <arequipeno@gmail.com>
+ * Copyright 2013, 2020, 2026 Ian Pilcher <arequipeno@gmail.com>
  *
  * This program is free software.  You can redistribute it or modify it under
  * the terms of version 2 of the GNU General Public License (GPL), as published
@@ -216,6 +216,29 @@ void fcd_alert_read_monitor(struct fcd_monitor *mon)
 	}
 }
 
+/*
+ * Called (before any monitor threads are started) when a monitor's alert
+ * state has been restored from a previous run.  Any alerts that were restored
+ * as set (FCD_ALERT_SET_ACK) are counted, so that fcd_alert_leds_open() will
+ * leave the corresponding LEDs on.
+ */
+void fcd_alert_restore(struct fcd_monitor *mon)
+{
+	enum fcd_alert_msg *msg;
+	unsigned char *mon_base;
+	size_t i;
+
+	mon_base = (unsigned char *)mon;
+
+	for (i = 0; i < FCD_ARRAY_SIZE(fcd_alerts); ++i) {
+
+		msg = (enum fcd_alert_msg *)(mon_base + fcd_alerts[i].mon_offset);
+
+		if (*msg == FCD_ALERT_SET_ACK)
+			++(fcd_alerts[i].counter);
+	}
+}
+
 void fcd_alert_leds_close(void)
 {
 	size_t i;
@@ -241,6 +264,10 @@ void fcd_alert_leds_open(void)
 		if (fcd_alerts[i].led_fd == -1)
 			FCD_PFATAL(buf);
 
-		fcd_alert_led_off(&fcd_alerts[i]);
+		/* Alerts may have been restored by fcd_alert_restore() */
+		if (fcd_alerts[i].counter > 0)
+			fcd_alert_led_on(&fcd_alerts[i]);
+		else
+			fcd_alert_led_off(&fcd_alerts[i]);
 	}
 }
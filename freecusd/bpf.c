@@ -0,0 +1,612 @@
+/*
+ * Copyright 2026 Ian Pilcher <arequipeno@gmail.com>
+ *
+ * This program is free software.  You can redistribute it or modify it under
+ * the terms of version 2 of the GNU General Public License (GPL), as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY -- without even the implied warranty of MERCHANTIBILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the text of the GPL for more details.
+ *
+ * Version 2 of the GNU General Public License is available at:
+ *
+ *   http://www.gnu.org/licenses/old-licenses/gpl-2.0.html
+ */
+
+/*
+ * Optional (build with -DFCD_BPF) block I/O latency histograms.  Two small BPF
+ * programs are attached to the block:block_rq_issue and block:block_rq_complete
+ * tracepoints.  The first records the time at which each request (identified
+ * by device and sector) is issued; the second computes the request's latency
+ * and increments the matching log2 (microseconds) slot of the device's
+ * histogram.  The storage monitor reads the histograms each sample period.
+ *
+ * The programs are assembled here, so no BPF compiler or libbpf is needed.
+ * The offsets of the tracepoint fields are read from the tracepoints' format
+ * files at runtime.  If anything isn't available (old kernel, no tracefs,
+ * etc.), fcd_bpf_init() fails, and the storage monitor carries on without
+ * the histograms.
+ */
+
+#include "freecusd.h"
+
+#ifdef FCD_BPF
+
+#include <linux/bpf.h>
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+
+/* Max number of CPUs (each needs its own perf event per tracepoint) */
+#define FCD_BPF_MAX_CPUS	16
+
+/* Max number of requests in flight (across all devices) */
+#define FCD_BPF_MAX_REQS	4096
+
+/* Max number of devices with histograms */
+#define FCD_BPF_MAX_DEVS	64
+
+/* Max # of instructions in a program */
+#define FCD_BPF_MAX_INSNS	128
+
+/* Stack offsets (from r10) used by the programs */
+#define FCD_BPF_REQ_KEY		-16	/* struct fcd_bpf_req_key */
+#define FCD_BPF_START		-24	/* issue time (ns) */
+#define FCD_BPF_HIST_KEY	-32	/* device number */
+#define FCD_BPF_HIST_ZERO	(FCD_BPF_HIST_KEY - FCD_BPF_HIST_SIZE)
+
+#define FCD_BPF_HIST_SIZE	(FCD_BPF_HIST_SLOTS * 8)
+
+/* Key of the in-flight request map */
+struct fcd_bpf_req_key {
+	uint32_t dev;
+	uint32_t pad;
+	uint64_t sector;
+};
+
+/* Offsets of the fields used in the tracepoints' records */
+struct fcd_bpf_tp {
+	const char *name;
+	unsigned id;
+	unsigned dev_off;
+	unsigned sector_off;
+};
+
+static struct fcd_bpf_tp fcd_bpf_issue = { .name = "block_rq_issue" };
+static struct fcd_bpf_tp fcd_bpf_complete = { .name = "block_rq_complete" };
+
+static int fcd_bpf_req_map = -1;
+static int fcd_bpf_hist_map = -1;
+static int fcd_bpf_progs[2] = { -1, -1 };
+static int fcd_bpf_events[2 * FCD_BPF_MAX_CPUS];
+static unsigned fcd_bpf_event_count;
+
+/* Program being assembled */
+static struct bpf_insn fcd_bpf_insns[FCD_BPF_MAX_INSNS];
+static unsigned fcd_bpf_insn_count;
+
+/* Verifier log (only used if a program fails to load) */
+static char fcd_bpf_log[8192];
+
+static const char *const fcd_bpf_tracefs[] = {
+	"/sys/kernel/tracing",
+	"/sys/kernel/debug/tracing",
+};
+
+/*
+ * Instruction emitters.  Each returns the index of the instruction, so that
+ * jumps can be patched once their targets are known.
+ */
+
+static unsigned fcd_bpf_emit(const uint8_t code, const uint8_t dst,
+			     const uint8_t src, const int16_t off,
+			     const int32_t imm)
+{
+	struct bpf_insn *insn;
+
+	if (fcd_bpf_insn_count == FCD_BPF_MAX_INSNS)
+		FCD_ABORT("BPF program too large\n");
+
+	insn = &fcd_bpf_insns[fcd_bpf_insn_count];
+	memset(insn, 0, sizeof *insn);
+	insn->code = code;
+	insn->dst_reg = dst;
+	insn->src_reg = src;
+	insn->off = off;
+	insn->imm = imm;
+
+	return fcd_bpf_insn_count++;
+}
+
+static void fcd_bpf_ld_map(const uint8_t dst, const int map_fd)
+{
+	fcd_bpf_emit(BPF_LD | BPF_DW | BPF_IMM, dst, BPF_PSEUDO_MAP_FD, 0,
+		     map_fd);
+	fcd_bpf_emit(0, 0, 0, 0, 0);
+}
+
+/* Sets a register to r10 + off (a pointer to the stack) */
+static void fcd_bpf_stack_ptr(const uint8_t dst, const int16_t off)
+{
+	fcd_bpf_emit(BPF_ALU64 | BPF_MOV | BPF_X, dst, BPF_REG_10, 0, 0);
+	fcd_bpf_emit(BPF_ALU64 | BPF_ADD | BPF_K, dst, 0, 0, off);
+}
+
+static void fcd_bpf_call(const int32_t helper)
+{
+	fcd_bpf_emit(BPF_JMP | BPF_CALL, 0, 0, 0, helper);
+}
+
+/* Makes the jump at index jmp land on the next instruction emitted */
+static void fcd_bpf_patch(const unsigned jmp)
+{
+	fcd_bpf_insns[jmp].off = fcd_bpf_insn_count - jmp - 1;
+}
+
+/*
+ * Builds the in-flight request map key (device & sector) at r10 + REQ_KEY, from
+ * the tracepoint record pointed to by r6
+ */
+static void fcd_bpf_req_key(const struct fcd_bpf_tp *const tp)
+{
+	fcd_bpf_emit(BPF_LDX | BPF_W | BPF_MEM, BPF_REG_2, BPF_REG_6,
+		     tp->dev_off, 0);
+	fcd_bpf_emit(BPF_STX | BPF_W | BPF_MEM, BPF_REG_10, BPF_REG_2,
+		     FCD_BPF_REQ_KEY, 0);
+	fcd_bpf_emit(BPF_ST | BPF_W | BPF_MEM, BPF_REG_10, 0,
+		     FCD_BPF_REQ_KEY + 4, 0);
+	fcd_bpf_emit(BPF_LDX | BPF_DW | BPF_MEM, BPF_REG_2, BPF_REG_6,
+		     tp->sector_off, 0);
+	fcd_bpf_emit(BPF_STX | BPF_DW | BPF_MEM, BPF_REG_10, BPF_REG_2,
+		     FCD_BPF_REQ_KEY + 8, 0);
+}
+
+/*
+ * block_rq_issue:
+ *
+ *	req_map[dev, sector] = ktime_get_ns()
+ */
+static void fcd_bpf_asm_issue(void)
+{
+	fcd_bpf_insn_count = 0;
+
+	fcd_bpf_emit(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_6, BPF_REG_1, 0, 0);
+	fcd_bpf_req_key(&fcd_bpf_issue);
+
+	fcd_bpf_call(BPF_FUNC_ktime_get_ns);
+	fcd_bpf_emit(BPF_STX | BPF_DW | BPF_MEM, BPF_REG_10, BPF_REG_0,
+		     FCD_BPF_START, 0);
+
+	fcd_bpf_ld_map(BPF_REG_1, fcd_bpf_req_map);
+	fcd_bpf_stack_ptr(BPF_REG_2, FCD_BPF_REQ_KEY);
+	fcd_bpf_stack_ptr(BPF_REG_3, FCD_BPF_START);
+	fcd_bpf_emit(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_4, 0, 0, BPF_ANY);
+	fcd_bpf_call(BPF_FUNC_map_update_elem);
+
+	fcd_bpf_emit(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, 0);
+	fcd_bpf_emit(BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+}
+
+/*
+ * block_rq_complete:
+ *
+ *	start = req_map[dev, sector] (or exit if not found)
+ *	delete req_map[dev, sector]
+ *	slot = min(log2((ktime_get_ns() - start) / 1000), SLOTS - 1)
+ *	hist = hist_map[dev] (created, all zeroes, if not found)
+ *	atomically increment hist[slot]
+ */
+static void fcd_bpf_asm_complete(void)
+{
+	unsigned i, miss, found, clamp, skip, shift[6];
+	static const int bits[6] = { 32, 16, 8, 4, 2, 1 };
+	int off;
+
+	fcd_bpf_insn_count = 0;
+
+	fcd_bpf_emit(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_6, BPF_REG_1, 0, 0);
+	fcd_bpf_req_key(&fcd_bpf_complete);
+
+	fcd_bpf_ld_map(BPF_REG_1, fcd_bpf_req_map);
+	fcd_bpf_stack_ptr(BPF_REG_2, FCD_BPF_REQ_KEY);
+	fcd_bpf_call(BPF_FUNC_map_lookup_elem);
+	miss = fcd_bpf_emit(BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_0, 0, 0, 0);
+	fcd_bpf_emit(BPF_LDX | BPF_DW | BPF_MEM, BPF_REG_7, BPF_REG_0, 0, 0);
+
+	fcd_bpf_ld_map(BPF_REG_1, fcd_bpf_req_map);
+	fcd_bpf_stack_ptr(BPF_REG_2, FCD_BPF_REQ_KEY);
+	fcd_bpf_call(BPF_FUNC_map_delete_elem);
+
+	/* r1 = latency (us) */
+	fcd_bpf_call(BPF_FUNC_ktime_get_ns);
+	fcd_bpf_emit(BPF_ALU64 | BPF_SUB | BPF_X, BPF_REG_0, BPF_REG_7, 0, 0);
+	fcd_bpf_emit(BPF_ALU64 | BPF_DIV | BPF_K, BPF_REG_0, 0, 0, 1000);
+	fcd_bpf_emit(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_1, BPF_REG_0, 0, 0);
+
+	/* r8 = log2(r1), by binary search (older verifiers reject loops) */
+	fcd_bpf_emit(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_8, 0, 0, 0);
+
+	for (i = 0; i < FCD_ARRAY_SIZE(bits); ++i) {
+		fcd_bpf_emit(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_2, BPF_REG_1,
+			     0, 0);
+		fcd_bpf_emit(BPF_ALU64 | BPF_RSH | BPF_K, BPF_REG_2, 0, 0,
+			     bits[i]);
+		shift[i] = fcd_bpf_emit(BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_2, 0,
+					0, 0);
+		fcd_bpf_emit(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_1, BPF_REG_2,
+			     0, 0);
+		fcd_bpf_emit(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_8, 0, 0,
+			     bits[i]);
+		fcd_bpf_patch(shift[i]);
+	}
+
+	/* Clamp to the last slot and convert to a byte offset */
+	clamp = fcd_bpf_emit(BPF_JMP | BPF_JGT | BPF_K, BPF_REG_8, 0, 0,
+			     FCD_BPF_HIST_SLOTS - 1);
+	skip = fcd_bpf_emit(BPF_JMP | BPF_JA, 0, 0, 0, 0);
+	fcd_bpf_patch(clamp);
+	fcd_bpf_emit(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_8, 0, 0,
+		     FCD_BPF_HIST_SLOTS - 1);
+	fcd_bpf_patch(skip);
+	fcd_bpf_emit(BPF_ALU64 | BPF_LSH | BPF_K, BPF_REG_8, 0, 0, 3);
+
+	/* Find the device's histogram */
+	fcd_bpf_emit(BPF_LDX | BPF_W | BPF_MEM, BPF_REG_2, BPF_REG_6,
+		     fcd_bpf_complete.dev_off, 0);
+	fcd_bpf_emit(BPF_STX | BPF_W | BPF_MEM, BPF_REG_10, BPF_REG_2,
+		     FCD_BPF_HIST_KEY, 0);
+	fcd_bpf_ld_map(BPF_REG_1, fcd_bpf_hist_map);
+	fcd_bpf_stack_ptr(BPF_REG_2, FCD_BPF_HIST_KEY);
+	fcd_bpf_call(BPF_FUNC_map_lookup_elem);
+	found = fcd_bpf_emit(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_0, 0, 0, 0);
+
+	/* Not found; create it */
+	for (off = FCD_BPF_HIST_ZERO; off < FCD_BPF_HIST_KEY; off += 8) {
+		fcd_bpf_emit(BPF_ST | BPF_DW | BPF_MEM, BPF_REG_10, 0, off,
+			     0);
+	}
+
+	fcd_bpf_ld_map(BPF_REG_1, fcd_bpf_hist_map);
+	fcd_bpf_stack_ptr(BPF_REG_2, FCD_BPF_HIST_KEY);
+	fcd_bpf_stack_ptr(BPF_REG_3, FCD_BPF_HIST_ZERO);
+	fcd_bpf_emit(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_4, 0, 0,
+		     BPF_NOEXIST);
+	fcd_bpf_call(BPF_FUNC_map_update_elem);
+	fcd_bpf_ld_map(BPF_REG_1, fcd_bpf_hist_map);
+	fcd_bpf_stack_ptr(BPF_REG_2, FCD_BPF_HIST_KEY);
+	fcd_bpf_call(BPF_FUNC_map_lookup_elem);
+	i = fcd_bpf_emit(BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_0, 0, 0, 0);
+
+	/* hist[slot] += 1 */
+	fcd_bpf_patch(found);
+	fcd_bpf_emit(BPF_ALU64 | BPF_ADD | BPF_X, BPF_REG_0, BPF_REG_8, 0, 0);
+	fcd_bpf_emit(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_1, 0, 0, 1);
+	fcd_bpf_emit(BPF_STX | BPF_DW | BPF_XADD, BPF_REG_0, BPF_REG_1, 0, 0);
+
+	fcd_bpf_patch(miss);
+	fcd_bpf_patch(i);
+	fcd_bpf_emit(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, 0);
+	fcd_bpf_emit(BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+}
+
+static int fcd_bpf(const int cmd, union bpf_attr *const attr)
+{
+	return syscall(__NR_bpf, cmd, attr, sizeof *attr);
+}
+
+static int fcd_bpf_map_create(const enum bpf_map_type type,
+			      const unsigned key_size,
+			      const unsigned value_size,
+			      const unsigned max_entries)
+{
+	union bpf_attr attr;
+
+	memset(&attr, 0, sizeof attr);
+	attr.map_type = type;
+	attr.key_size = key_size;
+	attr.value_size = value_size;
+	attr.max_entries = max_entries;
+
+	return fcd_bpf(BPF_MAP_CREATE, &attr);
+}
+
+/*
+ * Loads the program that has been assembled.  Returns the program fd, or -1
+ * on error.
+ */
+static int fcd_bpf_prog_load(const char *const name)
+{
+	union bpf_attr attr;
+	int fd;
+
+	memset(&attr, 0, sizeof attr);
+	attr.prog_type = BPF_PROG_TYPE_TRACEPOINT;
+	attr.insns = (uintptr_t)fcd_bpf_insns;
+	attr.insn_cnt = fcd_bpf_insn_count;
+	attr.license = (uintptr_t)"GPL";
+
+	fd = fcd_bpf(BPF_PROG_LOAD, &attr);
+	if (fd != -1)
+		return fd;
+
+	if (errno != EACCES && errno != EINVAL) {
+		FCD_PERROR(name);
+		return -1;
+	}
+
+	/* Load it again to get the verifier's complaint */
+	attr.log_buf = (uintptr_t)fcd_bpf_log;
+	attr.log_size = sizeof fcd_bpf_log;
+	attr.log_level = 1;
+	fcd_bpf_log[0] = 0;
+
+	fd = fcd_bpf(BPF_PROG_LOAD, &attr);
+	if (fd != -1)
+		return fd;
+
+	FCD_WARN("%s: BPF program rejected: %s\n", name, fcd_bpf_log);
+	return -1;
+}
+
+/*
+ * Reads the ID of a block tracepoint and the offsets of its dev and sector
+ * fields.  Returns 0 on success, -1 on error.
+ */
+static int fcd_bpf_read_tp(const int dirfd, struct fcd_bpf_tp *const tp)
+{
+	char path[64], buf[4096], *c;
+	unsigned off, size;
+	int fd, found;
+	ssize_t ret;
+
+	sprintf(path, "events/block/%s/id", tp->name);
+
+	fd = openat(dirfd, path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		FCD_PERROR(path);
+		return -1;
+	}
+
+	ret = fcd_lib_read_attr(fd, path, buf, sizeof buf);
+	if (close(fd) == -1)
+		FCD_PERROR("close");
+	if (ret == -1 || sscanf(buf, "%u", &tp->id) != 1) {
+		FCD_WARN("Failed to read tracepoint ID: %s\n", path);
+		return -1;
+	}
+
+	sprintf(path, "events/block/%s/format", tp->name);
+
+	fd = openat(dirfd, path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		FCD_PERROR(path);
+		return -1;
+	}
+
+	ret = fcd_lib_read_attr(fd, path, buf, sizeof buf);
+	if (close(fd) == -1)
+		FCD_PERROR("close");
+	if (ret == -1)
+		return -1;
+
+	/* e.g. "field:dev_t dev;	offset:8;	size:4;	signed:0;" */
+	for (found = 0, c = buf; (c = strstr(c, "field:")) != NULL; ++c) {
+
+		if (sscanf(c, "field:dev_t dev; offset:%u; size:%u;",
+				&off, &size) == 2 && size == 4) {
+			tp->dev_off = off;
+			found |= 1;
+		}
+		else if (sscanf(c, "field:sector_t sector; offset:%u; size:%u;",
+				&off, &size) == 2 && size == 8) {
+			tp->sector_off = off;
+			found |= 2;
+		}
+	}
+
+	if (found != 3) {
+		FCD_WARN("Unexpected tracepoint format: %s\n", path);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int fcd_bpf_read_tps(void)
+{
+	unsigned i;
+	int dirfd, ret;
+
+	for (i = 0; i < FCD_ARRAY_SIZE(fcd_bpf_tracefs); ++i) {
+
+		dirfd = open(fcd_bpf_tracefs[i],
+			     O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (dirfd == -1)
+			continue;
+
+		if (faccessat(dirfd, "events/block", F_OK, 0) == 0)
+			break;
+
+		if (close(dirfd) == -1)
+			FCD_PERROR("close");
+	}
+
+	if (i == FCD_ARRAY_SIZE(fcd_bpf_tracefs)) {
+		FCD_WARN("Block tracepoints not found (no tracefs?)\n");
+		return -1;
+	}
+
+	ret = 0;
+
+	if (fcd_bpf_read_tp(dirfd, &fcd_bpf_issue) == -1 ||
+			fcd_bpf_read_tp(dirfd, &fcd_bpf_complete) == -1)
+		ret = -1;
+
+	if (close(dirfd) == -1)
+		FCD_PERROR("close");
+
+	return ret;
+}
+
+/*
+ * Attaches a program to a tracepoint on every (online) CPU.  Returns 0 on
+ * success, -1 on error.
+ */
+static int fcd_bpf_attach(const struct fcd_bpf_tp *const tp, const int prog)
+{
+	struct perf_event_attr attr;
+	unsigned cpu, attached;
+	long cpus;
+	int fd;
+
+	cpus = sysconf(_SC_NPROCESSORS_CONF);
+	if (cpus > FCD_BPF_MAX_CPUS)
+		cpus = FCD_BPF_MAX_CPUS;
+
+	memset(&attr, 0, sizeof attr);
+	attr.type = PERF_TYPE_TRACEPOINT;
+	attr.size = sizeof attr;
+	attr.config = tp->id;
+	attr.sample_period = 1;
+	attr.wakeup_events = 1;
+
+	for (attached = 0, cpu = 0; cpu < (unsigned)cpus; ++cpu) {
+
+		fd = syscall(__NR_perf_event_open, &attr, -1, cpu, -1,
+			     PERF_FLAG_FD_CLOEXEC);
+		if (fd == -1) {
+			if (errno == ENODEV)	/* offline */
+				continue;
+			FCD_PERROR("perf_event_open");
+			return -1;
+		}
+
+		fcd_bpf_events[fcd_bpf_event_count++] = fd;
+
+		if (ioctl(fd, PERF_EVENT_IOC_SET_BPF, prog) == -1 ||
+				ioctl(fd, PERF_EVENT_IOC_ENABLE, 0) == -1) {
+			FCD_PERROR("ioctl");
+			return -1;
+		}
+
+		++attached;
+	}
+
+	return (attached == 0) ? -1 : 0;
+}
+
+void fcd_bpf_fini(void)
+{
+	unsigned i;
+
+	for (i = 0; i < fcd_bpf_event_count; ++i) {
+		if (close(fcd_bpf_events[i]) == -1)
+			FCD_PERROR("close");
+	}
+
+	fcd_bpf_event_count = 0;
+
+	for (i = 0; i < FCD_ARRAY_SIZE(fcd_bpf_progs); ++i) {
+		if (fcd_bpf_progs[i] != -1 && close(fcd_bpf_progs[i]) == -1)
+			FCD_PERROR("close");
+		fcd_bpf_progs[i] = -1;
+	}
+
+	if (fcd_bpf_req_map != -1 && close(fcd_bpf_req_map) == -1)
+		FCD_PERROR("close");
+	if (fcd_bpf_hist_map != -1 && close(fcd_bpf_hist_map) == -1)
+		FCD_PERROR("close");
+
+	fcd_bpf_req_map = -1;
+	fcd_bpf_hist_map = -1;
+}
+
+/*
+ * Creates the maps, loads the programs, and attaches them to the block
+ * tracepoints.  Returns 0 on success, -1 if the histograms aren't available.
+ */
+int fcd_bpf_init(void)
+{
+	if (fcd_bpf_read_tps() == -1)
+		return -1;
+
+	/* LRU hash (Linux 4.10) drops requests that never complete */
+	fcd_bpf_req_map = fcd_bpf_map_create(BPF_MAP_TYPE_LRU_HASH,
+					     sizeof(struct fcd_bpf_req_key),
+					     sizeof(uint64_t),
+					     FCD_BPF_MAX_REQS);
+	if (fcd_bpf_req_map == -1 && errno == EINVAL) {
+		fcd_bpf_req_map = fcd_bpf_map_create(BPF_MAP_TYPE_HASH,
+					sizeof(struct fcd_bpf_req_key),
+					sizeof(uint64_t), FCD_BPF_MAX_REQS);
+	}
+
+	if (fcd_bpf_req_map == -1) {
+		FCD_PERROR("bpf");
+		goto error;
+	}
+
+	fcd_bpf_hist_map = fcd_bpf_map_create(BPF_MAP_TYPE_HASH,
+					      sizeof(uint32_t),
+					      FCD_BPF_HIST_SIZE,
+					      FCD_BPF_MAX_DEVS);
+	if (fcd_bpf_hist_map == -1) {
+		FCD_PERROR("bpf");
+		goto error;
+	}
+
+	fcd_bpf_asm_issue();
+	fcd_bpf_progs[0] = fcd_bpf_prog_load(fcd_bpf_issue.name);
+	if (fcd_bpf_progs[0] == -1)
+		goto error;
+
+	fcd_bpf_asm_complete();
+	fcd_bpf_progs[1] = fcd_bpf_prog_load(fcd_bpf_complete.name);
+	if (fcd_bpf_progs[1] == -1)
+		goto error;
+
+	if (fcd_bpf_attach(&fcd_bpf_issue, fcd_bpf_progs[0]) == -1 ||
+			fcd_bpf_attach(&fcd_bpf_complete,
+				       fcd_bpf_progs[1]) == -1)
+		goto error;
+
+	FCD_INFO("Block I/O latency histograms enabled\n");
+	return 0;
+
+error:
+	fcd_bpf_fini();
+	return -1;
+}
+
+/*
+ * Reads the (cumulative) latency histogram of a device.  dev is the kernel's
+ * internal device number -- (major << 20) | minor.  Returns 0 on success, 1
+ * if the device hasn't completed any I/O yet, or -1 on error.
+ */
+int fcd_bpf_read(const unsigned dev, uint64_t *const counts)
+{
+	union bpf_attr attr;
+	uint32_t key;
+
+	key = dev;
+
+	memset(&attr, 0, sizeof attr);
+	attr.map_fd = fcd_bpf_hist_map;
+	attr.key = (uintptr_t)&key;
+	attr.value = (uintptr_t)counts;
+
+	if (fcd_bpf(BPF_MAP_LOOKUP_ELEM, &attr) == -1) {
+		if (errno == ENOENT)
+			return 1;
+		FCD_PERROR("bpf");
+		return -1;
+	}
+
+	return 0;
+}
+
+#endif	/* FCD_BPF */
@@ -1,5 +1,5 @@
 /*
- * Copyright 2014 Ian Pilcher <arequipeno@gmail.com>
+ * Copyright 2014, 2026 Ian Pilcher <arequipeno@gmail.com>
  *
  * This program is free software.  You can redistribute it or modify it under
  * the terms of version 2 of the GNU General Public License (GPL), as published
@@ -18,6 +18,7 @@
 
 #include <string.h>
 #include <limits.h>
+#include <sched.h>
 #include <errno.h>
 
 /*
@@ -40,6 +41,204 @@ struct fcd_raid_disk fcd_conf_disks[FCD_MAX_DISK_COUNT] = {
 	[0].temps[FCD_CONF_TEMP_WARN] = INT_MIN
 };
 
+/*
+ * Sensor (temperature & fan) sampling and filtering
+ */
+int fcd_conf_sample_interval = 30;	/* sensor_sample_interval */
+int fcd_conf_filter_samples = 1;	/* sensor_filter_samples */
+int fcd_conf_filter_weight = 100;	/* sensor_filter_weight */
+
+/*
+ * Child process limits
+ */
+int fcd_conf_max_children = 8;		/* max_child_processes */
+int fcd_conf_max_mon_children = 2;	/* max_child_processes_per_monitor */
+
+/*
+ * Memory locking & OOM killer
+ */
+_Bool fcd_conf_lock_memory = 0;		/* lock_memory */
+int fcd_conf_oom_score_adj = INT_MIN;	/* oom_score_adj; INT_MIN = not set */
+
+/*
+ * Scheduling (see sched.c)
+ */
+int fcd_conf_monitor_nice = INT_MIN;	/* monitor_nice; INT_MIN = not set */
+_Bool fcd_conf_monitor_sched_idle = 0;	/* monitor_sched_idle */
+int fcd_conf_helper_nice = INT_MIN;	/* helper_nice; INT_MIN = not set */
+_Bool fcd_conf_helper_sched_idle = 0;	/* helper_sched_idle */
+int fcd_conf_helper_io_class = 0;	/* helper_io_class; 0 = not set */
+int fcd_conf_helper_io_priority = 4;	/* helper_io_priority */
+int fcd_conf_cpu_affinity = -1;		/* cpu_affinity; -1 = not set */
+_Bool fcd_conf_helper_cgroup = 0;	/* helper_cgroup */
+int fcd_conf_helper_cpu_max = 0;	/* helper_cpu_max; 0 = no limit */
+int fcd_conf_helper_io_max = 0;		/* helper_io_max; 0 = no limit */
+
+static const struct fcd_conf_int_range {
+	int min;
+	int max;
+	int *value;
+}
+fcd_conf_sample_interval_range	= { 1, 30, &fcd_conf_sample_interval },
+fcd_conf_filter_samples_range	= { 1, FCD_FILTER_MAX_SAMPLES,
+				    &fcd_conf_filter_samples },
+fcd_conf_filter_weight_range	= { 1, 100, &fcd_conf_filter_weight },
+fcd_conf_max_children_range	= { 1, 64, &fcd_conf_max_children },
+fcd_conf_max_mon_children_range	= { 1, 16, &fcd_conf_max_mon_children },
+fcd_conf_oom_score_adj_range	= { -1000, 1000, &fcd_conf_oom_score_adj },
+fcd_conf_monitor_nice_range	= { -20, 19, &fcd_conf_monitor_nice },
+fcd_conf_helper_nice_range	= { -20, 19, &fcd_conf_helper_nice },
+fcd_conf_helper_io_class_range	= { 0, 3, &fcd_conf_helper_io_class },
+fcd_conf_helper_io_prio_range	= { 0, 7, &fcd_conf_helper_io_priority },
+fcd_conf_cpu_affinity_range	= { 0, CPU_SETSIZE - 1,
+				    &fcd_conf_cpu_affinity },
+fcd_conf_helper_cpu_max_range	= { 1, 100, &fcd_conf_helper_cpu_max },
+fcd_conf_helper_io_max_range	= { 1, 1000000, &fcd_conf_helper_io_max };
+
+/*
+ * Post-parse callback for integer options with a valid range
+ */
+static int fcd_conf_int_range_cb(cip_err_ctx *ctx, const cip_ini_value *value,
+				 const cip_ini_sect *sect __attribute__((unused)),
+				 const cip_ini_file *file __attribute__((unused)),
+				 void *post_parse_data)
+{
+	const struct fcd_conf_int_range *range = post_parse_data;
+	int i;
+
+	memcpy(&i, value->value, sizeof i);
+
+	if (i < range->min || i > range->max) {
+		cip_err(ctx, "Value (%d) outside valid range (%d - %d)",
+			i, range->min, range->max);
+		return -1;
+	}
+
+	*range->value = i;
+
+	return 0;
+}
+
+/*
+ * Post-parse callback for boolean options
+ */
+static int fcd_conf_bool_cb(cip_err_ctx *ctx __attribute__((unused)),
+			    const cip_ini_value *value,
+			    const cip_ini_sect *sect __attribute__((unused)),
+			    const cip_ini_file *file __attribute__((unused)),
+			    void *post_parse_data)
+{
+	*(_Bool *)post_parse_data = *(const bool *)(value->value);
+	return 0;
+}
+
+/* Options that don't belong to any particular monitor */
+static const cip_opt_info fcd_conf_opts[] = {
+	{
+		.name			= "sensor_sample_interval",
+		.type			= CIP_OPT_TYPE_INT,
+		.post_parse_fn		= fcd_conf_int_range_cb,
+		.post_parse_data	= (void *)&fcd_conf_sample_interval_range,
+	},
+	{
+		.name			= "sensor_filter_samples",
+		.type			= CIP_OPT_TYPE_INT,
+		.post_parse_fn		= fcd_conf_int_range_cb,
+		.post_parse_data	= (void *)&fcd_conf_filter_samples_range,
+	},
+	{
+		.name			= "sensor_filter_weight",
+		.type			= CIP_OPT_TYPE_INT,
+		.post_parse_fn		= fcd_conf_int_range_cb,
+		.post_parse_data	= (void *)&fcd_conf_filter_weight_range,
+	},
+	{
+		.name			= "max_child_processes",
+		.type			= CIP_OPT_TYPE_INT,
+		.post_parse_fn		= fcd_conf_int_range_cb,
+		.post_parse_data	= (void *)&fcd_conf_max_children_range,
+	},
+	{
+		.name			= "max_child_processes_per_monitor",
+		.type			= CIP_OPT_TYPE_INT,
+		.post_parse_fn		= fcd_conf_int_range_cb,
+		.post_parse_data	= (void *)&fcd_conf_max_mon_children_range,
+	},
+	{
+		.name			= "lock_memory",
+		.type			= CIP_OPT_TYPE_BOOL,
+		.post_parse_fn		= fcd_conf_bool_cb,
+		.post_parse_data	= &fcd_conf_lock_memory,
+	},
+	{
+		.name			= "oom_score_adj",
+		.type			= CIP_OPT_TYPE_INT,
+		.post_parse_fn		= fcd_conf_int_range_cb,
+		.post_parse_data	= (void *)&fcd_conf_oom_score_adj_range,
+	},
+	{
+		.name			= "monitor_nice",
+		.type			= CIP_OPT_TYPE_INT,
+		.post_parse_fn		= fcd_conf_int_range_cb,
+		.post_parse_data	= (void *)&fcd_conf_monitor_nice_range,
+	},
+	{
+		.name			= "monitor_sched_idle",
+		.type			= CIP_OPT_TYPE_BOOL,
+		.post_parse_fn		= fcd_conf_bool_cb,
+		.post_parse_data	= &fcd_conf_monitor_sched_idle,
+	},
+	{
+		.name			= "helper_nice",
+		.type			= CIP_OPT_TYPE_INT,
+		.post_parse_fn		= fcd_conf_int_range_cb,
+		.post_parse_data	= (void *)&fcd_conf_helper_nice_range,
+	},
+	{
+		.name			= "helper_sched_idle",
+		.type			= CIP_OPT_TYPE_BOOL,
+		.post_parse_fn		= fcd_conf_bool_cb,
+		.post_parse_data	= &fcd_conf_helper_sched_idle,
+	},
+	{
+		.name			= "helper_io_class",
+		.type			= CIP_OPT_TYPE_INT,
+		.post_parse_fn		= fcd_conf_int_range_cb,
+		.post_parse_data	= (void *)&fcd_conf_helper_io_class_range,
+	},
+	{
+		.name			= "helper_io_priority",
+		.type			= CIP_OPT_TYPE_INT,
+		.post_parse_fn		= fcd_conf_int_range_cb,
+		.post_parse_data	= (void *)&fcd_conf_helper_io_prio_range,
+	},
+	{
+		.name			= "cpu_affinity",
+		.type			= CIP_OPT_TYPE_INT,
+		.post_parse_fn		= fcd_conf_int_range_cb,
+		.post_parse_data	= (void *)&fcd_conf_cpu_affinity_range,
+	},
+	{
+		.name			= "helper_cgroup",
+		.type			= CIP_OPT_TYPE_BOOL,
+		.post_parse_fn		= fcd_conf_bool_cb,
+		.post_parse_data	= &fcd_conf_helper_cgroup,
+	},
+	{
+		.name			= "helper_cpu_max",
+		.type			= CIP_OPT_TYPE_INT,
+		.post_parse_fn		= fcd_conf_int_range_cb,
+		.post_parse_data	= (void *)&fcd_conf_helper_cpu_max_range,
+	},
+	{
+		.name			= "helper_io_max",
+		.type			= CIP_OPT_TYPE_INT,
+		.post_parse_fn		= fcd_conf_int_range_cb,
+		.post_parse_data	= (void *)&fcd_conf_helper_io_max_range,
+	},
+	{	.name			= NULL		}
+};
+
 /*
  * Post-parse callback for monitor enable/disable booleans
  */
@@ -108,6 +307,17 @@ static int fcd_conf_per_mon(cip_err_ctx *ctx, struct fcd_monitor *mon,
 	return 0;
 }
 
+static void fcd_conf_dump_nice(const char *const who, const int nice,
+			       const _Bool sched_idle)
+{
+	if (nice == INT_MIN)
+		FCD_DUMP("\t%s nice value: (not set)\n", who);
+	else
+		FCD_DUMP("\t%s nice value: %d\n", who, nice);
+
+	FCD_DUMP("\t%s SCHED_IDLE: %s\n", who, sched_idle ? "true" : "false");
+}
+
 static void fcd_conf_dump(void)
 {
 	struct fcd_monitor **mon;
@@ -115,6 +325,41 @@ static void fcd_conf_dump(void)
 	if (!fcd_err_debug)
 		return;
 
+	FCD_DUMP("Global configuration:\n");
+	FCD_DUMP("\tsensor sample interval: %d seconds\n",
+		 fcd_conf_sample_interval);
+	FCD_DUMP("\tsensor filter samples: %d\n", fcd_conf_filter_samples);
+	FCD_DUMP("\tsensor filter weight: %d%%\n", fcd_conf_filter_weight);
+	FCD_DUMP("\tmax child processes: %d\n", fcd_conf_max_children);
+	FCD_DUMP("\tmax child processes per monitor: %d\n",
+		 fcd_conf_max_mon_children);
+	FCD_DUMP("\tlock memory: %s\n",
+		 fcd_conf_lock_memory ? "true" : "false");
+	if (fcd_conf_oom_score_adj == INT_MIN) {
+		FCD_DUMP("\tOOM score adjustment: (not set)\n");
+	}
+	else {
+		FCD_DUMP("\tOOM score adjustment: %d\n",
+			 fcd_conf_oom_score_adj);
+	}
+	fcd_conf_dump_nice("monitor", fcd_conf_monitor_nice,
+			   fcd_conf_monitor_sched_idle);
+	fcd_conf_dump_nice("helper", fcd_conf_helper_nice,
+			   fcd_conf_helper_sched_idle);
+	FCD_DUMP("\thelper I/O class: %d (priority %d)\n",
+		 fcd_conf_helper_io_class, fcd_conf_helper_io_priority);
+	if (fcd_conf_cpu_affinity == -1)
+		FCD_DUMP("\tCPU affinity: (not set)\n");
+	else
+		FCD_DUMP("\tCPU affinity: CPU %d\n", fcd_conf_cpu_affinity);
+	FCD_DUMP("\thelper cgroup: %s\n",
+		 fcd_conf_helper_cgroup ? "true" : "false");
+	FCD_DUMP("\thelper CPU limit: %d%% (0 = no limit)\n",
+		 fcd_conf_helper_cpu_max);
+	FCD_DUMP("\thelper IOPS limit: %d (0 = no limit)\n",
+		 fcd_conf_helper_io_max);
+	FCD_DUMP("\n");
+
 	for (mon = fcd_monitors; *mon != NULL; ++mon) {
 
 		if ((*mon)->name == NULL)
@@ -166,6 +411,9 @@ void fcd_conf_parse(void)
 	if (raiddisk_schema == NULL)
 		FCD_FATAL("%s\n", cip_last_err(&ctx));
 
+	if (cip_opt_schema_new3(&ctx, freecusd_schema, fcd_conf_opts) == -1)
+		FCD_FATAL("%s\n", cip_last_err(&ctx));
+
 	for (mon = fcd_monitors; *mon != NULL; ++mon) {
 
 		ret = fcd_conf_per_mon(&ctx, *mon, freecusd_schema,
@@ -1,5 +1,5 @@
 /*
- * Copyright 2014 Ian Pilcher <arequipeno@gmail.com>
+ * Copyright 2014, 2026 Ian Pilcher <arequipeno@gmail.com>
  *
  * This program is free software.  You can redistribute it or modify it under
  * the terms of version 2 of the GNU General Public License (GPL), as published
@@ -40,6 +40,9 @@ static int fcd_disk_glob_errfn(const char *epath, int eerrno)
  * 0         1         2         3         4         5         6         7   7
  * 0         0         0         0         0         0         0         0   4
  *
+ * The kernel's ATA port ID (the N in "ataN" in kernel messages) is at offset
+ * 40.  (The glob only matches single-digit IDs.)
+ *
  * Port number is read from:
  *
  * /sys/devices/pci0000:00/0000:00:1f.2/ata4/ata_port/ata4/port_no
@@ -50,9 +53,9 @@ static int fcd_disk_glob_errfn(const char *epath, int eerrno)
  */
 
 /*
- * Populates fcd_conf_disks (name and port_no) with disks connected to ports
- * 2-6 of the ICH10R SATA controller.  Returns number of disks detected, which
- * may be 0; -1 on error.
+ * Populates fcd_conf_disks (name, port_no, and ata_id) with disks connected to
+ * ports 2-6 of the ICH10R SATA controller.  Returns number of disks detected,
+ * which may be 0; -1 on error.
  */
 int fcd_disk_detect(void)
 {
@@ -121,6 +124,7 @@ int fcd_disk_detect(void)
 
 		sprintf(fcd_conf_disks[count].name, "/dev/%s", path + 74);
 		fcd_conf_disks[count].port_no = port_no;
+		fcd_conf_disks[count].ata_id = path[40] - '0';
 		++count;
 	}
 
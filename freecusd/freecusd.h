@@ -1,5 +1,5 @@
 /*
- * Copyright 2013-2014, 2016-2017, 2020 Ian Pilcher <arequipeno@gmail.com>
+ * Copyright 2013-2014, 2016-2017, 2020, 2026 Ian Pilcher <arequipeno@gmail.com>
  *
  * This program is free software.  You can redistribute it or modify it under
  * the terms of version 2 of the GNU General Public License (GPL), as published
@@ -213,15 +213,111 @@ struct fcd_monitor {
 	_Bool silent;						/* no front-panel message */
 	uint8_t current_pwm_flags;
 	uint8_t new_pwm_flags;					/* SYNCHRONIZED */
+	time_t updated;						/* SYNCHRONIZED */
 	enum fcd_alert_msg sys_warn;				/* SYNCHRONIZED */
 	enum fcd_alert_msg sys_fail;				/* SYNCHRONIZED */
 	enum fcd_alert_msg disk_alerts[FCD_MAX_DISK_COUNT];	/* SYNCHRONIZED */
 	uint8_t buf[66];					/* SYNCHRONIZED */
 };
 
+/* hwmon chips that we know about */
+enum fcd_hwmon_chip {
+	FCD_HWMON_CORETEMP	= 0,
+	FCD_HWMON_IT87
+};
+#define FCD_HWMON_CHIP_ARRAY_SIZE	(FCD_HWMON_IT87 + 1)
+
+/* Max number of CPU cores with temperature sensors */
+#define FCD_HWMON_MAX_CORES		16
+
+/* Max hwmon channel number (e.g. N in tempN_input) accepted in config file */
+#define FCD_HWMON_MAX_CHANNEL		16
+
+/* Buffer size for a hwmon attribute name - e.g. "temp16_input" */
+#define FCD_HWMON_ATTR_SIZE		(sizeof "temp_input" + 10)
+
+/* Sensor filter - median of the last N samples, smoothed by an EWMA */
+#define FCD_FILTER_MAX_SAMPLES	9
+
+struct fcd_filter {
+	int samples[FCD_FILTER_MAX_SAMPLES];	/* ring buffer */
+	unsigned count;				/* # of valid samples */
+	unsigned next;				/* next ring buffer slot */
+	int value;				/* filtered value */
+	int peak;				/* max raw sample */
+	int trough;				/* min raw sample */
+};
+
+/*
+ * An input buffer for files and child process output, which is kept (and
+ * reused) by its owner.  It grows geometrically, up to max_size bytes
+ * (including the terminating 0).
+ */
+struct fcd_lib_buf {
+	char *data;
+	size_t size;
+	size_t max_size;
+	size_t high_water;	/* largest input read */
+	unsigned grows;		/* # of (re)allocations */
+	unsigned reads;
+	const char *name;
+};
+
+#define FCD_LIB_BUF_INIT(n, max)	{ .name = (n), .max_size = (max) }
+
+/* A child process - see proc.c */
+struct fcd_proc_child {
+	pid_t pid;
+	int pidfd;		/* -1 if pidfds aren't supported */
+};
+
+/* Limits on the contents of /proc/mdstat - see mdstat.c */
+#define FCD_MDSTAT_MAX_ARRAYS	64
+#define FCD_MDSTAT_MAX_DEVS	512
+
+/* A member device of an array in /proc/mdstat (not NUL-terminated) */
+struct fcd_mdstat_dev {
+	const char *name;
+	unsigned name_len;
+	unsigned number;
+	char flag;		/* 'W', 'F', 'S', 'R', or 0 */
+};
+
+/* An array in /proc/mdstat; strings point into the buffer that was parsed */
+struct fcd_mdstat_array {
+	const char *name;
+	const char *personality;	/* NULL if not shown */
+	const char *dev_summary;	/* "UU_U"; NULL if not shown */
+	const char *sync_action;	/* "resync", "check", etc.; or NULL */
+	unsigned name_len;
+	unsigned personality_len;
+	unsigned dev_summary_len;
+	unsigned sync_action_len;
+	unsigned first_dev;		/* index into fcd_mdstat.devs */
+	unsigned dev_count;
+	unsigned near_copies;		/* RAID-10 only; otherwise 1 */
+	unsigned far_copies;		/* RAID-10 only; otherwise 1 */
+	unsigned ideal_devs;		/* 0 if not shown */
+	unsigned current_devs;
+	int sync_permille;		/* -1 if not shown */
+	_Bool active;
+	char read_only;			/* 'r' (read-only), 'a' (auto), or 0 */
+};
+
+struct fcd_mdstat {
+	unsigned array_count;
+	unsigned dev_count;
+	struct fcd_mdstat_array arrays[FCD_MDSTAT_MAX_ARRAYS];
+	struct fcd_mdstat_dev devs[FCD_MDSTAT_MAX_DEVS];
+};
+
+/* Max size of monitor-specific state saved for warm restarts */
+#define FCD_STATE_PRIV_SIZE	64
+
 /* Config info about a RAID disk */
 struct fcd_raid_disk {
 	unsigned port_no;
+	unsigned ata_id;		/* kernel's ATA port ID (ataN) */
 	int temps[FCD_CONF_TEMP_ARRAY_SIZE];
 #if 0
 	int temp_warn;
@@ -258,20 +354,48 @@ extern __thread volatile sig_atomic_t fcd_thread_exit_flag;
 /* Signal mask for monitor thread calls to ppoll */
 extern sigset_t fcd_mon_ppoll_sigmask;
 
-/* Signal mask for reaper thread calls to ppoll */
-extern sigset_t fcd_proc_ppoll_sigmask;
 
 /* The monitors */
 extern struct fcd_monitor fcd_loadavg_monitor;
 extern struct fcd_monitor fcd_temp_core_monitor;
 extern struct fcd_monitor fcd_temp_it87_monitor;
 extern struct fcd_monitor fcd_sysfan_monitor;
+extern struct fcd_monitor fcd_throttle_monitor;
 extern struct fcd_monitor fcd_hddtemp_monitor;
 extern struct fcd_monitor fcd_smart_monitor;
 extern struct fcd_monitor fcd_raid_monitor;
+extern struct fcd_monitor fcd_storage_monitor;
+extern struct fcd_monitor fcd_kmsg_monitor;
+extern struct fcd_monitor fcd_sata_monitor;
 extern struct fcd_monitor fcd_pwm_monitor;
+extern struct fcd_monitor fcd_state_monitor;
 extern struct fcd_monitor *fcd_monitors[];
 
+/* Sensor sampling & filtering settings */
+extern int fcd_conf_sample_interval;
+extern int fcd_conf_filter_samples;
+extern int fcd_conf_filter_weight;
+
+/* Child process limits */
+extern int fcd_conf_max_children;
+extern int fcd_conf_max_mon_children;
+
+/* Memory locking & OOM killer settings */
+extern _Bool fcd_conf_lock_memory;
+extern int fcd_conf_oom_score_adj;
+
+/* Scheduling settings */
+extern int fcd_conf_monitor_nice;
+extern _Bool fcd_conf_monitor_sched_idle;
+extern int fcd_conf_helper_nice;
+extern _Bool fcd_conf_helper_sched_idle;
+extern int fcd_conf_helper_io_class;
+extern int fcd_conf_helper_io_priority;
+extern int fcd_conf_cpu_affinity;
+extern _Bool fcd_conf_helper_cgroup;
+extern int fcd_conf_helper_cpu_max;
+extern int fcd_conf_helper_io_max;
+
 /* Number and names of disks to monitor */
 extern unsigned fcd_conf_disk_count;
 extern struct fcd_raid_disk fcd_conf_disks[FCD_MAX_DISK_COUNT];
@@ -295,6 +419,7 @@ extern _Bool fcd_alert_update(enum fcd_alert_msg new, enum fcd_alert_msg *status
 extern void fcd_alert_read_monitor(struct fcd_monitor *mon);
 extern void fcd_alert_leds_close(void);
 extern void fcd_alert_leds_open(void);
+extern void fcd_alert_restore(struct fcd_monitor *mon);
 
 /* Serial port stuff  - tty.c */
 extern int fcd_tty_open(const char *tty);
@@ -305,12 +430,11 @@ extern void fcd_pic_setup_gpio(void);
 extern void fcd_pic_reset(void);
 
 /* Child process stuff - proc.c */
-extern pid_t fcd_proc_fork(const int *pipe_fds);
-extern int fcd_proc_kill(pid_t pid, const int *pipe_fds);
-extern int fcd_proc_wait(int *status, const int *pipe_fds,
+extern pid_t fcd_proc_fork(struct fcd_proc_child *child);
+extern void fcd_proc_thread_exit(void);
+extern int fcd_proc_kill(struct fcd_proc_child *child);
+extern int fcd_proc_wait(struct fcd_proc_child *child, int *status,
 			 struct timespec *timeout);
-extern int fcd_proc_close_pipe(const int *pipe_fds);
-__attribute__((noreturn)) extern void *fcd_proc_fn(void *arg);
 
 /* Utility functions - lib.c */
 extern void fcd_lib_set_mon_status(struct fcd_monitor *mon, const char *buf,
@@ -324,27 +448,56 @@ extern void fcd_lib_set_mon_status2(struct fcd_monitor *const mon,
 				    const int *const disks,
 				    const uint8_t pwm_flags);
 extern int fcd_lib_monitor_sleep(time_t seconds);
+extern void fcd_lib_set_timer_slack(void);
+extern int fcd_lib_tick_timeout(struct timespec *timeout, time_t period);
+extern void fcd_lib_count_wakeup(void);
+extern void fcd_lib_wakeup_report(void);
+extern int fcd_lib_deadline(struct timespec *deadline,
+			    const struct timespec *timeout);
+extern int fcd_lib_remaining(struct timespec *remaining,
+			     const struct timespec *deadline);
 extern ssize_t fcd_lib_read(int fd, void *buf, size_t count,
 			    struct timespec *timeout);
-extern ssize_t fcd_lib_read_all(int fd, char **buf, size_t *buf_size,
-				size_t max_size, struct timespec *timeout);
-extern ssize_t fcd_lib_cmd_output(int *status, char **cmd, char **buf,
-				  size_t *buf_size, size_t max_size,
-				  struct timespec *timeout,
-				  const int *pipe_fds);
-extern int fcd_lib_cmd_status(char **cmd, struct timespec *timeout,
-			      const int *pipe_fds);
+extern ssize_t fcd_lib_read_all(int fd, struct fcd_lib_buf *buf,
+				struct timespec *timeout);
+extern int fcd_lib_buf_prealloc(struct fcd_lib_buf *buf);
+extern void fcd_lib_buf_free(struct fcd_lib_buf *buf);
+#ifdef FCD_MALLOC_CHECK
+extern void fcd_lib_malloc_check(void);
+#endif
+extern ssize_t fcd_lib_cmd_output(int *status, char **cmd,
+				  struct fcd_lib_buf *buf,
+				  struct timespec *timeout);
+extern int fcd_lib_cmd_status(char **cmd, struct timespec *timeout);
 __attribute__((noreturn))
 extern void fcd_lib_fail_and_exit(struct fcd_monitor *mon);
 extern void fcd_lib_fail(struct fcd_monitor *mon);
 __attribute__((noreturn))
-extern void fcd_lib_parent_fail_and_exit(struct fcd_monitor *mon, const int *pipe_fds, char *buf);
+extern void fcd_lib_parent_fail_and_exit(struct fcd_monitor *mon,
+					 struct fcd_lib_buf *buf);
 extern int fcd_lib_disk_index(char c);
 //extern void fcd_lib_disk_mutex_lock(void);
 //extern void fcd_lib_disk_mutex_unlock(void);
 __attribute__((format(printf, 3, 4)))
 extern int fcd_lib_snprintf(char *restrict str, size_t size, const char *restrict format, ...);
 extern void fcd_lib_dump_temp_cfg(const int *const cfg);
+extern time_t fcd_lib_boottime(void);
+extern ssize_t fcd_lib_read_attr(int fd, const char *name, char *buf,
+				 size_t size);
+extern const char *fcd_lib_parse_int(const char *s, int *value);
+extern const char *fcd_lib_parse_fixed(const char *s, unsigned decimals,
+				       int *value);
+extern int fcd_lib_read_int(int fd, const char *name, int *value);
+extern struct fcd_lib_batch *fcd_lib_batch_new(const char *name,
+						const int *fds,
+						const char *const *names,
+						unsigned count);
+extern void fcd_lib_batch_free(struct fcd_lib_batch *batch);
+extern void fcd_lib_batch_disable(struct fcd_lib_batch *batch, unsigned index);
+extern unsigned fcd_lib_batch_read(struct fcd_lib_batch *batch, int *values);
+extern void fcd_lib_filter_init(struct fcd_filter *filter);
+extern int fcd_lib_filter_add(struct fcd_filter *filter, int sample);
+extern void fcd_lib_filter_reset_peaks(struct fcd_filter *filter);
 
 /* Config file parsing - conf.c */
 extern void fcd_conf_parse(void);
@@ -365,6 +518,44 @@ extern int fcd_disk_detect(void);
 extern void fcd_pwm_update(struct fcd_monitor *mon);
 extern void fcd_pwm_init(void);
 extern void fcd_pwm_fini(void);
+extern enum fcd_pwm_state fcd_pwm_state(void);
+
+/* hwmon discovery - hwmon.c */
+extern void fcd_hwmon_scan(void);
+extern void fcd_hwmon_close(void);
+extern int fcd_hwmon_open(enum fcd_hwmon_chip chip, const char *attr,
+			  int flags);
+extern int fcd_hwmon_core_temps(int *fds, unsigned *cores, unsigned max);
+extern int fcd_hwmon_channel_cb(cip_err_ctx *ctx, const cip_ini_value *value,
+				const cip_ini_sect *sect,
+				const cip_ini_file *file,
+				void *post_parse_data);
+
+/* Warm restart state - state.c */
+extern void fcd_state_load(void);
+extern void fcd_state_save(void);
+extern int fcd_state_pwm_state(void);
+extern void fcd_state_set_priv(const struct fcd_monitor *mon, const void *data,
+			       size_t size);
+extern time_t fcd_state_get_priv(const struct fcd_monitor *mon, void *data,
+				 size_t size);
+
+/* Scheduling - sched.c */
+extern void fcd_sched_init(void);
+extern void fcd_sched_fini(void);
+extern void fcd_sched_monitor(void);
+extern void fcd_sched_child(void);
+
+/* /proc/mdstat tokenizer - mdstat.c */
+extern int fcd_mdstat_parse(struct fcd_mdstat *mdstat, const char *buf);
+
+#ifdef FCD_BPF
+/* Block I/O latency histograms - bpf.c */
+#define FCD_BPF_HIST_SLOTS	32	/* log2 of latency in microseconds */
+extern int fcd_bpf_init(void);
+extern int fcd_bpf_read(unsigned dev, uint64_t *counts);
+extern void fcd_bpf_fini(void);
+#endif
 
 /* Low level logging (for libselinux callback) */
 extern void fcd_err_vmsg(int priority, const char *format, va_list ap);
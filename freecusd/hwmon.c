@@ -0,0 +1,368 @@
+/*
+ * Copyright 2026 Ian Pilcher <arequipeno@gmail.com>
+ *
+ * This program is free software.  You can redistribute it or modify it under
+ * the terms of version 2 of the GNU General Public License (GPL), as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY -- without even the implied warranty of MERCHANTIBILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the text of the GPL for more details.
+ *
+ * Version 2 of the GNU General Public License is available at:
+ *
+ *   http://www.gnu.org/licenses/old-licenses/gpl-2.0.html
+ */
+
+/*
+ * hwmon discovery.  /sys/class/hwmon is scanned once (by the main thread,
+ * before any monitor threads are started), and a directory file descriptor is
+ * kept open for each chip that we're interested in.  Monitors then open the
+ * attributes that they need relative to those descriptors.
+ */
+
+#include "freecusd.h"
+
+#include <sys/types.h>
+#include <dirent.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#define FCD_HWMON_CLASS_DIR	"/sys/class/hwmon"
+
+/* /sys/class/hwmon/hwmonNNN/device */
+#define FCD_HWMON_PATH_SIZE	(sizeof FCD_HWMON_CLASS_DIR "/hwmon/device" + 10)
+
+/* Chip names are short (e.g. "coretemp", "it8728") */
+#define FCD_HWMON_NAME_SIZE	32
+
+struct fcd_hwmon_chip_info {
+	const char *match;	/* chip name (or prefix) to match */
+	size_t match_len;	/* 0 for exact match */
+	int dirfd;
+	char path[FCD_HWMON_PATH_SIZE];
+};
+
+static struct fcd_hwmon_chip_info fcd_hwmon_chips[FCD_HWMON_CHIP_ARRAY_SIZE] = {
+	[FCD_HWMON_CORETEMP] = {
+		.match		= "coretemp",
+		.match_len	= 0,
+		.dirfd		= -1,
+	},
+	[FCD_HWMON_IT87] = {
+		.match		= "it87",		/* it8728, etc. */
+		.match_len	= sizeof "it87" - 1,
+		.dirfd		= -1,
+	},
+};
+
+/*
+ * Configuration callback for hwmon channel numbers (e.g. sysfan_rpm_channel)
+ */
+int fcd_hwmon_channel_cb(cip_err_ctx *ctx, const cip_ini_value *value,
+			 const cip_ini_sect *sect __attribute__((unused)),
+			 const cip_ini_file *file __attribute__((unused)),
+			 void *post_parse_data)
+{
+	int channel;
+
+	memcpy(&channel, value->value, sizeof channel);
+
+	if (channel < 1 || channel > FCD_HWMON_MAX_CHANNEL) {
+		cip_err(ctx, "Invalid hwmon channel (%d); must be 1 - %d",
+			channel, FCD_HWMON_MAX_CHANNEL);
+		return -1;
+	}
+
+	*(int *)post_parse_data = channel;
+
+	return 0;
+}
+
+/*
+ * Reads a (short) sysfs attribute relative to dirfd.  Strips any trailing
+ * newline.  Returns 0 on success, -1 if the attribute doesn't exist, or -2 on
+ * any other error.
+ */
+static int fcd_hwmon_read_str(const int dirfd, const char *const attr,
+			      char *const buf, const size_t size)
+{
+	ssize_t ret;
+	int fd;
+
+	fd = openat(dirfd, attr, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		if (errno == ENOENT)
+			return -1;
+		FCD_PERROR(attr);
+		return -2;
+	}
+
+	ret = read(fd, buf, size - 1);
+	if (ret == -1)
+		FCD_PERROR(attr);
+
+	if (close(fd) == -1)
+		FCD_PERROR(attr);
+
+	if (ret == -1)
+		return -2;
+
+	buf[ret] = 0;
+	if (ret > 0 && buf[ret - 1] == '\n')
+		buf[ret - 1] = 0;
+
+	return 0;
+}
+
+/*
+ * Checks whether a hwmon class device is a chip that we're interested in.
+ * Older kernels put the name (and all of the sensor attributes) in the
+ * underlying device's directory, rather than the hwmon directory, so check
+ * there as well.
+ */
+static void fcd_hwmon_check_dev(const int class_fd, const char *const dev)
+{
+	char name[FCD_HWMON_NAME_SIZE], path[FCD_HWMON_PATH_SIZE];
+	struct fcd_hwmon_chip_info *chip;
+	int dirfd, ret;
+	unsigned i;
+
+	if (snprintf(path, sizeof path, "%s/%s", FCD_HWMON_CLASS_DIR, dev)
+						>= (int)sizeof path) {
+		FCD_WARN("hwmon device name too long: %s\n", dev);
+		return;
+	}
+
+	dirfd = openat(class_fd, dev, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dirfd == -1) {
+		FCD_PERROR(path);
+		return;
+	}
+
+	ret = fcd_hwmon_read_str(dirfd, "name", name, sizeof name);
+	if (ret == -1) {
+
+		if (close(dirfd) == -1)
+			FCD_PERROR(path);
+
+		strcat(path, "/device");
+
+		dirfd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (dirfd == -1) {
+			FCD_PERROR(path);
+			return;
+		}
+
+		ret = fcd_hwmon_read_str(dirfd, "name", name, sizeof name);
+	}
+
+	if (ret != 0)
+		goto close_dirfd;
+
+	for (i = 0; i < FCD_HWMON_CHIP_ARRAY_SIZE; ++i) {
+
+		chip = &fcd_hwmon_chips[i];
+
+		if (chip->match_len == 0) {
+			if (strcmp(name, chip->match) != 0)
+				continue;
+		}
+		else if (strncmp(name, chip->match, chip->match_len) != 0) {
+			continue;
+		}
+
+		if (chip->dirfd != -1) {
+			FCD_WARN("Ignoring additional %s chip: %s\n",
+				 name, path);
+			break;
+		}
+
+		FCD_INFO("Found %s chip: %s\n", name, path);
+		chip->dirfd = dirfd;
+		strcpy(chip->path, path);
+		return;
+	}
+
+close_dirfd:
+	if (close(dirfd) == -1)
+		FCD_PERROR(path);
+}
+
+/*
+ * Scans /sys/class/hwmon for the chips in fcd_hwmon_chips.  Must be called
+ * before any monitor threads are started.  Missing chips are not an error
+ * here; monitors that need them will fail when they try to open attributes.
+ */
+void fcd_hwmon_scan(void)
+{
+	struct dirent *dent;
+	int class_fd;
+	DIR *dir;
+
+	dir = opendir(FCD_HWMON_CLASS_DIR);
+	if (dir == NULL) {
+		FCD_PERROR(FCD_HWMON_CLASS_DIR);
+		return;
+	}
+
+	class_fd = dirfd(dir);
+
+	while (errno = 0, (dent = readdir(dir)) != NULL) {
+
+		if (strncmp(dent->d_name, "hwmon", sizeof "hwmon" - 1) != 0)
+			continue;
+
+		fcd_hwmon_check_dev(class_fd, dent->d_name);
+	}
+
+	if (errno != 0)
+		FCD_PERROR(FCD_HWMON_CLASS_DIR);
+
+	if (closedir(dir) == -1)
+		FCD_PERROR(FCD_HWMON_CLASS_DIR);
+}
+
+void fcd_hwmon_close(void)
+{
+	unsigned i;
+
+	for (i = 0; i < FCD_HWMON_CHIP_ARRAY_SIZE; ++i) {
+
+		if (fcd_hwmon_chips[i].dirfd == -1)
+			continue;
+
+		if (close(fcd_hwmon_chips[i].dirfd) == -1)
+			FCD_PERROR(fcd_hwmon_chips[i].path);
+
+		fcd_hwmon_chips[i].dirfd = -1;
+	}
+}
+
+/*
+ * Opens an attribute (e.g. "temp1_input") of a chip.  Returns the file
+ * descriptor, or -1 on error (including chip not found).
+ */
+int fcd_hwmon_open(const enum fcd_hwmon_chip chip, const char *const attr,
+		   const int flags)
+{
+	const struct fcd_hwmon_chip_info *const info = &fcd_hwmon_chips[chip];
+	int fd;
+
+	if (info->dirfd == -1) {
+		FCD_WARN("No %s hwmon chip found\n", info->match);
+		return -1;
+	}
+
+	fd = openat(info->dirfd, attr, flags | O_CLOEXEC);
+	if (fd == -1)
+		FCD_ERR("%s/%s: %m\n", info->path, attr);
+
+	return fd;
+}
+
+/*
+ * Finds all of the CPU core temperature inputs ("Core N" labels) of the
+ * coretemp chip.  Core numbers and (open) input file descriptors are stored in
+ * cores and fds, sorted by core number.  Returns the number of cores found
+ * (which may be 0), or -1 on error.
+ */
+int fcd_hwmon_core_temps(int *const fds, unsigned *const cores,
+			 const unsigned max)
+{
+	const struct fcd_hwmon_chip_info *const info =
+					&fcd_hwmon_chips[FCD_HWMON_CORETEMP];
+	char label[FCD_HWMON_NAME_SIZE], attr[FCD_HWMON_ATTR_SIZE];
+	unsigned count, index, core, i;
+	struct dirent *dent;
+	int fd, dup_fd, n;
+	DIR *dir;
+	char *end;
+
+	if (info->dirfd == -1) {
+		FCD_WARN("No coretemp hwmon chip found\n");
+		return -1;
+	}
+
+	/* fdopendir takes ownership of its file descriptor */
+	dup_fd = fcntl(info->dirfd, F_DUPFD_CLOEXEC, 0);
+	if (dup_fd == -1) {
+		FCD_PERROR("fcntl");
+		return -1;
+	}
+
+	dir = fdopendir(dup_fd);
+	if (dir == NULL) {
+		FCD_PERROR(info->path);
+		if (close(dup_fd) == -1)
+			FCD_PERROR("close");
+		return -1;
+	}
+
+	/* Duplicated fd shares its file offset with the original */
+	rewinddir(dir);
+
+	count = 0;
+
+	while ((dent = readdir(dir)) != NULL) {
+
+		if (sscanf(dent->d_name, "temp%u%n", &index, &n) != 1 ||
+				strcmp(dent->d_name + n, "_label") != 0)
+			continue;
+
+		if (fcd_hwmon_read_str(info->dirfd, dent->d_name, label,
+				       sizeof label) != 0)
+			continue;
+
+		if (strncmp(label, "Core ", sizeof "Core " - 1) != 0)
+			continue;
+
+		errno = 0;
+		core = strtoul(label + sizeof "Core " - 1, &end, 10);
+		if (errno != 0 || *end != 0 || core > UINT_MAX / 2)
+			continue;
+
+		if (count == max) {
+			FCD_WARN("Ignoring CPU core %u (too many cores)\n",
+				 core);
+			continue;
+		}
+
+		sprintf(attr, "temp%u_input", index);
+
+		fd = openat(info->dirfd, attr, O_RDONLY | O_CLOEXEC);
+		if (fd == -1) {
+			FCD_ERR("%s/%s: %m\n", info->path, attr);
+			goto error;
+		}
+
+		/* Insertion sort by core number */
+
+		for (i = count; i > 0 && cores[i - 1] > core; --i) {
+			cores[i] = cores[i - 1];
+			fds[i] = fds[i - 1];
+		}
+
+		cores[i] = core;
+		fds[i] = fd;
+		++count;
+	}
+
+	if (closedir(dir) == -1)
+		FCD_PERROR(info->path);
+
+	return count;
+
+error:
+	while (count > 0) {
+		if (close(fds[--count]) == -1)
+			FCD_PERROR("close");
+	}
+
+	if (closedir(dir) == -1)
+		FCD_PERROR(info->path);
+
+	return -1;
+}
@@ -0,0 +1,396 @@
+/*
+ * Copyright 2026 Ian Pilcher <arequipeno@gmail.com>
+ *
+ * This program is free software.  You can redistribute it or modify it under
+ * the terms of version 2 of the GNU General Public License (GPL), as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY -- without even the implied warranty of MERCHANTIBILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the text of the GPL for more details.
+ *
+ * Version 2 of the GNU General Public License is available at:
+ *
+ *   http://www.gnu.org/licenses/old-licenses/gpl-2.0.html
+ */
+
+/*
+ * ATA error monitor.  Reads kernel log records from /dev/kmsg as they are
+ * written and counts the ATA errors and link resets of each RAID disk.  These
+ * show up long before S.M.A.R.T. or md notice anything (if they ever do).
+ * Each read of /dev/kmsg returns a single record, which looks like this (see
+ * Documentation/ABI/testing/dev-kmsg in the kernel sources):
+ *
+ *   3,1234,5678901234,-;ata4.00: exception Emask 0x10 SAct 0x0 SErr ...
+ *
+ * The message may be followed by continuation lines (" KEY=value"), which are
+ * ignored.  The "ataN" in the message is the kernel's ID of the port; see
+ * fcd_disk_detect().
+ *
+ * An error (and the link reset that usually follows it) is counted once -- on
+ * its "exception Emask" line.  A link reset that doesn't follow an error (e.g.
+ * a hard reset after a link drop) is counted separately.
+ */
+
+#include "freecusd.h"
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+
+/* Max # of events remembered per disk (and max value of ata_error_warn) */
+#define FCD_KMSG_MAX_EVENTS	16
+
+/* A link reset this soon (seconds) after an error is part of the error */
+#define FCD_KMSG_EPISODE	10
+
+/* Seconds between display updates while any disk has recent events */
+#define FCD_KMSG_INTERVAL	30
+
+/* Max size of a /dev/kmsg record (the kernel uses 1024 + prefix) */
+#define FCD_KMSG_RECORD_SIZE	8192
+
+struct fcd_kmsg_disk {
+	time_t events[FCD_KMSG_MAX_EVENTS];	/* ring buffer */
+	unsigned next;				/* next slot in events */
+	time_t last_error;			/* 0 = none */
+	_Bool alert;
+};
+
+static struct fcd_kmsg_disk fcd_kmsg_disks[FCD_MAX_DISK_COUNT];
+
+/* Alert if a disk has this many errors & resets in the window; 0 = never */
+static int fcd_kmsg_warn = 3;		/* ata_error_warn */
+
+/* Window (seconds) */
+static int fcd_kmsg_window = 3600;	/* ata_error_window */
+
+static int fcd_kmsg_cb();
+
+static const cip_opt_info fcd_kmsg_opts[] = {
+	{
+		.name			= "ata_error_warn",
+		.type			= CIP_OPT_TYPE_INT,
+		.post_parse_fn		= fcd_kmsg_cb,
+		.post_parse_data	= &fcd_kmsg_warn,
+	},
+	{
+		.name			= "ata_error_window",
+		.type			= CIP_OPT_TYPE_INT,
+		.post_parse_fn		= fcd_kmsg_cb,
+		.post_parse_data	= &fcd_kmsg_window,
+	},
+	{	.name			= NULL		}
+};
+
+/*
+ * Configuration callback for the error threshold and window
+ */
+static int fcd_kmsg_cb(cip_err_ctx *ctx, const cip_ini_value *value,
+		       const cip_ini_sect *sect __attribute__((unused)),
+		       const cip_ini_file *file __attribute__((unused)),
+		       void *post_parse_data)
+{
+	int i;
+
+	memcpy(&i, value->value, sizeof i);
+
+	if (post_parse_data == &fcd_kmsg_warn &&
+			(i < 0 || i > FCD_KMSG_MAX_EVENTS)) {
+		cip_err(ctx, "Invalid ATA error threshold (0 - %d): %d",
+			FCD_KMSG_MAX_EVENTS, i);
+		return -1;
+	}
+
+	if (post_parse_data == &fcd_kmsg_window && (i < 60 || i > 86400)) {
+		cip_err(ctx, "Invalid ATA error window (60 - 86400): %d", i);
+		return -1;
+	}
+
+	*(int *)post_parse_data = i;
+
+	return 0;
+}
+
+/* Returns the number of a disk's events within the window */
+static unsigned fcd_kmsg_count(const struct fcd_kmsg_disk *const disk,
+			       const time_t now)
+{
+	unsigned i, count;
+
+	for (count = 0, i = 0; i < FCD_KMSG_MAX_EVENTS; ++i) {
+		if (disk->events[i] != 0 &&
+				now - disk->events[i] < fcd_kmsg_window)
+			++count;
+	}
+
+	return count;
+}
+
+static void fcd_kmsg_event(const unsigned d, const time_t now,
+			   const char *const msg, const int len)
+{
+	struct fcd_kmsg_disk *const disk = &fcd_kmsg_disks[d];
+
+	/* 0 means an unused slot */
+	disk->events[disk->next] = (now == 0) ? 1 : now;
+	disk->next = (disk->next + 1) % FCD_KMSG_MAX_EVENTS;
+
+	FCD_INFO("%s: %.*s\n", fcd_conf_disks[d].name, len, msg);
+}
+
+/*
+ * Parses the message of a /dev/kmsg record -- up to the first newline.  Only
+ * messages of the form "ataN: ..." or "ataN.MM: ..." are of interest.
+ */
+static void fcd_kmsg_parse(const char *const msg, const int len,
+			   const time_t now)
+{
+	const char *c, *end;
+	unsigned id, d;
+
+	if (len < 6 || memcmp(msg, "ata", 3) != 0)
+		return;
+
+	end = msg + len;
+
+	for (id = 0, c = msg + 3; c < end && *c >= '0' && *c <= '9'; ++c)
+		id = id * 10 + (*c - '0');
+
+	if (c == msg + 3)
+		return;
+
+	if (c < end && *c == '.') {
+		while (++c < end && *c >= '0' && *c <= '9');
+	}
+
+	if (c >= end || *c != ':')
+		return;
+
+	for (d = 0; d < fcd_conf_disk_count; ++d) {
+		if (fcd_conf_disks[d].ata_id == id)
+			break;
+	}
+
+	if (d == fcd_conf_disk_count)
+		return;
+
+	/* The message isn't NUL-terminated */
+	if (memmem(c, end - c, "exception Emask", 15) != NULL) {
+		fcd_kmsg_disks[d].last_error = now;
+		fcd_kmsg_event(d, now, msg, len);
+	}
+	else if (memmem(c, end - c, "resetting link", 14) != NULL &&
+			(fcd_kmsg_disks[d].last_error == 0 ||
+			 now - fcd_kmsg_disks[d].last_error >
+							FCD_KMSG_EPISODE)) {
+		fcd_kmsg_event(d, now, msg, len);
+	}
+}
+
+/*
+ * Reads all available records from /dev/kmsg.  Returns 0 on success, -1 on
+ * error.
+ */
+static int fcd_kmsg_read(const int fd)
+{
+	static char record[FCD_KMSG_RECORD_SIZE];
+	const char *msg, *end;
+	ssize_t ret;
+	time_t now;
+
+	now = fcd_lib_boottime();
+
+	while (1) {
+
+		ret = read(fd, record, sizeof record - 1);
+		if (ret == -1) {
+
+			if (errno == EAGAIN)
+				return 0;
+
+			/* Records were overwritten before they were read */
+			if (errno == EPIPE) {
+				FCD_DEBUG("Missed kernel log records\n");
+				continue;
+			}
+
+			if (errno == EINTR)
+				continue;
+
+			FCD_PERROR("/dev/kmsg");
+			return -1;
+		}
+
+		record[ret] = 0;
+
+		msg = strchr(record, ';');
+		if (msg == NULL)
+			continue;
+
+		++msg;
+
+		end = strchr(msg, '\n');
+		if (end == NULL)
+			end = record + ret;
+
+		fcd_kmsg_parse(msg, end - msg, now);
+	}
+}
+
+/*
+ * Formats the LCD display -- the number of recent events of each disk -- and
+ * sets disks[] for disks with too many.  Returns the number of such disks.
+ * Sets *recent if any disk has events in the window.
+ */
+static int fcd_kmsg_status(char *const buf, int *const disks,
+			   _Bool *const recent)
+{
+	struct fcd_kmsg_disk *disk;
+	unsigned d, count;
+	time_t now;
+	int warn;
+
+	now = fcd_lib_boottime();
+	memset(buf, ' ', 21);
+	*recent = 0;
+
+	for (warn = 0, d = 0; d < fcd_conf_disk_count; ++d) {
+
+		disk = &fcd_kmsg_disks[d];
+		count = fcd_kmsg_count(disk, now);
+
+		if (count > 0)
+			*recent = 1;
+
+		/* "a0  b0  c3  d0  e0  " */
+		if (fcd_lib_snprintf(buf + 4 * d, 5, "%c%-3u",
+				fcd_conf_disks[d].name[FCD_DISK_NAME_SIZE - 2],
+				count) < 0)
+			return -1;
+
+		disks[d] = (fcd_kmsg_warn != 0 &&
+					count >= (unsigned)fcd_kmsg_warn);
+
+		if (disks[d] && !disk->alert) {
+			FCD_WARN("%s: %u ATA errors/resets in %d seconds\n",
+				 fcd_conf_disks[d].name, count,
+				 fcd_kmsg_window);
+		}
+
+		disk->alert = disks[d];
+		warn += disks[d];
+	}
+
+	return warn;
+}
+
+/*
+ * Waits for new kernel log records.  If any disk has recent events, also
+ * wakes up periodically, so that events that leave the window are dropped
+ * from the display.  Returns the thread-local value of fcd_thread_exit_flag
+ * (or -1 on error).
+ */
+static int fcd_kmsg_wait(const int fd, const _Bool recent)
+{
+	struct timespec ts, *timeout;
+	struct pollfd pfd;
+
+	if (recent) {
+		if (fcd_lib_tick_timeout(&ts, FCD_KMSG_INTERVAL) == -1)
+			return -1;
+		timeout = &ts;
+	}
+	else {
+		timeout = NULL;
+	}
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+
+	if (ppoll(&pfd, 1, timeout, &fcd_mon_ppoll_sigmask) == -1) {
+		if (errno != EINTR) {
+			FCD_PERROR("ppoll");
+			return -1;
+		}
+	}
+	else {
+		fcd_lib_count_wakeup();
+	}
+
+	return fcd_thread_exit_flag;
+}
+
+__attribute__((noreturn))
+static void fcd_kmsg_close_and_disable(const int fd,
+				       struct fcd_monitor *const mon)
+{
+	if (close(fd) == -1)
+		FCD_PERROR("/dev/kmsg");
+	fcd_lib_fail_and_exit(mon);
+}
+
+__attribute__((noreturn))
+static void *fcd_kmsg_fn(void *arg)
+{
+	static const char path[] = "/dev/kmsg";
+	int fd, ret, warn, disks[FCD_MAX_DISK_COUNT];
+	struct fcd_monitor *mon = arg;
+	char buf[21];
+	_Bool recent;
+
+	fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+	if (fd == -1) {
+		FCD_PERROR(path);
+		fcd_lib_fail_and_exit(mon);
+	}
+
+	/* Only new messages; don't count errors from before freecusd started */
+	if (lseek(fd, 0, SEEK_END) == -1) {
+		FCD_PERROR(path);
+		fcd_kmsg_close_and_disable(fd, mon);
+	}
+
+	do {
+		if (fcd_kmsg_read(fd) == -1)
+			fcd_kmsg_close_and_disable(fd, mon);
+
+		memset(disks, 0, sizeof disks);
+
+		warn = fcd_kmsg_status(buf, disks, &recent);
+		if (warn < 0)
+			fcd_kmsg_close_and_disable(fd, mon);
+
+		fcd_lib_set_mon_status(mon, buf, warn, 0, disks, 0);
+
+		ret = fcd_kmsg_wait(fd, recent);
+		if (ret == -1)
+			fcd_kmsg_close_and_disable(fd, mon);
+
+	} while (ret == 0);
+
+	if (close(fd) == -1)
+		FCD_PERROR(path);
+
+	pthread_exit(NULL);
+}
+
+static void fcd_kmsg_dump_cfg(void)
+{
+	FCD_DUMP("\terror threshold: %d\n", fcd_kmsg_warn);
+	FCD_DUMP("\terror window: %d seconds\n", fcd_kmsg_window);
+}
+
+struct fcd_monitor fcd_kmsg_monitor = {
+	.mutex			= PTHREAD_MUTEX_INITIALIZER,
+	.name			= "ATA error",
+	.monitor_fn		= fcd_kmsg_fn,
+	.cfg_dump_fn		= fcd_kmsg_dump_cfg,
+	.buf			= "....."
+				  "ATA ERRORS          "
+				  "                    ",
+	.enabled		= true,
+	.enabled_opt_name	= "enable_ata_error_monitor",
+	.freecusd_opts		= fcd_kmsg_opts,
+};
@@ -1,5 +1,5 @@
 /*
- * Copyright 2013-2014, 2016-2017, 2020 Ian Pilcher <arequipeno@gmail.com>
+ * Copyright 2013-2014, 2016-2017, 2020, 2026 Ian Pilcher <arequipeno@gmail.com>
  *
  * This program is free software.  You can redistribute it or modify it under
  * the terms of version 2 of the GNU General Public License (GPL), as published
@@ -16,22 +16,137 @@
 
 #include "freecusd.h"
 
-#include <sys/wait.h>
+#include <sys/prctl.h>
 #include <string.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <time.h>
 #include <poll.h>
 #include <stdarg.h>
+#include <limits.h>
+#include <stdlib.h>
 
-#define FCD_LIB_BUF_CHUNK	2000
+#ifdef FCD_IO_URING
+#include <liburing.h>
+#endif
+
+/* Initial size of an input buffer; it doubles each time it fills */
+#define FCD_LIB_BUF_MIN		512
 
 sigset_t fcd_mon_ppoll_sigmask;
 
 /*
- * Sleeps for the specified number of seconds, unless interrupted by a signal
- * (SIGUSR1).  Returns the thread-local value of fcd_thread_exit_flag (or -1 on
- * error).
+ * All periodic sleeps (by the monitor threads and by the main thread) end on
+ * a shared tick -- a multiple of the sleep period on the monotonic clock -- so
+ * threads with the same (or harmonic) periods all wake up at the same moment.
+ * Each thread also sets a generous timer slack, which lets the kernel merge
+ * their timers into a single wakeup.
+ */
+#define FCD_LIB_TIMER_SLACK_NS	50000000L	/* 50 ms */
+
+/* Wakeup counters; see fcd_lib_count_wakeup() */
+static unsigned long fcd_lib_wakeups;
+static unsigned long fcd_lib_distinct_wakeups;
+static int64_t fcd_lib_last_wakeup;
+
+/*
+ * Sets the timer slack of the calling thread
+ */
+void fcd_lib_set_timer_slack(void)
+{
+	if (prctl(PR_SET_TIMERSLACK, FCD_LIB_TIMER_SLACK_NS, 0, 0, 0) == -1)
+		FCD_PERROR("prctl");
+}
+
+/*
+ * Calculates the time until the next multiple of period seconds on the
+ * monotonic clock.  Returns 0 on success or -1 on error.
+ */
+int fcd_lib_tick_timeout(struct timespec *const timeout, const time_t period)
+{
+	struct timespec now;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &now) == -1) {
+		FCD_PERROR("clock_gettime");
+		return -1;
+	}
+
+	timeout->tv_sec = period - 1 - now.tv_sec % period;
+	timeout->tv_nsec = 1000000000L - now.tv_nsec;
+
+	if (timeout->tv_nsec == 1000000000L) {
+		timeout->tv_nsec = 0;
+		++(timeout->tv_sec);
+	}
+
+	return 0;
+}
+
+/*
+ * Called by each thread after a periodic sleep.  A wakeup is "distinct" if it
+ * happens more than FCD_LIB_TIMER_SLACK_NS after the previous (distinct)
+ * wakeup of any thread -- i.e. it wasn't coalesced with another thread's
+ * wakeup.
+ */
+void fcd_lib_count_wakeup(void)
+{
+	struct timespec now;
+	int64_t ns, last;
+
+	__atomic_add_fetch(&fcd_lib_wakeups, 1, __ATOMIC_RELAXED);
+
+	if (clock_gettime(CLOCK_MONOTONIC, &now) == -1) {
+		FCD_PERROR("clock_gettime");
+		return;
+	}
+
+	ns = (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+	last = __atomic_load_n(&fcd_lib_last_wakeup, __ATOMIC_RELAXED);
+
+	if (ns - last > FCD_LIB_TIMER_SLACK_NS &&
+			__atomic_compare_exchange_n(&fcd_lib_last_wakeup, &last,
+						    ns, 0, __ATOMIC_RELAXED,
+						    __ATOMIC_RELAXED)) {
+		__atomic_add_fetch(&fcd_lib_distinct_wakeups, 1,
+				   __ATOMIC_RELAXED);
+	}
+}
+
+/*
+ * Called by the main thread after each of its wakeups.  If debugging is
+ * enabled, logs the number of wakeups once a minute.
+ */
+void fcd_lib_wakeup_report(void)
+{
+	static unsigned long wakeups, distinct;
+	static time_t next_report;
+	unsigned long w, d;
+	time_t now;
+
+	if (!fcd_err_debug)
+		return;
+
+	now = fcd_lib_boottime();
+	if (now < next_report)
+		return;
+
+	w = __atomic_load_n(&fcd_lib_wakeups, __ATOMIC_RELAXED);
+	d = __atomic_load_n(&fcd_lib_distinct_wakeups, __ATOMIC_RELAXED);
+
+	if (next_report != 0) {
+		FCD_DEBUG("Wakeups in the last minute: %lu (%lu distinct)\n",
+			  w - wakeups, d - distinct);
+	}
+
+	wakeups = w;
+	distinct = d;
+	next_report = now + 60;
+}
+
+/*
+ * Sleeps until the next multiple of the specified number of seconds (see
+ * above), unless interrupted by a signal (SIGUSR1).  Returns the thread-local
+ * value of fcd_thread_exit_flag (or -1 on error).
  *
  * NOTE: Does not check fcd_thread_exit_flag before sleeping (assumes that
  * 	 SIGUSR1 has been blocked).
@@ -40,13 +155,17 @@ int fcd_lib_monitor_sleep(time_t seconds)
 {
 	struct timespec ts;
 
-	ts.tv_sec = seconds;
-	ts.tv_nsec = 0;
-
-	if (ppoll(NULL, 0, &ts, &fcd_mon_ppoll_sigmask) == -1
-						&& errno != EINTR) {
-		FCD_PERROR("ppoll");
+	if (fcd_lib_tick_timeout(&ts, seconds) == -1)
 		return -1;
+
+	if (ppoll(NULL, 0, &ts, &fcd_mon_ppoll_sigmask) == -1) {
+		if (errno != EINTR) {
+			FCD_PERROR("ppoll");
+			return -1;
+		}
+	}
+	else {
+		fcd_lib_count_wakeup();
 	}
 
 	return fcd_thread_exit_flag;
@@ -56,8 +175,8 @@ int fcd_lib_monitor_sleep(time_t seconds)
  * Calculates *deadline, based on current time and timeout.  Returns 0 on
  * success, -1 on error.
  */
-static int fcd_lib_deadline(struct timespec *deadline,
-			    const struct timespec *timeout)
+int fcd_lib_deadline(struct timespec *deadline,
+		     const struct timespec *timeout)
 {
 	struct timespec now;
 
@@ -82,8 +201,8 @@ static int fcd_lib_deadline(struct timespec *deadline,
  * Calculates *remaining time, based on current time and deadline (but "rounds"
  * negative result up to zero).  Returns 0 on success, -1 on error.
  */
-static int fcd_lib_remaining(struct timespec *remaining,
-			     const struct timespec *deadline)
+int fcd_lib_remaining(struct timespec *remaining,
+		      const struct timespec *deadline)
 {
 	struct timespec now;
 
@@ -169,52 +288,96 @@ ssize_t fcd_lib_read(int fd, void *buf, size_t count, struct timespec *timeout)
 }
 
 /*
- * Called as necessary to grow an input buffer.  Returns 0 on success, -1 on
- * error, -4 if max buffer size would be exceeded.
- *
- * NOTE: Buffer size is actually limited to the smallest multiple of
- *	 FCD_LIB_BUF_CHUNK that is greater than or equal to max_size.
+ * Called as necessary to grow an input buffer, doubling its size (but not
+ * beyond its max_size).  Returns 0 on success, -1 on error, -4 if the buffer
+ * is already at its max_size.
  */
-static int fcd_lib_grow_buf(char **buf, size_t *buf_size, size_t max_size)
+static int fcd_lib_grow_buf(struct fcd_lib_buf *const buf)
 {
 	size_t new_size;
-	char *new_buf;
+	char *new_data;
+
+	if (buf->size >= buf->max_size)
+		return -4;
 
-	if (*buf == NULL || *buf_size == 0)
-		new_size = FCD_LIB_BUF_CHUNK;
+	if (buf->size == 0)
+		new_size = FCD_LIB_BUF_MIN;
 	else
-		new_size = *buf_size + FCD_LIB_BUF_CHUNK;
+		new_size = 2 * buf->size;
 
-	/*
-	 * Ensure max_size is a multiple of FCD_LIB_BUF_CHUNK, rounding up if
-	 * necessary
-	 */
-	max_size = ((max_size + FCD_LIB_BUF_CHUNK - 1) / FCD_LIB_BUF_CHUNK)
-						* FCD_LIB_BUF_CHUNK;
+	if (new_size > buf->max_size)
+		new_size = buf->max_size;
 
-	if (new_size > max_size)
-		return -4;
+	new_data = realloc(buf->data, new_size);
+	if (new_data == NULL) {
+		FCD_PERROR("realloc");
+		return -1;
+	}
+
+	buf->data = new_data;
+	buf->size = new_size;
+	++buf->grows;
+
+	FCD_DEBUG("Grew %s buffer to %zu bytes\n", buf->name, new_size);
+
+	return 0;
+}
+
+/*
+ * If memory locking is enabled, allocates the buffer at its maximum size, so
+ * that it will never need to be grown (and all of its pages are locked up
+ * front).  Returns 0 on success or -1 on error.
+ */
+int fcd_lib_buf_prealloc(struct fcd_lib_buf *const buf)
+{
+	char *new_data;
+
+	if (!fcd_conf_lock_memory || buf->size == buf->max_size)
+		return 0;
 
-	new_buf = realloc(*buf, new_size);
-	if (new_buf == NULL) {
+	new_data = realloc(buf->data, buf->max_size);
+	if (new_data == NULL) {
 		FCD_PERROR("realloc");
 		return -1;
 	}
 
-	*buf = new_buf;
-	*buf_size = new_size;
+	/* Touch every page */
+	memset(new_data + buf->size, 0, buf->max_size - buf->size);
+
+	buf->data = new_data;
+	buf->size = buf->max_size;
+	++buf->grows;
 
 	return 0;
 }
 
+/*
+ * Frees an input buffer (logging its statistics if debugging is enabled) and
+ * resets it to its initial (empty) state.
+ */
+void fcd_lib_buf_free(struct fcd_lib_buf *const buf)
+{
+	if (buf->data != NULL) {
+		FCD_DEBUG("%s buffer: %zu bytes allocated, high water mark %zu "
+			  "bytes, %u allocations, %u reads\n", buf->name,
+			  buf->size, buf->high_water, buf->grows, buf->reads);
+	}
+
+	free(buf->data);
+	buf->data = NULL;
+	buf->size = 0;
+}
+
 /*
  * Reads from fd until EOF, timeout, interrupted by signal (SIGUSR1), max buffer
- * size is exceeded or error occurs.  Input buffer is grown as necessary.
- * Updates *timeout with remaining time on successful return (>= 0).  Returns #
- * of bytes read, which may be 0 (-1 = error, -2 = timeout, -3 = interrupted by
- * thread exit signal, -4 max buffer size would be exceeded).
+ * size is exceeded or error occurs.  Input buffer is grown as necessary, and
+ * it is reused by later calls, so a buffer that has grown large enough is
+ * never reallocated.  Updates *timeout with remaining time on successful
+ * return (>= 0).  Returns # of bytes read, which may be 0 (-1 = error, -2 =
+ * timeout, -3 = interrupted by thread exit signal, -4 max buffer size would be
+ * exceeded).
  */
-ssize_t fcd_lib_read_all(int fd, char **buf, size_t *buf_size, size_t max_size,
+ssize_t fcd_lib_read_all(int fd, struct fcd_lib_buf *buf,
 			 struct timespec *timeout)
 {
 	size_t total;
@@ -223,13 +386,13 @@ ssize_t fcd_lib_read_all(int fd, char **buf, size_t *buf_size, size_t max_size,
 	total = 0;
 
 	do {
-		if (total == *buf_size) {
-			ret = fcd_lib_grow_buf(buf, buf_size, max_size);
+		if (total == buf->size) {
+			ret = fcd_lib_grow_buf(buf);
 			if (ret < 0)
 				return ret;	/* -1 or -4 */
 		}
 
-		ret = fcd_lib_read(fd, *buf + total, *buf_size - total,
+		ret = fcd_lib_read(fd, buf->data + total, buf->size - total,
 				   timeout);
 		if (ret < 0)
 			return ret;	/* -1, -2, or -3 */
@@ -239,15 +402,86 @@ ssize_t fcd_lib_read_all(int fd, char **buf, size_t *buf_size, size_t max_size,
 	} while (ret != 0);
 
 	/*
-	 * If the number of bytes read is an exact multiple of FCD_BUF_CHUNK,
-	 * buffer will have been grown immediately before fcd_read returned 0.
+	 * If the number of bytes read exactly fills the buffer, it will have
+	 * been grown immediately before fcd_lib_read returned 0.
 	 */
 
-	(*buf)[total] = 0;
+	buf->data[total] = 0;
+
+	++buf->reads;
+	if (total > buf->high_water)
+		buf->high_water = total;
 
 	return total;
 }
 
+#ifdef FCD_MALLOC_CHECK
+
+/*
+ * Debugging aid for lock_memory.  When freecusd is built with FCD_MALLOC_CHECK,
+ * these wrappers count heap allocations (and remember the caller of the most
+ * recent one).  The main thread calls fcd_lib_malloc_check() after each pass
+ * through the monitors; the first call starts counting, and later calls log
+ * any allocations made since initialization.
+ */
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static _Bool fcd_lib_malloc_armed;
+static unsigned long fcd_lib_malloc_count;
+static void *fcd_lib_malloc_caller;
+
+static void fcd_lib_malloc_count_caller(void *const caller)
+{
+	if (__atomic_load_n(&fcd_lib_malloc_armed, __ATOMIC_RELAXED)) {
+		__atomic_add_fetch(&fcd_lib_malloc_count, 1, __ATOMIC_RELAXED);
+		__atomic_store_n(&fcd_lib_malloc_caller, caller,
+				 __ATOMIC_RELAXED);
+	}
+}
+
+void *malloc(size_t size)
+{
+	fcd_lib_malloc_count_caller(__builtin_return_address(0));
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	fcd_lib_malloc_count_caller(__builtin_return_address(0));
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	fcd_lib_malloc_count_caller(__builtin_return_address(0));
+	return __libc_realloc(ptr, size);
+}
+
+void fcd_lib_malloc_check(void)
+{
+	static unsigned long reported;
+	unsigned long count;
+
+	if (!fcd_lib_malloc_armed) {
+		__atomic_store_n(&fcd_lib_malloc_armed, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	count = __atomic_load_n(&fcd_lib_malloc_count, __ATOMIC_RELAXED);
+	if (count != reported) {
+		FCD_WARN("%lu heap allocations since initialization "
+			 "(most recent from %p)\n", count,
+			 __atomic_load_n(&fcd_lib_malloc_caller,
+					 __ATOMIC_RELAXED));
+		reported = count;
+	}
+}
+
+#endif  /* FCD_MALLOC_CHECK */
+
 /*
  * Mark a monitor as failed
  */
@@ -283,18 +517,16 @@ void fcd_lib_fail_and_exit(struct fcd_monitor *mon)
 }
 
 /*
- * Called by a monitor thread to clean up child process communication resources
- * (reaper thread pipe and buffer) and disable itself when an error occurs.
+ * Called by a monitor thread to free its child process output buffer and
+ * disable itself when an error occurs.
  *
  * Never returns.
- *
- * NOTE: buf may be NULL
  */
 __attribute__((noreturn))
-void fcd_lib_parent_fail_and_exit(struct fcd_monitor *mon, const int *pipe_fds, char *buf)
+void fcd_lib_parent_fail_and_exit(struct fcd_monitor *mon,
+				  struct fcd_lib_buf *buf)
 {
-	free(buf);
-	fcd_proc_close_pipe(pipe_fds);
+	fcd_lib_buf_free(buf);
 	fcd_lib_fail_and_exit(mon);
 }
 
@@ -338,6 +570,7 @@ void fcd_lib_set_mon_status2(struct fcd_monitor *const mon,
 	}
 
 	mon->new_pwm_flags = pwm_flags;
+	mon->updated = fcd_lib_boottime();
 
 	if (disks != NULL) {
 
@@ -423,6 +656,8 @@ static void fcd_lib_cmd_child(int fd, char **cmd)
 		fcd_lib_child_set_cloexec(STDERR_FILENO);
 	}
 
+	fcd_sched_child();
+
 	execv(cmd[0], cmd + 1);
 
 	FCD_CHILD_PABORT("execv");
@@ -433,10 +668,11 @@ static void fcd_lib_cmd_child(int fd, char **cmd)
  * requested (create_output_pipe != 0).  On success, returns read fd of child
  * output pipe (or 0 if create_output_pipe == 0); returns -1 on error.
  */
-static int fcd_lib_cmd_spawn(pid_t *child, char **cmd, const int *reaper_pipe,
+static int fcd_lib_cmd_spawn(struct fcd_proc_child *child, char **cmd,
 			     int create_output_pipe)
 {
 	int output_pipe[2];
+	pid_t pid;
 
 	if (create_output_pipe) {
 
@@ -447,9 +683,8 @@ static int fcd_lib_cmd_spawn(pid_t *child, char **cmd, const int *reaper_pipe,
 		}
 	}
 
-	*child = fcd_proc_fork(reaper_pipe);
-	if (*child == -1) {
-		FCD_PERROR("fork");
+	pid = fcd_proc_fork(child);
+	if (pid == -1) {
 		if (create_output_pipe) {
 			if (close(output_pipe[0]) == -1)
 				FCD_PERROR("close");
@@ -459,7 +694,7 @@ static int fcd_lib_cmd_spawn(pid_t *child, char **cmd, const int *reaper_pipe,
 		return -1;
 	}
 
-	if (*child == 0) {
+	if (pid == 0) {
 		fcd_lib_cmd_child(create_output_pipe ? output_pipe[1] : -1,
 				  cmd);
 	}
@@ -472,7 +707,7 @@ static int fcd_lib_cmd_spawn(pid_t *child, char **cmd, const int *reaper_pipe,
 				FCD_PERROR("close");
 				FCD_ABORT("Failed to close child pipe\n");
 			}
-			fcd_proc_kill(*child, reaper_pipe);
+			fcd_proc_kill(child);
 			return -1;
 		}
 	}
@@ -482,51 +717,43 @@ static int fcd_lib_cmd_spawn(pid_t *child, char **cmd, const int *reaper_pipe,
 
 /*
  * Executes an external program in a child process, reads its output into the
- * buffer at buf (which is grown as necessary, up to max_size bytes), and
+ * buffer at buf (which is grown as necessary, up to its max_size), and
  * stores its exit status (0 - 255) in *status.  Returns the number of bytes
  * read (which may be 0), -1 on error, -2 if the timeout expires, -3 if the
  * thread exit signal is received, or -4 if the maximum buffer size is exceeded.
  * (If necessary, the child process is killed.)
  */
-ssize_t fcd_lib_cmd_output(int *status, char **cmd, char **buf,
-			   size_t *buf_size, size_t max_size,
-			   struct timespec *timeout, const int *pipe_fds)
+ssize_t fcd_lib_cmd_output(int *status, char **cmd, struct fcd_lib_buf *buf,
+			   struct timespec *timeout)
 {
+	struct fcd_proc_child child;
 	ssize_t bytes_read;
 	int ret, fd;
-	pid_t child;
 
-	fd = fcd_lib_cmd_spawn(&child, cmd, pipe_fds, 1);
+	fd = fcd_lib_cmd_spawn(&child, cmd, 1);
 	if (fd == -1)
 		return -1;
 
-	bytes_read = fcd_lib_read_all(fd, buf, buf_size, max_size, timeout);
+	bytes_read = fcd_lib_read_all(fd, buf, timeout);
 	if (bytes_read < 0) {
 		if (close(fd) == -1)
 			FCD_PERROR("close");
-		fcd_proc_kill(child, pipe_fds);
+		fcd_proc_kill(&child);
 		return bytes_read;
 	}
 
 	if (close(fd) == -1) {
 		FCD_PERROR("close");
-		fcd_proc_kill(child, pipe_fds);
+		fcd_proc_kill(&child);
 		return -1;
 	}
 
-	ret = fcd_proc_wait(status, pipe_fds, timeout);
+	ret = fcd_proc_wait(&child, status, timeout);
 	if (ret < 0) {
-		fcd_proc_kill(child, pipe_fds);
+		fcd_proc_kill(&child);
 		return ret;
 	}
 
-	if (!WIFEXITED(*status)) {
-		FCD_WARN("Child process did not terminate normally\n");
-		return -1;
-	}
-
-	*status = WEXITSTATUS(*status);
-
 	return bytes_read;
 }
 
@@ -535,27 +762,21 @@ ssize_t fcd_lib_cmd_output(int *status, char **cmd, char **buf,
  * (0 - 255).  Returns -1 on error, -2 if timeout expires, or -3 if the thread
  * exit signal is received.  (If necessary, the child process is killed.)
  */
-int fcd_lib_cmd_status(char **cmd, struct timespec *timeout,
-		       const int *pipe_fds)
+int fcd_lib_cmd_status(char **cmd, struct timespec *timeout)
 {
+	struct fcd_proc_child child;
 	int status, ret;
-	pid_t child;
 
-	if (fcd_lib_cmd_spawn(&child, cmd, pipe_fds, 0) == -1)
+	if (fcd_lib_cmd_spawn(&child, cmd, 0) == -1)
 		return -1;
 
-	ret = fcd_proc_wait(&status, pipe_fds, timeout);
+	ret = fcd_proc_wait(&child, &status, timeout);
 	if (ret < 0) {
-		fcd_proc_kill(child, pipe_fds);
+		fcd_proc_kill(&child);
 		return ret;
 	}
 
-	if (!WIFEXITED(status)) {
-		FCD_WARN("Child process did not terminate normally\n");
-		return -1;
-	}
-
-	return WEXITSTATUS(status);
+	return status;
 }
 
 /*
@@ -636,3 +857,521 @@ void fcd_lib_dump_temp_cfg(const int *const cfg)
 	FCD_DUMP("\t\tfan high on: %d\n", cfg[FCD_CONF_TEMP_FAN_HIGH_ON]);
 	FCD_DUMP("\t\tfan high hysteresis: %d\n", cfg[FCD_CONF_TEMP_FAN_HIGH_HYST]);
 }
+
+/*
+ * Returns the number of seconds since boot (including time spent suspended).
+ * Unlike CLOCK_MONOTONIC_COARSE, which is used for timeouts, the result is
+ * meaningful across daemon restarts.
+ */
+time_t fcd_lib_boottime(void)
+{
+	struct timespec now;
+
+	if (clock_gettime(CLOCK_BOOTTIME, &now) == -1)
+		FCD_PABORT("clock_gettime");
+
+	return now.tv_sec;
+}
+
+void fcd_lib_filter_init(struct fcd_filter *const filter)
+{
+	filter->count = 0;
+	filter->next = 0;
+	fcd_lib_filter_reset_peaks(filter);
+}
+
+/*
+ * Starts a new peak/trough recording period
+ */
+void fcd_lib_filter_reset_peaks(struct fcd_filter *const filter)
+{
+	filter->peak = INT_MIN;
+	filter->trough = INT_MAX;
+}
+
+/*
+ * Adds a raw sample to a sensor filter and returns the new filtered value.
+ * The median of the last fcd_conf_filter_samples samples rejects isolated
+ * bad readings; the EWMA (fcd_conf_filter_weight percent of each new median)
+ * smooths what's left.  With the default settings (1 sample, 100%), the
+ * filtered value is simply the raw sample.
+ */
+int fcd_lib_filter_add(struct fcd_filter *const filter, const int sample)
+{
+	int sorted[FCD_FILTER_MAX_SAMPLES], median, s;
+	unsigned i, j;
+
+	filter->samples[filter->next] = sample;
+	filter->next = (filter->next + 1) % fcd_conf_filter_samples;
+	if (filter->count < (unsigned)fcd_conf_filter_samples)
+		++filter->count;
+
+	if (sample > filter->peak)
+		filter->peak = sample;
+	if (sample < filter->trough)
+		filter->trough = sample;
+
+	/* Insertion sort; N is tiny */
+
+	for (i = 0; i < filter->count; ++i) {
+
+		s = filter->samples[i];
+
+		for (j = i; j > 0 && sorted[j - 1] > s; --j)
+			sorted[j] = sorted[j - 1];
+
+		sorted[j] = s;
+	}
+
+	if (filter->count % 2 == 1) {
+		median = sorted[filter->count / 2];
+	}
+	else {
+		median = (int)(((long long)sorted[filter->count / 2 - 1] +
+					sorted[filter->count / 2]) / 2);
+	}
+
+	if (filter->count == 1) {
+		filter->value = median;
+	}
+	else {
+		filter->value += (int)((long long)(median - filter->value) *
+					fcd_conf_filter_weight / 100);
+	}
+
+	return filter->value;
+}
+
+/*
+ * Reads the contents of a sysfs or procfs attribute from an open file
+ * descriptor into buf (NUL-terminated).  Uses a single pread(), so the same
+ * descriptor can be read repeatedly without seeking; nothing is allocated.
+ * Returns the number of bytes read, or -1 on error.
+ */
+ssize_t fcd_lib_read_attr(const int fd, const char *const name,
+			  char *const buf, const size_t size)
+{
+	ssize_t ret;
+
+	ret = pread(fd, buf, size - 1, 0);
+	if (ret == -1) {
+		FCD_PERROR(name);
+		return -1;
+	}
+
+	buf[ret] = 0;
+
+	return ret;
+}
+
+/*
+ * Parses a decimal integer (with optional leading '-').  Returns a pointer to
+ * the first character after the number, or NULL if there are no digits or the
+ * value overflows an int.
+ */
+const char *fcd_lib_parse_int(const char *s, int *const value)
+{
+	_Bool negative;
+	long long l;
+
+	if ((negative = (*s == '-')))
+		++s;
+
+	if (*s < '0' || *s > '9')
+		return NULL;
+
+	for (l = 0; *s >= '0' && *s <= '9'; ++s) {
+		l = l * 10 + (*s - '0');
+		if (l > (long long)INT_MAX + 1)
+			return NULL;
+	}
+
+	if (negative)
+		l = -l;
+
+	if (l > INT_MAX)
+		return NULL;
+
+	*value = (int)l;
+
+	return s;
+}
+
+/*
+ * Parses a non-negative fixed-point number (e.g. "0.57" from /proc/loadavg)
+ * into an integer scaled by 10^decimals - "0.57" with 2 decimals is 57.
+ * Extra digits after the decimal point are truncated.  Returns a pointer to
+ * the first character after the number, or NULL on error.
+ */
+const char *fcd_lib_parse_fixed(const char *s, const unsigned decimals,
+				int *const value)
+{
+	unsigned places;
+	long long l;
+
+	if (*s < '0' || *s > '9')
+		return NULL;
+
+	for (l = 0; *s >= '0' && *s <= '9'; ++s) {
+		l = l * 10 + (*s - '0');
+		if (l > INT_MAX)
+			return NULL;
+	}
+
+	places = 0;
+
+	if (*s == '.') {
+		for (++s; *s >= '0' && *s <= '9'; ++s) {
+			if (places < decimals) {
+				l = l * 10 + (*s - '0');
+				++places;
+			}
+		}
+	}
+
+	for (; places < decimals; ++places)
+		l *= 10;
+
+	if (l > INT_MAX)
+		return NULL;
+
+	*value = (int)l;
+
+	return s;
+}
+
+/*
+ * Reads a single integer value (temperature, fan speed, counter, etc.) from an
+ * open sysfs attribute.  Returns 0 on success, -1 on error.
+ */
+int fcd_lib_read_int(const int fd, const char *const name, int *const value)
+{
+	const char *end;
+	char buf[24];
+
+	if (fcd_lib_read_attr(fd, name, buf, sizeof buf) == -1)
+		return -1;
+
+	end = fcd_lib_parse_int(buf, value);
+	if (end == NULL || (*end != '\n' && *end != 0)) {
+		FCD_WARN("Failed to parse contents of %s\n", name);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Batched attribute reads.  A monitor that samples several attributes (the
+ * temperature monitor's inputs, the throttle monitor's per-CPU counters) reads
+ * them all with a single call.  If freecusd is built with FCD_IO_URING (and
+ * linked with -luring), the reads are submitted to an io_uring as one batch,
+ * using registered files and a registered buffer; otherwise (or if io_uring
+ * isn't usable at runtime), each attribute is read with pread().
+ *
+ * Each batch belongs to a single thread, so no locking is needed.  All memory
+ * is allocated when the batch is created.
+ */
+
+/* Long enough for any sysfs integer attribute */
+#define FCD_LIB_BATCH_BUF_SIZE	24
+
+/* Log the average cost of a batch read after this many reads (if debugging) */
+#define FCD_LIB_BATCH_STATS	1024
+
+struct fcd_lib_batch_entry {
+	char buf[FCD_LIB_BATCH_BUF_SIZE];
+	const char *name;
+	int fd;
+	int err;		/* errno from last read */
+	_Bool disabled;
+};
+
+struct fcd_lib_batch {
+	const char *name;
+	unsigned count;
+	unsigned reads;
+	unsigned long long ns;
+#ifdef FCD_IO_URING
+	_Bool uring;
+	struct io_uring ring;
+#endif
+	struct fcd_lib_batch_entry entries[];
+};
+
+#ifdef FCD_IO_URING
+
+static void fcd_lib_batch_uring_init(struct fcd_lib_batch *const batch)
+{
+	struct iovec iov;
+	unsigned i;
+	int *fds;
+	int ret;
+
+	batch->uring = 0;
+
+	fds = malloc(batch->count * sizeof *fds);
+	if (fds == NULL) {
+		FCD_PERROR("malloc");
+		return;
+	}
+
+	for (i = 0; i < batch->count; ++i)
+		fds[i] = batch->entries[i].fd;
+
+	ret = io_uring_queue_init(batch->count, &batch->ring, 0);
+	if (ret < 0) {
+		errno = -ret;
+		FCD_INFO("%s: io_uring not available (%m); using pread\n",
+			 batch->name);
+		goto free_fds;
+	}
+
+	ret = io_uring_register_files(&batch->ring, fds, batch->count);
+	if (ret < 0) {
+		errno = -ret;
+		FCD_WARN("%s: io_uring_register_files: %m\n", batch->name);
+		goto exit_ring;
+	}
+
+	/* One buffer covers all of the entries */
+	iov.iov_base = batch->entries;
+	iov.iov_len = batch->count * sizeof batch->entries[0];
+
+	ret = io_uring_register_buffers(&batch->ring, &iov, 1);
+	if (ret < 0) {
+		errno = -ret;
+		FCD_WARN("%s: io_uring_register_buffers: %m\n", batch->name);
+		goto exit_ring;
+	}
+
+	batch->uring = 1;
+	goto free_fds;
+
+exit_ring:
+	io_uring_queue_exit(&batch->ring);
+free_fds:
+	free(fds);
+}
+
+static int fcd_lib_batch_uring_read(struct fcd_lib_batch *const batch)
+{
+	struct fcd_lib_batch_entry *e;
+	struct io_uring_cqe *cqe;
+	struct io_uring_sqe *sqe;
+	unsigned i, submitted;
+	int ret;
+
+	for (submitted = 0, i = 0; i < batch->count; ++i) {
+
+		e = &batch->entries[i];
+		if (e->disabled)
+			continue;
+
+		sqe = io_uring_get_sqe(&batch->ring);
+		if (sqe == NULL) {
+			FCD_WARN("%s: io_uring submission queue full\n",
+				 batch->name);
+			return -1;
+		}
+
+		/* With IOSQE_FIXED_FILE, "fd" is an index into the file set */
+		io_uring_prep_read_fixed(sqe, i, e->buf, sizeof e->buf - 1,
+					 0, 0);
+		sqe->flags |= IOSQE_FIXED_FILE;
+		io_uring_sqe_set_data(sqe, e);
+		++submitted;
+	}
+
+	ret = io_uring_submit_and_wait(&batch->ring, submitted);
+	if (ret < 0) {
+		errno = -ret;
+		FCD_PERROR("io_uring_submit_and_wait");
+		return -1;
+	}
+
+	for (i = 0; i < submitted; ++i) {
+
+		ret = io_uring_wait_cqe(&batch->ring, &cqe);
+		if (ret < 0) {
+			errno = -ret;
+			FCD_PERROR("io_uring_wait_cqe");
+			return -1;
+		}
+
+		e = io_uring_cqe_get_data(cqe);
+
+		if (cqe->res < 0) {
+			e->err = -cqe->res;
+		}
+		else {
+			e->buf[cqe->res] = 0;
+			e->err = 0;
+		}
+
+		io_uring_cqe_seen(&batch->ring, cqe);
+	}
+
+	return 0;
+}
+
+#endif	/* FCD_IO_URING */
+
+/*
+ * Creates a batch of count attributes.  The caller retains ownership of the
+ * file descriptors (and names), which must remain valid until the batch is
+ * freed or the entry is disabled.  Entries whose file descriptor is -1 start
+ * out disabled.  Returns NULL on error.
+ */
+struct fcd_lib_batch *fcd_lib_batch_new(const char *const name,
+					const int *const fds,
+					const char *const *const names,
+					const unsigned count)
+{
+	struct fcd_lib_batch *batch;
+	unsigned i;
+
+	batch = calloc(1, sizeof *batch + count * sizeof batch->entries[0]);
+	if (batch == NULL) {
+		FCD_PERROR("calloc");
+		return NULL;
+	}
+
+	batch->name = name;
+	batch->count = count;
+
+	for (i = 0; i < count; ++i) {
+		batch->entries[i].fd = fds[i];
+		batch->entries[i].name = names[i];
+		batch->entries[i].disabled = (fds[i] == -1);
+	}
+
+#ifdef FCD_IO_URING
+	fcd_lib_batch_uring_init(batch);
+#endif
+
+	return batch;
+}
+
+static void fcd_lib_batch_stats(struct fcd_lib_batch *const batch)
+{
+	if (batch->reads == 0)
+		return;
+
+	FCD_DEBUG("%s: %u batch reads of %u attributes, average %llu ns (%s)\n",
+		  batch->name, batch->reads, batch->count,
+		  batch->ns / batch->reads,
+#ifdef FCD_IO_URING
+		  batch->uring ? "io_uring" : "pread"
+#else
+		  "pread"
+#endif
+		  );
+
+	batch->reads = 0;
+	batch->ns = 0;
+}
+
+void fcd_lib_batch_free(struct fcd_lib_batch *const batch)
+{
+	if (batch == NULL)
+		return;
+
+	fcd_lib_batch_stats(batch);
+
+#ifdef FCD_IO_URING
+	if (batch->uring)
+		io_uring_queue_exit(&batch->ring);
+#endif
+
+	free(batch);
+}
+
+/*
+ * Stops reading an attribute (e.g. because the monitor that uses it has
+ * failed).  Disabled entries are always reported as successfully read.
+ */
+void fcd_lib_batch_disable(struct fcd_lib_batch *const batch,
+			   const unsigned index)
+{
+	batch->entries[index].disabled = 1;
+}
+
+/*
+ * Reads every (enabled) attribute in the batch and parses its integer value
+ * into the corresponding element of values.  Returns the number of attributes
+ * read successfully before the first failure - i.e. batch->count on success,
+ * or the index of the first attribute that couldn't be read or parsed.
+ */
+unsigned fcd_lib_batch_read(struct fcd_lib_batch *const batch,
+			    int *const values)
+{
+	struct fcd_lib_batch_entry *e;
+	struct timespec start, end;
+	const char *p;
+	ssize_t ret;
+	unsigned i;
+
+	if (fcd_err_debug && clock_gettime(CLOCK_MONOTONIC, &start) == -1)
+		FCD_PERROR("clock_gettime");
+
+#ifdef FCD_IO_URING
+	if (batch->uring && fcd_lib_batch_uring_read(batch) == -1) {
+		FCD_WARN("%s: falling back to pread\n", batch->name);
+		io_uring_queue_exit(&batch->ring);
+		batch->uring = 0;
+	}
+
+	if (!batch->uring)
+#endif
+	{
+		for (i = 0; i < batch->count; ++i) {
+
+			e = &batch->entries[i];
+			if (e->disabled)
+				continue;
+
+			ret = pread(e->fd, e->buf, sizeof e->buf - 1, 0);
+			if (ret == -1) {
+				e->err = errno;
+			}
+			else {
+				e->buf[ret] = 0;
+				e->err = 0;
+			}
+		}
+	}
+
+	if (fcd_err_debug) {
+
+		if (clock_gettime(CLOCK_MONOTONIC, &end) == -1)
+			FCD_PERROR("clock_gettime");
+
+		batch->ns += (end.tv_sec - start.tv_sec) * 1000000000ULL
+					+ end.tv_nsec - start.tv_nsec;
+
+		if (++batch->reads == FCD_LIB_BATCH_STATS)
+			fcd_lib_batch_stats(batch);
+	}
+
+	for (i = 0; i < batch->count; ++i) {
+
+		e = &batch->entries[i];
+		if (e->disabled)
+			continue;
+
+		if (e->err != 0) {
+			errno = e->err;
+			FCD_PERROR(e->name);
+			return i;
+		}
+
+		p = fcd_lib_parse_int(e->buf, &values[i]);
+		if (p == NULL || (*p != '\n' && *p != 0)) {
+			FCD_WARN("Failed to parse contents of %s\n", e->name);
+			return i;
+		}
+	}
+
+	return batch->count;
+}
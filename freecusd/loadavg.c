@@ -1,5 +1,5 @@
 /*
- * Copyright 2013-2014, 2020 Ian Pilcher <arequipeno@gmail.com>
+ * Copyright 2013-2014, 2020, 2026 Ian Pilcher <arequipeno@gmail.com>
  *
  * This program is free software.  You can redistribute it or modify it under
  * the terms of version 2 of the GNU General Public License (GPL), as published
@@ -17,10 +17,12 @@
 #include "freecusd.h"
 
 #include <string.h>
+#include <limits.h>
+#include <fcntl.h>
 
-/* Alert thresholds */
-static double fcd_loadavg_warn[3] = { 12.0, 12.0, 12.0 };
-static double fcd_loadavg_crit[3] = { 16.0, 16.0, 16.0 };
+/* Alert thresholds (hundredths) */
+static int fcd_loadavg_warn[3] = { 1200, 1200, 1200 };
+static int fcd_loadavg_crit[3] = { 1600, 1600, 1600 };
 
 static int fcd_loadavg_cb();
 
@@ -49,8 +51,9 @@ static int fcd_loadavg_cb(cip_err_ctx *ctx, const cip_ini_value *value,
 			  void *post_parse_data)
 {
 	const cip_float_list *list;
-	double avg, *p;
 	unsigned i;
+	double avg;
+	int *p;
 
 	list = (const cip_float_list *)(value->value);
 	if (list->count != 3) {
@@ -64,61 +67,78 @@ static int fcd_loadavg_cb(cip_err_ctx *ctx, const cip_ini_value *value,
 
 		avg = list->values[i];
 
+		if (avg < 0.0 || avg > INT_MAX / 100) {
+			cip_err(ctx, "Load average (%g) outside valid range "
+				"(0 - %d)", avg, INT_MAX / 100);
+			return -1;
+		}
+
 		if (avg <= 0.0 || avg >= 100.0) {
 			cip_err(ctx,
 				"Probably not a useful load average value: %g",
 				avg);
 		}
 
-		p[i] = avg;
+		p[i] = (int)(avg * 100.0 + 0.5);
 	}
 
 	return 0;
 }
 
 __attribute__((noreturn))
-static void fcd_loadavg_close_and_disable(FILE *fp, struct fcd_monitor *mon)
+static void fcd_loadavg_close_and_disable(const int fd, const char *const path,
+					  struct fcd_monitor *const mon)
 {
-	if (fclose(fp) != 0)
-		FCD_PERROR("fclose");
+	if (close(fd) != 0)
+		FCD_PERROR(path);
 	fcd_lib_fail_and_exit(mon);
 
 }
 
+/*
+ * Parses the 3 load averages (as hundredths) from the contents of
+ * /proc/loadavg - e.g. "0.57 0.61 0.63 1/345 12345".
+ */
+static int fcd_loadavg_parse(const char *s, int *const avgs)
+{
+	unsigned i;
+
+	for (i = 0; i < 3; ++i) {
+
+		s = fcd_lib_parse_fixed(s, 2, &avgs[i]);
+		if (s == NULL || *s != ' ')
+			return -1;
+
+		++s;
+	}
+
+	return 0;
+}
+
 __attribute__((noreturn))
 static void *fcd_loadavg_fn(void *arg)
 {
 	static const char path[] = "/proc/loadavg";
 	struct fcd_monitor *mon = arg;
-	int warn, fail, ret;
-	double avgs[3];
-	char buf[21];
+	int warn, fail, ret, fd, avgs[3];
+	char buf[21], contents[64];
 	unsigned i;
-	FILE *fp;
 
-	fp = fopen(path, "re");
-	if (fp == NULL) {
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
 		FCD_PERROR(path);
 		fcd_lib_fail_and_exit(mon);
 	}
 
-	if (setvbuf(fp, NULL, _IONBF, 0) != 0) {
-		FCD_PERROR("setvbuf");
-		fcd_loadavg_close_and_disable(fp, mon);
-	}
-
 	do {
-		rewind(fp);
 		memset(buf, ' ', sizeof buf);
 
-		ret = fscanf(fp, "%lf %lf %lf", &avgs[0], &avgs[1], &avgs[2]);
-		if (ret == EOF) {
-			FCD_PERROR("fscanf");
-			fcd_loadavg_close_and_disable(fp, mon);
-		}
-		else if (ret != 3) {
+		if (fcd_lib_read_attr(fd, path, contents, sizeof contents) == -1)
+			fcd_loadavg_close_and_disable(fd, path, mon);
+
+		if (fcd_loadavg_parse(contents, avgs) == -1) {
 			FCD_WARN("Failed to parse contents of /proc/loadavg\n");
-			fcd_loadavg_close_and_disable(fp, mon);
+			fcd_loadavg_close_and_disable(fd, path, mon);
 		}
 
 		for (fail = 0, warn = 0, i = 0; i < FCD_ARRAY_SIZE(avgs); ++i) {
@@ -133,31 +153,38 @@ static void *fcd_loadavg_fn(void *arg)
 				warn = 1;
 		}
 
-		ret = fcd_lib_snprintf(buf, sizeof buf, "%.2f %.2f %.2f",
-				       avgs[0], avgs[1], avgs[2]);
+		ret = fcd_lib_snprintf(buf, sizeof buf,
+				       "%d.%02d %d.%02d %d.%02d",
+				       avgs[0] / 100, avgs[0] % 100,
+				       avgs[1] / 100, avgs[1] % 100,
+				       avgs[2] / 100, avgs[2] % 100);
 		if (ret < 0)
-			fcd_loadavg_close_and_disable(fp, mon);
+			fcd_loadavg_close_and_disable(fd, path, mon);
 
 		fcd_lib_set_mon_status(mon, buf, warn, fail, NULL, 0);
 
 		ret = fcd_lib_monitor_sleep(30);
 		if (ret == -1)
-			fcd_loadavg_close_and_disable(fp, mon);
+			fcd_loadavg_close_and_disable(fd, path, mon);
 
 	} while (ret == 0);
 
-	if (fclose(fp) != 0)
-		FCD_PERROR("fclose");
+	if (close(fd) != 0)
+		FCD_PERROR(path);
 
 	pthread_exit(NULL);
 }
 
 static void fcd_loadavg_dump_cfg(void)
 {
-	FCD_DUMP("\twarning: %.2f %.2f %.2f\n",
-		 fcd_loadavg_warn[0], fcd_loadavg_warn[1], fcd_loadavg_warn[2]);
-	FCD_DUMP("\tcritical: %.2f %.2f %.2f\n",
-		 fcd_loadavg_crit[0], fcd_loadavg_crit[1], fcd_loadavg_crit[2]);
+	FCD_DUMP("\twarning: %d.%02d %d.%02d %d.%02d\n",
+		 fcd_loadavg_warn[0] / 100, fcd_loadavg_warn[0] % 100,
+		 fcd_loadavg_warn[1] / 100, fcd_loadavg_warn[1] % 100,
+		 fcd_loadavg_warn[2] / 100, fcd_loadavg_warn[2] % 100);
+	FCD_DUMP("\tcritical: %d.%02d %d.%02d %d.%02d\n",
+		 fcd_loadavg_crit[0] / 100, fcd_loadavg_crit[0] % 100,
+		 fcd_loadavg_crit[1] / 100, fcd_loadavg_crit[1] % 100,
+		 fcd_loadavg_crit[2] / 100, fcd_loadavg_crit[2] % 100);
 }
 
 struct fcd_monitor fcd_loadavg_monitor = {
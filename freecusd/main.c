@@ -1,5 +1,5 @@
 /*
- * Copyright 2013-2014, 2017, 2020 Ian Pilcher <arequipeno@gmail.com>
+ * Copyright 2013-2014, 2017, 2020, 2026 Ian Pilcher <arequipeno@gmail.com>
  *
  * This program is free software.  You can redistribute it or modify it under
  * the terms of version 2 of the GNU General Public License (GPL), as published
@@ -18,11 +18,20 @@
 
 #include <sys/resource.h>
 #include <sys/socket.h>
+#include <sys/mman.h>
 #include <sys/un.h>
 #include <stdarg.h>
 #include <locale.h>
+#include <limits.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
+
+/*
+ * Monitor thread stack size.  (The default is usually 8 MiB, all of which
+ * would be locked if lock_memory is enabled.)
+ */
+#define FCD_MAIN_STACK_SIZE	(256 * 1024)
 
 static struct fcd_monitor fcd_main_logo = {
 	/* see https://github.com/ipilcher/n5550/issues/15 */
@@ -38,13 +47,18 @@ static struct fcd_monitor fcd_main_logo = {
 struct fcd_monitor *fcd_monitors[] = {
 	&fcd_main_logo,
 	&fcd_pwm_monitor,		/* "silent" monitor; doesn't display anything */
+	&fcd_state_monitor,		/* also "silent" */
 	&fcd_loadavg_monitor,
 	&fcd_temp_core_monitor,
 	&fcd_temp_it87_monitor,		/* Part of the coretemp monitor */
 	&fcd_sysfan_monitor,
+	&fcd_throttle_monitor,
 	&fcd_smart_monitor,
 	&fcd_hddtemp_monitor,		/* Part of the S.M.A.R.T. monitor */
 	&fcd_raid_monitor,
+	&fcd_storage_monitor,
+	&fcd_kmsg_monitor,
+	&fcd_sata_monitor,
 	NULL
 };
 
@@ -57,10 +71,8 @@ static _Bool fcd_main_systemd = 0;
  */
 __thread volatile sig_atomic_t fcd_thread_exit_flag = 0;
 
-static const struct timespec fcd_main_sleep = {
-	.tv_sec		= 3,
-	.tv_nsec	= 0,
-};
+/* LCD message rotation period (seconds) */
+#define FCD_MAIN_SLEEP		3
 
 static const struct sockaddr_un fcd_main_log_addr = {
 	.sun_family	= AF_UNIX,
@@ -144,21 +156,102 @@ static void fcd_main_child_log_open(void)
 		FCD_PABORT(fcd_main_log_addr.sun_path);
 }
 
+/*
+ * Locks all current and future pages into memory, so that the daemon won't
+ * suffer major faults when the system is under memory pressure.
+ */
+static void fcd_main_lock_memory(void)
+{
+	if (!fcd_conf_lock_memory)
+		return;
+
+	if (mlockall(MCL_CURRENT | MCL_FUTURE) == -1) {
+		FCD_PERROR("mlockall");
+		FCD_WARN("Failed to lock memory\n");
+	}
+	else {
+		FCD_INFO("Locked memory\n");
+	}
+}
+
+static void fcd_main_set_oom_score_adj(void)
+{
+	static const char path[] = "/proc/self/oom_score_adj";
+	char buf[sizeof "-1000\n"];
+	int fd, len;
+
+	if (fcd_conf_oom_score_adj == INT_MIN)
+		return;
+
+	len = snprintf(buf, sizeof buf, "%d\n", fcd_conf_oom_score_adj);
+
+	fd = open(path, O_WRONLY | O_CLOEXEC);
+	if (fd == -1) {
+		FCD_PERROR(path);
+		return;
+	}
+
+	if (write(fd, buf, len) != len)
+		FCD_PERROR(path);
+
+	if (close(fd) == -1)
+		FCD_PERROR("close");
+}
+
+/* Cleanup handler for monitor threads, which usually call pthread_exit */
+static void fcd_main_mon_cleanup(void *arg)
+{
+	(void)arg;
+	fcd_proc_thread_exit();
+}
+
+/*
+ * Monitor thread start routine -- applies any scheduling settings before
+ * running the monitor
+ */
+static void *fcd_main_mon_thread(void *arg)
+{
+	struct fcd_monitor *mon = arg;
+	void *ret;
+
+	fcd_sched_monitor();
+	fcd_lib_set_timer_slack();
+
+	pthread_cleanup_push(fcd_main_mon_cleanup, NULL);
+	ret = mon->monitor_fn(mon);
+	pthread_cleanup_pop(1);
+
+	return ret;
+}
+
 static void fcd_main_start_mon_threads(void)
 {
 	struct fcd_monitor *mon, **m;
+	pthread_attr_t attr;
 	int ret;
 
+	ret = pthread_attr_init(&attr);
+	if (ret != 0)
+		FCD_PT_ABRT("pthread_attr_init", ret);
+
+	ret = pthread_attr_setstacksize(&attr, FCD_MAIN_STACK_SIZE);
+	if (ret != 0)
+		FCD_PT_ABRT("pthread_attr_setstacksize", ret);
+
 	for (m = fcd_monitors; mon = *m, mon != NULL; ++m) {
 
 		if (mon->monitor_fn != 0 && mon->enabled) {
 
-			ret = pthread_create(&mon->tid, NULL,
-					     mon->monitor_fn, mon);
+			ret = pthread_create(&mon->tid, &attr,
+					     fcd_main_mon_thread, mon);
 			if (ret != 0)
 				FCD_PT_ABRT("pthread_create", ret);
 		}
 	}
+
+	ret = pthread_attr_destroy(&attr);
+	if (ret != 0)
+		FCD_PT_ABRT("pthread_attr_destroy", ret);
 }
 
 static void fcd_main_stop_thread(pthread_t thread)
@@ -235,8 +328,27 @@ static void fcd_main_set_sig_handler(void)
 		FCD_PABORT("sigaction");
 	if (sigaction(SIGUSR1, &sa, NULL) == -1)
 		FCD_PABORT("sigaction");
-	if (sigaction(SIGCHLD, &sa, NULL) == -1)
-		FCD_PABORT("sigaction");
+}
+
+/*
+ * Sleeps until the next FCD_MAIN_SLEEP second tick (which coincides with the
+ * monitor threads' ticks), unless interrupted by SIGINT or SIGTERM.
+ */
+static void fcd_main_sleep(void)
+{
+	struct timespec ts;
+
+	if (fcd_lib_tick_timeout(&ts, FCD_MAIN_SLEEP) == -1)
+		FCD_ABORT("Failed to calculate main loop sleep time\n");
+
+	if (nanosleep(&ts, NULL) == -1) {
+		if (errno != EINTR)
+			FCD_PABORT("nanosleep");
+	}
+	else {
+		fcd_lib_count_wakeup();
+		fcd_lib_wakeup_report();
+	}
 }
 
 static void fcd_main_read_monitor(int tty_fd, struct fcd_monitor *mon)
@@ -265,7 +377,6 @@ int main(int argc, char *argv[])
 {
 	sigset_t worker_sigmask, main_sigmask;
 	struct fcd_monitor **mon;
-	pthread_t reaper_thread;
 	int tty_fd, ret;
 
 	fcd_main_parse_args(argc, argv);
@@ -280,14 +391,16 @@ int main(int argc, char *argv[])
 	}
 
 	fcd_conf_parse();
+	fcd_state_load();
+	fcd_hwmon_scan();
 	setlocale(LC_NUMERIC, "");
+	fcd_main_set_oom_score_adj();
+	fcd_sched_init();
+	fcd_main_lock_memory();
 
-	fcd_main_sigmask(&worker_sigmask, SIGINT, SIGTERM, SIGCHLD, SIGUSR1, 0);
-	fcd_main_sigmask(&main_sigmask, -SIGINT, -SIGTERM, SIGCHLD, SIGUSR1, 0);
-	fcd_main_sigmask(&fcd_mon_ppoll_sigmask,
-			 SIGINT, SIGTERM, SIGCHLD, -SIGUSR1, 0);
-	fcd_main_sigmask(&fcd_proc_ppoll_sigmask,
-			 SIGINT, SIGTERM, -SIGCHLD, -SIGUSR1, 0);
+	fcd_main_sigmask(&worker_sigmask, SIGINT, SIGTERM, SIGUSR1, 0);
+	fcd_main_sigmask(&main_sigmask, -SIGINT, -SIGTERM, SIGUSR1, 0);
+	fcd_main_sigmask(&fcd_mon_ppoll_sigmask, SIGINT, SIGTERM, -SIGUSR1, 0);
 
 	ret = pthread_sigmask(SIG_SETMASK, &worker_sigmask, NULL);
 	if (ret != 0)
@@ -295,10 +408,6 @@ int main(int argc, char *argv[])
 
 	fcd_main_set_sig_handler();
 
-	ret = pthread_create(&reaper_thread, NULL, fcd_proc_fn, NULL);
-	if (ret != 0)
-		FCD_PT_ABRT("pthread_create", ret);
-
 	fcd_main_start_mon_threads();
 
 	ret = pthread_sigmask(SIG_SETMASK, &main_sigmask, NULL);
@@ -310,6 +419,7 @@ int main(int argc, char *argv[])
 	tty_fd = fcd_tty_open("/dev/ttyS0");
 	fcd_alert_leds_open();
 	fcd_pwm_init();
+	fcd_lib_set_timer_slack();
 
 	while (!fcd_main_got_exit_signal) {
 
@@ -317,24 +427,30 @@ int main(int argc, char *argv[])
 
 			fcd_main_read_monitor(tty_fd, *mon);
 
-			if (!(*mon)->silent) {
-				ret = nanosleep(&fcd_main_sleep, NULL);
-				if (ret == -1 && errno != EINTR)
-					FCD_PABORT("nanosleep");
-			}
+			if (!(*mon)->silent)
+				fcd_main_sleep();
 
 			if (fcd_main_got_exit_signal)
 				break;
 		}
+
+		fcd_state_save();
+#ifdef FCD_MALLOC_CHECK
+		fcd_lib_malloc_check();
+#endif
 	}
 
+	/* Save final state after the monitors stop, but before PWM is reset */
+	fcd_main_stop_mon_threads();
+	fcd_state_save();
+
 	fcd_alert_leds_close();
 	fcd_pwm_fini();
 	if (close(tty_fd) == -1)
 		FCD_PERROR("close");
 
-	fcd_main_stop_mon_threads();
-	fcd_main_stop_thread(reaper_thread);
+	fcd_sched_fini();
+	fcd_hwmon_close();
 	if (!fcd_err_foreground && close(fcd_err_child_errfd) == -1)
 		FCD_PERROR(fcd_main_log_addr.sun_path);
 
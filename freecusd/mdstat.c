@@ -0,0 +1,380 @@
+/*
+ * Copyright 2026 Ian Pilcher <arequipeno@gmail.com>
+ *
+ * This program is free software.  You can redistribute it or modify it under
+ * the terms of version 2 of the GNU General Public License (GPL), as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY -- without even the implied warranty of MERCHANTIBILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the text of the GPL for more details.
+ *
+ * Version 2 of the GNU General Public License is available at:
+ *
+ *   http://www.gnu.org/licenses/old-licenses/gpl-2.0.html
+ */
+
+/*
+ * /proc/mdstat tokenizer.  Makes a single pass over the contents of the file
+ * and fills in a struct fcd_mdstat, which describes each array and its member
+ * devices.  Nothing is copied; names, etc. point into the buffer, which must
+ * not be modified while the results are in use.
+ *
+ * An array looks something like this (see md_seq_show() and the status
+ * functions of the various personalities in the kernel's drivers/md):
+ *
+ *   md1 : active (auto-read-only) raid5 sdd[4] sdc[2] sdb[1](F) sda[0]
+ *         5860147200 blocks super 1.2 level 5, 512k chunk, ... [4/3] [UU_U]
+ *         [=>..................]  recovery =  5.1% (99834368/1953382400) ...
+ *         bitmap: 0/15 pages [0KB], 65536KB chunk
+ *
+ * RAID-10 arrays also show "N near-copies" and/or "N far-copies" (or "N
+ * offset-copies") before the [ideal/current] device counts.  Non-redundant
+ * arrays (linear & RAID-0) don't show the counts or the [UU_U] summary at all.
+ */
+
+#include "freecusd.h"
+
+#include <string.h>
+
+/* Returns a pointer to the first character after the current line */
+static const char *fcd_mdstat_next_line(const char *c)
+{
+	while (*c != 0 && *c != '\n')
+		++c;
+
+	return (*c == '\n') ? c + 1 : c;
+}
+
+/* Skips spaces (but not newlines) */
+static const char *fcd_mdstat_skip_spaces(const char *c)
+{
+	while (*c == ' ' || *c == '\t')
+		++c;
+
+	return c;
+}
+
+/* Returns the length of the token (run of non-whitespace) at c */
+static unsigned fcd_mdstat_token_len(const char *c)
+{
+	const char *t;
+
+	for (t = c; *t != 0 && *t != ' ' && *t != '\t' && *t != '\n'; ++t);
+
+	return t - c;
+}
+
+/* Compares a token with a string */
+static int fcd_mdstat_token_is(const char *const t, const unsigned len,
+			       const char *const s)
+{
+	return strlen(s) == len && memcmp(t, s, len) == 0;
+}
+
+/*
+ * Parses an unsigned decimal number.  Returns a pointer to the first character
+ * after the number, or NULL if there are no digits at c.
+ */
+static const char *fcd_mdstat_uint(const char *c, unsigned *const value)
+{
+	const char *start = c;
+
+	for (*value = 0; *c >= '0' && *c <= '9'; ++c)
+		*value = *value * 10 + (*c - '0');
+
+	return (c == start) ? NULL : c;
+}
+
+/*
+ * Parses a member device token -- NAME[NUMBER] or NAME[NUMBER](FLAG).  Returns
+ * 0 on success or -1 if the token is malformed.
+ */
+static int fcd_mdstat_dev(const char *const t, const unsigned len,
+			  struct fcd_mdstat_dev *const dev)
+{
+	const char *c, *end;
+
+	end = t + len;
+
+	for (c = t; c < end && *c != '['; ++c);
+
+	if (c == t || c == end)
+		return -1;
+
+	dev->name = t;
+	dev->name_len = c - t;
+
+	c = fcd_mdstat_uint(c + 1, &dev->number);
+	if (c == NULL || c >= end || *c != ']')
+		return -1;
+
+	if (++c == end) {
+		dev->flag = 0;
+		return 0;
+	}
+
+	if (end - c != 3 || c[0] != '(' || c[2] != ')' ||
+			strchr("WFSR", c[1]) == NULL)
+		return -1;
+
+	dev->flag = c[1];
+
+	return 0;
+}
+
+/*
+ * Parses the first line of an array.  Returns 1 if the line describes an array
+ * (and stores a pointer to the start of the next line in *next), 0 if it
+ * doesn't, or -1 on error.
+ */
+static int fcd_mdstat_header(const char *c, struct fcd_mdstat *const mdstat,
+			     const char **const next)
+{
+	struct fcd_mdstat_array *array;
+	struct fcd_mdstat_dev *dev;
+	const char *name;
+	unsigned len, name_len;
+
+	name = c;
+	name_len = fcd_mdstat_token_len(c);
+	c += name_len;
+
+	if (c[0] != ' ' || c[1] != ':' || c[2] != ' ')
+		return 0;
+
+	c += 3;
+	len = fcd_mdstat_token_len(c);
+
+	if (mdstat->array_count == FCD_MDSTAT_MAX_ARRAYS) {
+		FCD_WARN("Too many RAID arrays in /proc/mdstat\n");
+		return -1;
+	}
+
+	array = &mdstat->arrays[mdstat->array_count];
+	memset(array, 0, sizeof *array);
+	array->name = name;
+	array->name_len = name_len;
+	array->first_dev = mdstat->dev_count;
+	array->near_copies = 1;
+	array->far_copies = 1;
+	array->sync_permille = -1;
+
+	if (fcd_mdstat_token_is(c, len, "active"))
+		array->active = 1;
+	else if (!fcd_mdstat_token_is(c, len, "inactive"))
+		return 0;
+
+	c = fcd_mdstat_skip_spaces(c + len);
+	len = fcd_mdstat_token_len(c);
+
+	if (fcd_mdstat_token_is(c, len, "(read-only)")) {
+		array->read_only = 'r';
+		c = fcd_mdstat_skip_spaces(c + len);
+		len = fcd_mdstat_token_len(c);
+	}
+	else if (fcd_mdstat_token_is(c, len, "(auto-read-only)")) {
+		array->read_only = 'a';
+		c = fcd_mdstat_skip_spaces(c + len);
+		len = fcd_mdstat_token_len(c);
+	}
+
+	/* Member devices always contain '['; the personality never does */
+	if (len != 0 && memchr(c, '[', len) == NULL) {
+		array->personality = c;
+		array->personality_len = len;
+		c = fcd_mdstat_skip_spaces(c + len);
+		len = fcd_mdstat_token_len(c);
+	}
+
+	while (len != 0) {
+
+		if (mdstat->dev_count == FCD_MDSTAT_MAX_DEVS) {
+			FCD_WARN("Too many RAID devices in /proc/mdstat\n");
+			return -1;
+		}
+
+		dev = &mdstat->devs[mdstat->dev_count];
+
+		if (fcd_mdstat_dev(c, len, dev) == -1) {
+			FCD_WARN("Error parsing /proc/mdstat: '%.*s'\n",
+				 (int)len, c);
+			return -1;
+		}
+
+		++mdstat->dev_count;
+		++array->dev_count;
+
+		c = fcd_mdstat_skip_spaces(c + len);
+		len = fcd_mdstat_token_len(c);
+	}
+
+	++mdstat->array_count;
+	*next = fcd_mdstat_next_line(c);
+
+	return 1;
+}
+
+/*
+ * Parses a percentage with (at most) 1 decimal place into permille.  Returns
+ * -1 if the token isn't a percentage.
+ */
+static int fcd_mdstat_permille(const char *c, const unsigned len)
+{
+	const char *end = c + len;
+	unsigned whole, tenths;
+
+	c = fcd_mdstat_uint(c, &whole);
+	if (c == NULL || whole > 100)
+		return -1;
+
+	tenths = 0;
+
+	if (c < end && *c == '.') {
+		if (++c < end && *c >= '0' && *c <= '9')
+			tenths = *c++ - '0';
+		while (c < end && *c >= '0' && *c <= '9')
+			++c;
+	}
+
+	if (c + 1 != end || *c != '%')
+		return -1;
+
+	return whole * 10 + tenths;
+}
+
+/* Sync actions that can appear in a progress line */
+static const char *const fcd_mdstat_sync_actions[] = {
+	"resync", "recovery", "reshape", "check", "repair",
+};
+
+/*
+ * Checks whether a token is a sync action (possibly followed by "=PENDING" or
+ * "=DELAYED"), and records it.  Returns 1 if it is, 0 if not.
+ */
+static int fcd_mdstat_sync_action(const char *const t, const unsigned len,
+				  struct fcd_mdstat_array *const array)
+{
+	const char *a;
+	unsigned i, a_len;
+
+	for (i = 0; i < FCD_ARRAY_SIZE(fcd_mdstat_sync_actions); ++i) {
+
+		a = fcd_mdstat_sync_actions[i];
+		a_len = strlen(a);
+
+		if (len >= a_len && memcmp(t, a, a_len) == 0 &&
+				(len == a_len || t[a_len] == '=')) {
+			array->sync_action = t;
+			array->sync_action_len = a_len;
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Parses a continuation line of an array -- looking for the RAID-10 layout,
+ * the device counts and summary, and the progress of any sync action.
+ */
+static const char *fcd_mdstat_detail(const char *c,
+				     struct fcd_mdstat_array *const array)
+{
+	unsigned len, number, have_number;
+	const char *t;
+	int permille;
+
+	have_number = 0;
+	number = 0;
+
+	for (c = fcd_mdstat_skip_spaces(c); (len = fcd_mdstat_token_len(c));
+					c = fcd_mdstat_skip_spaces(c + len)) {
+
+		if (have_number && fcd_mdstat_token_is(c, len, "near-copies")) {
+			array->near_copies = number;
+		}
+		else if (have_number &&
+			    (fcd_mdstat_token_is(c, len, "far-copies") ||
+			     fcd_mdstat_token_is(c, len, "offset-copies"))) {
+			array->far_copies = number;
+		}
+		else if (c[0] == '[' && c[len - 1] == ']' && len > 2) {
+
+			/* [ideal/current], [UU_U], or a progress bar */
+			t = fcd_mdstat_uint(c + 1, &number);
+			if (t != NULL && *t == '/') {
+				t = fcd_mdstat_uint(t + 1,
+						    &array->current_devs);
+				if (t == c + len - 1)
+					array->ideal_devs = number;
+				else
+					array->current_devs = 0;
+			}
+			else if (c[1] == 'U' || c[1] == '_') {
+				array->dev_summary = c + 1;
+				array->dev_summary_len = len - 2;
+			}
+		}
+		else if (fcd_mdstat_sync_action(c, len, array)) {
+			/* Followed by "=" and the percentage */
+			c = fcd_mdstat_skip_spaces(c + len);
+			len = fcd_mdstat_token_len(c);
+			if (fcd_mdstat_token_is(c, len, "=")) {
+				c = fcd_mdstat_skip_spaces(c + len);
+				len = fcd_mdstat_token_len(c);
+				permille = fcd_mdstat_permille(c, len);
+				if (permille != -1)
+					array->sync_permille = permille;
+			}
+			if (len == 0)
+				break;
+		}
+
+		have_number = (fcd_mdstat_uint(c, &number) == c + len);
+	}
+
+	return fcd_mdstat_next_line(c);
+}
+
+/*
+ * Parses the contents of /proc/mdstat.  Returns 0 on success or -1 on error.
+ */
+int fcd_mdstat_parse(struct fcd_mdstat *const mdstat, const char *c)
+{
+	struct fcd_mdstat_array *array;
+	const char *next;
+	int ret;
+
+	mdstat->array_count = 0;
+	mdstat->dev_count = 0;
+	array = NULL;
+
+	while (*c != 0) {
+
+		if (*c == ' ' || *c == '\t') {
+			if (array != NULL)
+				c = fcd_mdstat_detail(c, array);
+			else
+				c = fcd_mdstat_next_line(c);
+			continue;
+		}
+
+		array = NULL;
+
+		/* "Personalities : ...", "unused devices: ...", blank lines */
+		ret = fcd_mdstat_header(c, mdstat, &next);
+		if (ret == -1)
+			return -1;
+
+		if (ret == 0) {
+			c = fcd_mdstat_next_line(c);
+		}
+		else {
+			array = &mdstat->arrays[mdstat->array_count - 1];
+			c = next;
+		}
+	}
+
+	return 0;
+}
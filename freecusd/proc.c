@@ -1,5 +1,5 @@
 /*
- * Copyright 2013 Ian Pilcher <arequipeno@gmail.com>
+ * Copyright 2013, 2026 Ian Pilcher <arequipeno@gmail.com>
  *
  * This program is free software.  You can redistribute it or modify it under
  * the terms of version 2 of the GNU General Public License (GPL), as published
@@ -14,265 +14,374 @@
  *   http://www.gnu.org/licenses/old-licenses/gpl-2.0.html
  */
 
+/*
+ * Child process management.  Each child is owned by the monitor thread that
+ * forked it, and only that thread ever waits for it (there is no waitpid(-1)
+ * anywhere), so the child's PID can't be reused until its owner reaps it.
+ *
+ * The owner waits by polling a pidfd (Linux 5.3+), which becomes readable when
+ * the child exits, and then reaps it with waitid(P_PIDFD).  On older kernels,
+ * it falls back to checking the child with waitid(P_PID, ..., WNOHANG) every
+ * FCD_PROC_POLL_MS milliseconds.
+ *
+ * Every unreaped child (including killed children that haven't exited yet) is
+ * counted, both globally and per thread, and the counts enforce the
+ * max_child_processes and max_child_processes_per_monitor limits, so a hung
+ * helper program can't cause children to pile up indefinitely.  (The owner
+ * always has the child's record, so no lookup by PID or pidfd is needed.)
+ */
+
 #include "freecusd.h"
 
+#include <sys/syscall.h>
 #include <sys/wait.h>
 #include <string.h>
 #include <errno.h>
 #include <poll.h>
 
-struct fcd_proc_child {
-	pid_t child;
-	int pipe_fds[2];
-};
+#ifndef P_PIDFD
+#define P_PIDFD		3
+#endif
 
-sigset_t fcd_proc_ppoll_sigmask;
+/* Fallback polling interval, if pidfds aren't supported */
+#define FCD_PROC_POLL_MS	100
+
+/* How long to wait for a killed child to exit */
+#define FCD_PROC_KILL_TIMEOUT	1
+
+/*
+ * Max number of stale children per thread.  Stale children still count against
+ * max_child_processes_per_monitor (max 16), so this can't actually fill up.
+ */
+#define FCD_PROC_MAX_STALE	16
 
+/* Number of unreaped children (all threads) */
 static pthread_mutex_t fcd_proc_mutex = PTHREAD_MUTEX_INITIALIZER;
+static unsigned fcd_proc_count;
 
-/* Currently the hddtemp, smart, and raid monitors spawn children */
-static struct fcd_proc_child fcd_proc_children[3] = {
-	{ .child = -1 },
-	{ .child = -1 },
-	{ .child = -1 },
-};
+/* Number of unreaped children owned by this thread */
+static __thread unsigned fcd_proc_thread_count;
 
-/*******************************************************************************
- *
- * Functions called in other threads
- *
- ******************************************************************************/
+/*
+ * Killed children that didn't exit within FCD_PROC_KILL_TIMEOUT (probably
+ * stuck in uninterruptible I/O).  Their owner tries again to reap them each
+ * time that it forks or waits for a child, and when it exits.
+ */
+static __thread struct fcd_proc_child fcd_proc_stale[FCD_PROC_MAX_STALE];
+static __thread unsigned fcd_proc_stale_count;
 
-pid_t fcd_proc_fork(const int *pipe_fds)
+static void fcd_proc_lock(void)
 {
-	pid_t child;
-	size_t i;
 	int ret;
 
 	ret = pthread_mutex_lock(&fcd_proc_mutex);
-	if (ret != 0) {
-		FCD_PT_ERR("pthread_mutex_lock", ret);
-		return -1;
-	}
+	if (ret != 0)
+		FCD_PT_ABRT("pthread_mutex_lock", ret);
+}
 
-	for (i = 0; i < FCD_ARRAY_SIZE(fcd_proc_children); ++i) {
-		if (fcd_proc_children[i].child == -1)
-			break;
-	}
+static void fcd_proc_unlock(void)
+{
+	int ret;
 
-	if (i >= FCD_ARRAY_SIZE(fcd_proc_children)) {
-		FCD_WARN("No free slot in child array\n");
-		child = -1;
-		goto unlock_mutex;
-	}
+	ret = pthread_mutex_unlock(&fcd_proc_mutex);
+	if (ret != 0)
+		FCD_PT_ABRT("pthread_mutex_unlock", ret);
+}
 
-	child = fork();
-	if (child == -1) {
-		FCD_PERROR("fork");
-		child = -1;
-		goto unlock_mutex;
-	}
+/*
+ * Removes the child from the registry
+ */
+static void fcd_proc_unregister(void)
+{
+	fcd_proc_lock();
+	--fcd_proc_count;
+	fcd_proc_unlock();
 
-	if (child == 0)
-		return 0;
+	--fcd_proc_thread_count;
+}
 
-	fcd_proc_children[i].child = child;
-	memcpy(fcd_proc_children[i].pipe_fds, pipe_fds,
-	       sizeof fcd_proc_children[i].pipe_fds);
+static int fcd_proc_pidfd_open(const pid_t pid)
+{
+#ifdef SYS_pidfd_open
+	return syscall(SYS_pidfd_open, pid, 0);
+#else
+	(void)pid;
+	errno = ENOSYS;
+	return -1;
+#endif
+}
 
-unlock_mutex:
+static void fcd_proc_forget(struct fcd_proc_child *const child)
+{
+	fcd_proc_unregister();
 
-	ret = pthread_mutex_unlock(&fcd_proc_mutex);
-	if (ret == -1)
-		FCD_PT_ABRT("pthread_mutex_unlock", ret);
+	if (child->pidfd != -1 && close(child->pidfd) == -1)
+		FCD_PERROR("close");
 
-	return child;
+	child->pid = -1;
+	child->pidfd = -1;
 }
 
 /*
- * Returns 0 on success, -1 on error, -2 if timeout expires, or -3 if the
- * thread exit signal is received.
+ * Reaps the child, if it has exited.  Returns 1 if the child was reaped (and
+ * stores its exit information in *info), 0 if it is still running, or -1 on
+ * error.
  */
-int fcd_proc_wait(int *status, const int *pipe_fds, struct timespec *timeout)
+static int fcd_proc_reap(struct fcd_proc_child *const child,
+			 siginfo_t *const info)
 {
-	ssize_t ret;
+	static const int options = WEXITED | WNOHANG;
+	int ret;
 
-	ret = fcd_lib_read(pipe_fds[0], status, sizeof *status, timeout);
-	if (ret < 0)
-		return ret;
+	memset(info, 0, sizeof *info);
+
+	if (child->pidfd != -1) {
 
-	if (ret != (ssize_t)sizeof *status) {
-		FCD_ERR("Incomplete read (%zd bytes)\n", ret);
+		ret = waitid(P_PIDFD, child->pidfd, info, options);
+
+		/* Linux 5.3 has pidfd_open, but waitid(P_PIDFD) is 5.4+ */
+		if (ret == -1 && errno == EINVAL)
+			ret = waitid(P_PID, child->pid, info, options);
+	}
+	else {
+		ret = waitid(P_PID, child->pid, info, options);
+	}
+
+	if (ret == -1) {
+		FCD_PERROR("waitid");
 		return -1;
 	}
 
-	return 0;
+	if (info->si_pid == 0)
+		return 0;
+
+	fcd_proc_forget(child);
+
+	return 1;
 }
 
-int fcd_proc_kill(pid_t pid, const int *pipe_fds)
+/*
+ * Waits for the child to exit and reaps it.  If interruptible is non-zero, the
+ * wait is cut short by the thread exit signal.  Returns 0 on success, -1 on
+ * error, -2 if the timeout expires, or -3 if the thread exit signal is
+ * received.
+ */
+static int fcd_proc_poll(struct fcd_proc_child *const child,
+			 siginfo_t *const info, struct timespec *const timeout,
+			 const int interruptible)
 {
-	int result, ret;
-	size_t i;
+	struct timespec deadline, poll_ts;
+	const struct timespec *ts;
+	struct pollfd pfd;
+	int ret;
 
-	ret = pthread_mutex_lock(&fcd_proc_mutex);
-	if (ret != 0) {
-		FCD_PT_ERR("pthread_mutex_lock", ret);
+	if (fcd_lib_deadline(&deadline, timeout) == -1)
 		return -1;
-	}
 
-	for (i = 0; i < FCD_ARRAY_SIZE(fcd_proc_children); ++i) {
+	pfd.fd = child->pidfd;
+	pfd.events = POLLIN;
+
+	poll_ts.tv_sec = 0;
+	poll_ts.tv_nsec = FCD_PROC_POLL_MS * 1000000L;
+
+	while (!interruptible || !fcd_thread_exit_flag) {
+
+		ret = fcd_proc_reap(child, info);
+		if (ret != 0)
+			return (ret == 1) ? 0 : -1;
+
+		if (fcd_lib_remaining(timeout, &deadline) == -1)
+			return -1;
 
-		if (fcd_proc_children[i].child == pid) {
+		if (timeout->tv_sec == 0 && timeout->tv_nsec == 0)
+			return -2;
 
-			fcd_proc_children[i].child = -1;
-			break;
+		if (child->pidfd != -1) {
+			ret = ppoll(&pfd, 1, timeout, &fcd_mon_ppoll_sigmask);
+		}
+		else {
+			if (timeout->tv_sec == 0 &&
+					timeout->tv_nsec < poll_ts.tv_nsec)
+				ts = timeout;
+			else
+				ts = &poll_ts;
+
+			ret = ppoll(NULL, 0, ts, &fcd_mon_ppoll_sigmask);
 		}
-	}
 
-	if (i >= FCD_ARRAY_SIZE(fcd_proc_children)) {
-		result = 1;		/* Child already exited & reaped */
-		goto unlock_mutex;
+		if (ret == -1 && errno != EINTR) {
+			FCD_PERROR("ppoll");
+			return -1;
+		}
 	}
 
-	if (kill(pid, SIGKILL) == -1) {
-		FCD_PERROR("kill");
-		result = -1;
-		goto unlock_mutex;
+	return -3;
+}
+
+/*
+ * Tries to reap this thread's stale children.
+ */
+static void fcd_proc_reap_stale(void)
+{
+	siginfo_t info;
+	unsigned i;
+
+	for (i = 0; i < fcd_proc_stale_count; ) {
+
+		if (fcd_proc_reap(&fcd_proc_stale[i], &info) == 1) {
+			fcd_proc_stale[i] =
+				fcd_proc_stale[--fcd_proc_stale_count];
+		}
+		else {
+			++i;
+		}
 	}
+}
 
-	result = 0;
+/*
+ * Called when a monitor thread exits.  Makes a last attempt to reap the
+ * thread's stale children, and stops counting any that still haven't exited.
+ * (Their PIDs can't be reused, since they are never reaped.)
+ */
+void fcd_proc_thread_exit(void)
+{
+	struct fcd_proc_child *child;
 
-unlock_mutex:
+	fcd_proc_reap_stale();
 
-	ret = pthread_mutex_unlock(&fcd_proc_mutex);
-	if (ret != 0)
-		FCD_PT_ABRT("pthread_mutex_unlock", ret);
+	while (fcd_proc_stale_count != 0) {
+		child = &fcd_proc_stale[--fcd_proc_stale_count];
+		FCD_WARN("Abandoning killed child process (PID %ld)\n",
+			 (long)child->pid);
+		fcd_proc_forget(child);
+	}
+}
 
-	if (result == 1) {
+/*
+ * Forks a child process and adds it to the registry.  Returns 0 in the child,
+ * the child's PID in the parent, or -1 on error (including reaching either of
+ * the child process limits).
+ */
+pid_t fcd_proc_fork(struct fcd_proc_child *const child)
+{
+	static __thread _Bool pidfd_warned = 0;
+	pid_t pid;
 
-		/* Child has been reaped, so clear its status from the pipe */
+	if (fcd_proc_stale_count != 0)
+		fcd_proc_reap_stale();
 
-		ret = read(pipe_fds[0], &result, sizeof result);
-		if (ret == -1) {
-			FCD_PERROR("read");
-			return -1;
-		}
+	if (fcd_proc_thread_count >= (unsigned)fcd_conf_max_mon_children) {
+		FCD_WARN("Per-monitor child process limit (%d) reached\n",
+			 fcd_conf_max_mon_children);
+		return -1;
+	}
 
-		if (ret != (int)sizeof result) {
-			FCD_ERR("Incomplete read (%d bytes)\n", ret);
-			return -1;
-		}
+	fcd_proc_lock();
 
-		return 0;
+	if (fcd_proc_count >= (unsigned)fcd_conf_max_children) {
+		FCD_WARN("Child process limit (%d) reached\n",
+			 fcd_conf_max_children);
+		fcd_proc_unlock();
+		return -1;
 	}
 
-	return result;
-}
+	++fcd_proc_count;
 
-int fcd_proc_close_pipe(const int *pipe_fds)
-{
-	int ret;
+	fcd_proc_unlock();
 
-	ret = close(pipe_fds[0]);
-	if (ret == -1)
-		FCD_PERROR("close");
+	++fcd_proc_thread_count;
 
-	if (close(pipe_fds[1]) == -1) {
-		FCD_PERROR("close");
+	pid = fork();
+	if (pid == -1) {
+		FCD_PERROR("fork");
+		fcd_proc_unregister();
 		return -1;
 	}
 
-	return ret;
-}
+	if (pid == 0)
+		return 0;
 
-/*******************************************************************************
- *
- * The actual reaper thread
- *
- ******************************************************************************/
+	child->pid = pid;
+
+	child->pidfd = fcd_proc_pidfd_open(pid);
+	if (child->pidfd == -1 && !pidfd_warned) {
+		FCD_INFO("pidfd_open: %m; polling child processes\n");
+		pidfd_warned = 1;
+	}
 
-static void fcd_proc_send(pid_t pid, int status)
+	return pid;
+}
+
+/*
+ * Waits for the child to exit and stores its exit status (0 - 255) in *status.
+ * Returns 0 on success, -1 on error (including abnormal termination of the
+ * child), -2 if timeout expires, or -3 if the thread exit signal is received.
+ * If the child has not been reaped (-1, -2, or -3), the caller must kill it.
+ */
+int fcd_proc_wait(struct fcd_proc_child *const child, int *const status,
+		  struct timespec *const timeout)
 {
-	size_t i;
+	siginfo_t info;
 	int ret;
 
-	for (i = 0; i < FCD_ARRAY_SIZE(fcd_proc_children); ++i) {
+	if (fcd_proc_stale_count != 0)
+		fcd_proc_reap_stale();
 
-		if (fcd_proc_children[i].child == pid) {
-
-			fcd_proc_children[i].child = -1;
-			break;
-		}
-	}
+	ret = fcd_proc_poll(child, &info, timeout, 1);
+	if (ret < 0)
+		return ret;
 
-	if (i >= FCD_ARRAY_SIZE(fcd_proc_children)) {
-
-		/*
-		 * This can happen if the following sequence occurs:
-		 *
-		 * 	1. fcd_proc_wait (in monitor thread) times out
-		 * 	2. Monitor thread calls fcd_proc_kill, which acquires
-		 * 		fcd_proc_mutex
-		 * 	3. Child process terminates; reaper thread is woken up
-		 * 		by SIGCHLD
-		 * 	4. Reaper thread blocks, waiting to acquire the mutex
-		 * 	5. fcd_proc_kill (in monitor thread) removes the child
-		 * 		from fcd_proc_children
-		 * 	6. Monitor thread releases the mutex
-		 * 	7. Reaper thread cannot find the child in
-		 * 		fcd_proc_children
-		 */
-
-		FCD_WARN("PID %lu not found in child array\n",
-			 (unsigned long)pid);
-		return;
+	if (info.si_code != CLD_EXITED) {
+		FCD_WARN("Child process did not terminate normally\n");
+		return -1;
 	}
 
-	ret = write(fcd_proc_children[i].pipe_fds[1], &status, sizeof status);
-	if (ret == -1)
-		FCD_PABORT("write");
+	*status = info.si_status;
 
-	if (ret != (int)sizeof status)
-		FCD_ABORT("Incomplete write (%d bytes)\n", ret);
+	return 0;
 }
 
-__attribute__((noreturn))
-void *fcd_proc_fn(void *arg __attribute__((unused)))
+/*
+ * Kills the child (if it hasn't already been reaped) and reaps it.  Returns 0
+ * on success or -1 on error.
+ */
+int fcd_proc_kill(struct fcd_proc_child *const child)
 {
-	int status, ret;
-	pid_t pid;
+	struct timespec timeout;
+	siginfo_t info;
+	int ret;
 
-	while (!fcd_thread_exit_flag) {
+	if (child->pid == -1)
+		return 0;
 
-		/* Wait to be interrupted by a signal (SIGCHLD or SIGUSR1) */
-		ret = ppoll(NULL, 0, NULL, &fcd_proc_ppoll_sigmask);
-		if (ret != -1)
-			FCD_ABORT("Unexpected ppoll return value: %d\n", ret);
-		if (errno != EINTR)
-			FCD_PABORT("ppoll");
+	if (kill(child->pid, SIGKILL) == -1) {
+		FCD_PERROR("kill");
+		fcd_proc_forget(child);
+		return -1;
+	}
 
-		ret = pthread_mutex_lock(&fcd_proc_mutex);
-		if (ret != 0)
-			FCD_PT_ABRT("pthread_mutex_lock", ret);
+	timeout.tv_sec = FCD_PROC_KILL_TIMEOUT;
+	timeout.tv_nsec = 0;
 
-		do {
-			pid = waitpid(-1, &status, WNOHANG);
-			if (pid == -1) {
-				if (errno == ECHILD)
-					pid = 0;
-				else
-					FCD_PABORT("waitpid");
-			}
+	ret = fcd_proc_poll(child, &info, &timeout, 0);
+	if (ret == 0)
+		return 0;
 
-			if (pid > 0)
-				fcd_proc_send(pid, status);
+	if (ret == -2) {
 
-		} while (pid != 0);
+		FCD_WARN("Killed child process (PID %ld) did not exit\n",
+			 (long)child->pid);
 
-		ret = pthread_mutex_unlock(&fcd_proc_mutex);
-		if (ret != 0)
-			FCD_PT_ABRT("pthread_mutex_unlock", ret);
+		if (fcd_proc_stale_count < FCD_PROC_MAX_STALE) {
+			fcd_proc_stale[fcd_proc_stale_count++] = *child;
+			child->pid = -1;
+			child->pidfd = -1;
+			return 0;
+		}
 	}
 
-	pthread_exit(NULL);
+	/* Can't wait for the child, so give up on it */
+	fcd_proc_forget(child);
+
+	return -1;
 }
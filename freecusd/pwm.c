@@ -1,5 +1,5 @@
 /*
- * Copyright 2020, 2023 Ian Pilcher <arequipeno@gmail.com>
+ * Copyright 2020, 2023, 2026 Ian Pilcher <arequipeno@gmail.com>
  *
  * This program is free software.  You can redistribute it or modify it under
  * the terms of version 2 of the GNU General Public License (GPL), as published
@@ -31,7 +31,10 @@ const char *const fcd_pwm_state_names[FCD_PWM_STATE_ARRAY_SIZE] = {
 	"MAXIMUM"
 };
 
-static const char fcd_pwm_file[] = "/run/n5550/it87/pwm3";
+/* it87 PWM output (pwmN) */
+static int fcd_pwm_channel = 3;		/* sysfan_pwm_channel */
+static char fcd_pwm_file[FCD_HWMON_ATTR_SIZE];
+
 static enum fcd_pwm_state fcd_pwm_current_state = FCD_PWM_STATE_NORMAL;
 static int fcd_pwm_fd;
 
@@ -62,6 +65,12 @@ static const cip_opt_info fcd_pwm_opts[] = {
 		.post_parse_fn		= fcd_pwm_cb,
 		.post_parse_data	= &fcd_pwm_values[FCD_PWM_STATE_MAX],
 	},
+	{
+		.name			= "sysfan_pwm_channel",
+		.type			= CIP_OPT_TYPE_INT,
+		.post_parse_fn		= fcd_hwmon_channel_cb,
+		.post_parse_data	= &fcd_pwm_channel,
+	},
 	{	.name			= NULL		}
 };
 
@@ -90,16 +99,10 @@ static int fcd_pwm_cb(cip_err_ctx *const ctx, const cip_ini_value *const value,
 	return 0;
 }
 
-static void fcd_pwm_set(const enum fcd_pwm_state new)
+static void fcd_pwm_write(const enum fcd_pwm_state new)
 {
 	ssize_t ret;
 
-	if (fcd_pwm_current_state == new)
-		return;
-
-	FCD_INFO("Changing fan speed from %s to %s\n",
-		 fcd_pwm_state_names[fcd_pwm_current_state], fcd_pwm_state_names[new]);
-
 	ret = write(fcd_pwm_fd, fcd_pwm_values[new].s, fcd_pwm_values[new].len);
 	if (ret < 0)
 		FCD_PABORT(fcd_pwm_file);
@@ -109,6 +112,22 @@ static void fcd_pwm_set(const enum fcd_pwm_state new)
 	fcd_pwm_current_state = new;
 }
 
+static void fcd_pwm_set(const enum fcd_pwm_state new)
+{
+	if (fcd_pwm_current_state == new)
+		return;
+
+	FCD_INFO("Changing fan speed from %s to %s\n",
+		 fcd_pwm_state_names[fcd_pwm_current_state], fcd_pwm_state_names[new]);
+
+	fcd_pwm_write(new);
+}
+
+enum fcd_pwm_state fcd_pwm_state(void)
+{
+	return fcd_pwm_current_state;
+}
+
 void fcd_pwm_update(struct fcd_monitor *const mon)
 {
 	uint8_t flags;
@@ -157,12 +176,30 @@ void fcd_pwm_update(struct fcd_monitor *const mon)
 
 void fcd_pwm_init(void)
 {
-	if (fcd_pwm_monitor.enabled) {
+	int restored;
 
-		if ((fcd_pwm_fd = open(fcd_pwm_file, O_WRONLY | O_CLOEXEC)) < 0)
-			FCD_PFATAL(fcd_pwm_file);
+	if (fcd_pwm_monitor.enabled) {
 
-		fcd_pwm_set(FCD_PWM_STATE_MAX);
+		sprintf(fcd_pwm_file, "pwm%d", fcd_pwm_channel);
+
+		fcd_pwm_fd = fcd_hwmon_open(FCD_HWMON_IT87, fcd_pwm_file,
+					    O_WRONLY);
+		if (fcd_pwm_fd < 0)
+			FCD_FATAL("Cannot control system fan speed\n");
+
+		/*
+		 * Run the fan at full speed until the monitors report in, unless
+		 * a fan speed was restored from a previous run.
+		 */
+		restored = fcd_state_pwm_state();
+		if (restored >= 0) {
+			FCD_INFO("Restoring fan speed: %s\n",
+				 fcd_pwm_state_names[restored]);
+			fcd_pwm_write(restored);
+		}
+		else {
+			fcd_pwm_write(FCD_PWM_STATE_MAX);
+		}
 	}
 	else {
 		FCD_INFO("System fan speed management (PWM) disabled\n");
@@ -181,6 +218,7 @@ static void fcd_pwm_dump_cfg(void)
 {
 	int i;
 
+	FCD_DUMP("\tit87 channel: %d\n", fcd_pwm_channel);
 	FCD_DUMP("\tPWM values:\n");
 
 	for (i = 0; i < FCD_PWM_STATE_ARRAY_SIZE; ++i) {
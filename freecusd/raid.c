@@ -1,5 +1,5 @@
 /*
- * Copyright 2013-2014, 2020 Ian Pilcher <arequipeno@gmail.com>
+ * Copyright 2013-2014, 2020, 2026 Ian Pilcher <arequipeno@gmail.com>
  *
  * This program is free software.  You can redistribute it or modify it under
  * the terms of version 2 of the GNU General Public License (GPL), as published
@@ -18,15 +18,64 @@
 
 #include <limits.h>
 #include <string.h>
+#include <ctype.h>
 #include <regex.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <time.h>
 
 /* Max size of a RAID array kernel name - 11 chars + terminating 0 */
 #define FCD_RAID_DEVNAME_SIZE		12
 
-/* /sys/devices/virtual/block/<DEV>/md/array_state; <DEV> is 11 chars max */
-#define FCD_RAID_SYSFS_FILE_SIZE	54
+/* Max size of a member device name (e.g. sda12) - 7 chars + terminating 0 */
+#define FCD_RAID_MEMBER_SIZE		8
+
+/*
+ * /sys/devices/virtual/block/<DEV>/md/dev-<MEMBER>/errors; <DEV> is 11 chars
+ * max, <MEMBER> is 7
+ */
+#define FCD_RAID_SYSFS_FILE_SIZE	61
+
+/*
+ * /proc/mdstat, the /etc inotify watch, and degraded & sync_action for each
+ * array.  (array_state isn't polled; it changes between clean and active on
+ * every burst of writes, and /proc/mdstat already signals starts and stops.)
+ */
+#define FCD_RAID_MAX_POLL_FDS		(2 + 2 * FCD_MDSTAT_MAX_ARRAYS)
+
+/* Max number of arrays tracked (from mdadm.conf or seen in /proc/mdstat) */
+#define FCD_RAID_MAX_ARRAYS		128
+
+/* Size of the UUID & name indexes (power of 2, at least 2 * max arrays) */
+#define FCD_RAID_INDEX_SIZE		256
+#define FCD_RAID_INDEX_MASK		(FCD_RAID_INDEX_SIZE - 1)
+
+/* Number of sync progress samples used to calculate the average speed */
+#define FCD_RAID_SYNC_SAMPLES		10
+
+/* Re-read interval (seconds) while a sync is running */
+#define FCD_RAID_SYNC_POLL		30
+
+/* A sync that makes no progress for this long (seconds) is "stalled" */
+#define FCD_RAID_STALL_TIME		300
+
+/* Big enough for any md/sync_action value ("recover", etc.) */
+#define FCD_RAID_SYNC_ACTION_SIZE	8
+
+/* Number of mismatch_cnt results kept for each array */
+#define FCD_RAID_MM_HISTORY		8
+
+/* Persistent mismatch_cnt history */
+#define FCD_RAID_MM_DIR			"/var/lib/freecusd"
+#define FCD_RAID_MM_FILE		FCD_RAID_MM_DIR "/mismatch_cnt"
+#define FCD_RAID_MM_TMP_FILE		FCD_RAID_MM_DIR "/mismatch_cnt.tmp"
+
+/* Time (ms) to let a burst of md events settle before re-reading */
+#define FCD_RAID_SETTLE_MS		100
 
 /* Buffer size required for a UUID - aaaaaaaa:bbbbbbbb:cccccccc:dddddddd */
 #define FCD_RAID_UUID_BUF_SIZE		36
@@ -34,39 +83,37 @@
 /* Max size of buffer used to read /etc/mdadm.conf and /proc/mdstat */
 #define FCD_RAID_FILE_BUF_SIZE		20000
 
-/*
- * Regex to match/parse the initial portion of an array in /proc/mdstat
- */
-static const char fcd_raid_mdstat_array_pattern_1[] =
-	"^([^[:space:]]+) : "				// 1 - RAID device
-	"(active|inactive) "				// 2 - [in]active
-	"(\\(read-only\\) |\\(auto-read-only\\) )?"	// 3 - [auto-]read-only
-	"(faulty |linear |multipath |raid0 |raid1 |"	// 4 - personality
-		"raid4 |raid5 |raid6 |raid10 )?";
+/* Parsed contents of /proc/mdstat */
+static struct fcd_mdstat fcd_raid_mdstat;
 
-static regmatch_t fcd_raid_mdstat_array_matches_1[5];
+/* Seconds between re-reads of /proc/mdstat if no md events occur */
+static int fcd_raid_poll_interval = 300;	/* raid_safety_poll */
 
-/*
- * Regex to match/parse a single RAID array member in /proc/mdstat
- */
-static const char fcd_raid_mdstat_dev_pattern[] =
-	"^([[:alnum:]-]+)"			// 1 - device name
-	"\\[([[:digit:]]+)\\]"			// 2 - device number
-	"(\\([WFSR]\\))?";			// 3 - device status
+/* Warn if a check finds more mismatches than this (or more than last time) */
+static int fcd_raid_mm_threshold = 0;		/* raid_mismatch_threshold */
 
-static regmatch_t fcd_raid_mdstat_dev_matches[4];
+static int fcd_raid_poll_cb();
+static int fcd_raid_mm_threshold_cb();
 
-/*
- * Regex to match/parse the end of the second line of an array in /proc/mdstat
- */
-static const char fcd_raid_mdstat_array_pattern_2[] =
-	"([[:digit:]]+ near-copies )?"		// 1 - # near-copies
-	"([[:digit:]]+ (far|offset)-copies )?"	// 2 - # far/offset-copies
-	"\\[([[:digit:]]+)/"			// 4 - "ideal" devices
-	"([[:digit:]]+)\\]"			// 5 - current devices
-	" \\[([U_]+)\\]$";			// 6 - device status summary
+/* inotify watch on /etc, to catch changes to mdadm.conf; -1 if none */
+static int fcd_raid_inotify_fd = -1;
+static _Bool fcd_raid_conf_changed;
 
-static regmatch_t fcd_raid_mdstat_array_matches_2[7];
+static const cip_opt_info fcd_raid_opts[] = {
+	{
+		.name			= "raid_safety_poll",
+		.type			= CIP_OPT_TYPE_INT,
+		.post_parse_fn		= fcd_raid_poll_cb,
+		.post_parse_data	= &fcd_raid_poll_interval,
+	},
+	{
+		.name			= "raid_mismatch_threshold",
+		.type			= CIP_OPT_TYPE_INT,
+		.post_parse_fn		= fcd_raid_mm_threshold_cb,
+		.post_parse_data	= &fcd_raid_mm_threshold,
+	},
+	{	.name			= NULL		}
+};
 
 /*
  * Regex to match/parse an array that is identified by UUID in /etc/mdadm.conf
@@ -94,26 +141,6 @@ struct fcd_raid_regex {
 };
 
 static struct fcd_raid_regex fcd_raid_regexes[] = {
-	{
-		.cflags 	= REG_EXTENDED | REG_NEWLINE,
-		.pattern	= fcd_raid_mdstat_array_pattern_1,
-		.matches	= fcd_raid_mdstat_array_matches_1,
-		.nmatch		= FCD_ARRAY_SIZE(
-					fcd_raid_mdstat_array_matches_1),
-	},
-	{
-		.cflags		= REG_EXTENDED | REG_NEWLINE,
-		.pattern	= fcd_raid_mdstat_dev_pattern,
-		.matches	= fcd_raid_mdstat_dev_matches,
-		.nmatch		= FCD_ARRAY_SIZE(fcd_raid_mdstat_dev_matches),
-	},
-	{
-		.cflags		= REG_EXTENDED | REG_NEWLINE,
-		.pattern	= fcd_raid_mdstat_array_pattern_2,
-		.matches	= fcd_raid_mdstat_array_matches_2,
-		.nmatch		= FCD_ARRAY_SIZE(
-					fcd_raid_mdstat_array_matches_2),
-	},
 	{
 		.cflags		= REG_EXTENDED | REG_NEWLINE | REG_ICASE,
 		.pattern	= fcd_raid_conf_array_pattern,
@@ -140,8 +167,7 @@ static char *fcd_raid_mdadm_cmd[] = {
 };
 
 /* Buffer used by fcd_raid_get_uuid for mdadm output */
-static char *fcd_raid_uuid_buf = NULL;
-static size_t fcd_raid_uuid_buf_size = 0;
+static struct fcd_lib_buf fcd_raid_uuid_buf = FCD_LIB_BUF_INIT("mdadm", 1000);
 
 enum fcd_raid_type {
 	FCD_RAID_TYPE_FAULTY,
@@ -161,15 +187,15 @@ struct fcd_raid_type_match {
 };
 
 const struct fcd_raid_type_match fcd_raid_type_matches[] = {
-	{ FCD_RAID_TYPE_FAULTY,		"faulty " },
-	{ FCD_RAID_TYPE_LINEAR,		"linear " },
-	{ FCD_RAID_TYPE_MULTIPATH,	"multipath " },
-	{ FCD_RAID_TYPE_RAID0,		"raid0 " },
-	{ FCD_RAID_TYPE_RAID1,		"raid1 " },
-	{ FCD_RAID_TYPE_RAID4,		"raid4 " },
-	{ FCD_RAID_TYPE_RAID5,		"raid5 " },
-	{ FCD_RAID_TYPE_RAID6,		"raid6 " },
-	{ FCD_RAID_TYPE_RAID10,		"raid10 " },
+	{ FCD_RAID_TYPE_FAULTY,		"faulty" },
+	{ FCD_RAID_TYPE_LINEAR,		"linear" },
+	{ FCD_RAID_TYPE_MULTIPATH,	"multipath" },
+	{ FCD_RAID_TYPE_RAID0,		"raid0" },
+	{ FCD_RAID_TYPE_RAID1,		"raid1" },
+	{ FCD_RAID_TYPE_RAID4,		"raid4" },
+	{ FCD_RAID_TYPE_RAID5,		"raid5" },
+	{ FCD_RAID_TYPE_RAID6,		"raid6" },
+	{ FCD_RAID_TYPE_RAID10,		"raid10" },
 };
 
 enum fcd_raid_arr_stat {
@@ -192,762 +218,2060 @@ enum fcd_raid_dev_stat {
 	FCD_RAID_DEV_REPLACEMENT,
 };
 
+/* Progress of a resync/recovery/check/etc. */
+struct fcd_raid_sync {
+	char action[FCD_RAID_SYNC_ACTION_SIZE];	/* empty if idle */
+	uint64_t done[FCD_RAID_SYNC_SAMPLES];	/* sectors */
+	time_t time[FCD_RAID_SYNC_SAMPLES];
+	unsigned next;				/* next sample slot */
+	unsigned count;				/* # of valid samples */
+	uint64_t last_done;			/* last md/sync_completed */
+	uint64_t total;				/* sectors; 0 = unknown */
+	unsigned permille;
+	unsigned speed;				/* KiB/s */
+	unsigned speed_min;			/* md/sync_speed_min */
+	unsigned speed_max;			/* md/sync_speed_max */
+	time_t eta;				/* seconds; -1 = unknown */
+	time_t last_progress;
+	_Bool pending;				/* delayed by another array */
+	_Bool stalled;
+	_Bool slow;
+};
+
+/* Member device states (md/dev-XXX/state) that indicate trouble */
+#define FCD_RAID_MEMBER_FAULTY		0x01
+#define FCD_RAID_MEMBER_WRITE_ERROR	0x02
+#define FCD_RAID_MEMBER_WANT_REPLACE	0x04
+#define FCD_RAID_MEMBER_BLOCKED		0x08
+
+/* Health of an array member -- md/dev-XXX/{errors,state} */
+struct fcd_raid_member {
+	char name[FCD_RAID_MEMBER_SIZE];	/* empty if not a member */
+	unsigned baseline;			/* errors when first seen */
+	unsigned errors;			/* corrected read errors */
+	unsigned state;				/* FCD_RAID_MEMBER_* flags */
+	_Bool known;				/* baseline is valid */
+};
+
+/* mismatch_cnt results of completed checks, oldest first */
+struct fcd_raid_mm {
+	uint32_t uuid[4];
+	unsigned count;
+	struct {
+		time_t when;			/* wall clock time */
+		uint64_t mismatches;
+	} hist[FCD_RAID_MM_HISTORY];
+};
+
 struct fcd_raid_array {
 	uint32_t uuid[4];
-	struct fcd_raid_array *next;
 	char name[FCD_RAID_DEVNAME_SIZE];
-	int sysfs_fd;
+	int sysfs_fd;			/* md/array_state */
+	int degraded_fd;		/* md/degraded (redundant arrays) */
+	int sync_action_fd;		/* md/sync_action (ditto) */
 	int transient;
 	unsigned ideal_devs;
 	unsigned current_devs;
 	enum fcd_raid_type type;
 	enum fcd_raid_arr_stat array_status;
 	enum fcd_raid_dev_stat dev_status[FCD_MAX_DISK_COUNT];
+	struct fcd_raid_member members[FCD_MAX_DISK_COUNT];
+	struct fcd_raid_sync sync;
+	struct fcd_raid_mm *mm;			/* NULL if no history */
 };
 
-static struct fcd_raid_array *fcd_raid_list = NULL;
-static struct fcd_raid_array **fcd_raid_list_end = &fcd_raid_list;
-
-static void fcd_raid_list_append(struct fcd_raid_array *array)
-{
-	array->next = NULL;
-	*fcd_raid_list_end = array;
-	fcd_raid_list_end = &array->next;
-}
-
-static struct fcd_raid_array *fcd_raid_find_by_substr(const char *s, size_t len)
+/*
+ * Configuration callback for the mismatch_cnt warning threshold
+ */
+static int fcd_raid_mm_threshold_cb(cip_err_ctx *ctx,
+				    const cip_ini_value *value,
+				    const cip_ini_sect *sect
+						__attribute__((unused)),
+				    const cip_ini_file *file
+						__attribute__((unused)),
+				    void *post_parse_data)
 {
-	struct fcd_raid_array *array;
+	int threshold;
 
-	for (array = fcd_raid_list; array != NULL; array = array->next) {
+	memcpy(&threshold, value->value, sizeof threshold);
 
-		if (strlen(array->name) == len &&
-				memcmp(s, array->name, len) == 0)
-			return array;
+	if (threshold < 0) {
+		cip_err(ctx, "Invalid RAID mismatch threshold: %d", threshold);
+		return -1;
 	}
 
-	return NULL;
+	*(int *)post_parse_data = threshold;
+
+	return 0;
 }
 
-static struct fcd_raid_array *fcd_raid_find_by_uuid(const uint32_t *uuid)
+/*
+ * Configuration callback for the safety poll interval
+ */
+static int fcd_raid_poll_cb(cip_err_ctx *ctx, const cip_ini_value *value,
+			    const cip_ini_sect *sect __attribute__((unused)),
+			    const cip_ini_file *file __attribute__((unused)),
+			    void *post_parse_data)
 {
-	struct fcd_raid_array *array;
+	int interval;
 
-	for (array = fcd_raid_list; array != NULL; array = array->next) {
+	memcpy(&interval, value->value, sizeof interval);
 
-		if (memcmp(array->uuid, uuid, sizeof *uuid) == 0)
-			return array;
+	if (interval < 30 || interval > 3600) {
+		cip_err(ctx, "Invalid RAID safety poll interval: %d",
+			interval);
+		return -1;
 	}
 
-	return NULL;
+	*(int *)post_parse_data = interval;
+
+	return 0;
 }
 
-static int fcd_raid_close_array_fd(struct fcd_raid_array *array)
+/*
+ * Array records are kept in a fixed table, with 2 open-addressed (linear
+ * probing) indexes -- by UUID and by (current) device name.  Each index slot
+ * holds a table index + 1 (0 = empty slot), and the indexes are never more
+ * than half full.  Arrays are never removed, but an array's name is removed
+ * from the name index when it is stopped (see fcd_raid_close_array_fd).
+ */
+static struct fcd_raid_array fcd_raid_arrays[FCD_RAID_MAX_ARRAYS];
+static unsigned fcd_raid_count;
+static uint8_t fcd_raid_by_uuid[FCD_RAID_INDEX_SIZE];
+static uint8_t fcd_raid_by_name[FCD_RAID_INDEX_SIZE];
+
+/* UUIDs are (pseudo-)random, so there's no need to do anything fancy */
+static unsigned fcd_raid_uuid_hash(const uint32_t *uuid)
 {
-	if (close(array->sysfs_fd) == -1) {
-		FCD_PERROR("close");
-		return -1;
-	}
+	return (uuid[0] ^ uuid[1] ^ uuid[2] ^ uuid[3]) & FCD_RAID_INDEX_MASK;
+}
 
-	array->sysfs_fd = -1;
+/* FNV-1a */
+static unsigned fcd_raid_name_hash(const char *s, size_t len)
+{
+	uint32_t hash;
 
-	memset(array->name, 0, sizeof array->name);
+	for (hash = 2166136261u; len > 0; --len, ++s)
+		hash = (hash ^ (unsigned char)*s) * 16777619u;
 
-	return 0;
+	return hash & FCD_RAID_INDEX_MASK;
 }
 
-static int fcd_raid_array_unchanged(struct fcd_raid_array *array)
+/*
+ * Returns the index of the name's slot in the name index, or the index of the
+ * empty slot where it would be inserted.
+ */
+static unsigned fcd_raid_name_slot(const char *s, size_t len)
 {
-	ssize_t ret;
-	char c;
+	const struct fcd_raid_array *array;
+	unsigned i;
 
-	if (lseek(array->sysfs_fd, SEEK_SET, 0) == -1) {
-		FCD_PERROR("lseek");
-		return -1;
-	}
+	for (i = fcd_raid_name_hash(s, len); fcd_raid_by_name[i] != 0;
+					i = (i + 1) & FCD_RAID_INDEX_MASK) {
 
-	ret = read(array->sysfs_fd, &c, 1);
+		array = &fcd_raid_arrays[fcd_raid_by_name[i] - 1];
 
-	switch (ret) {
+		if (strlen(array->name) == len &&
+				memcmp(s, array->name, len) == 0)
+			break;
+	}
 
-		case 1:		return 1;
+	return i;
+}
 
-		case 0:		FCD_ERR("Unexpected EOF\n");
-				return -1;
+static unsigned fcd_raid_uuid_slot(const uint32_t *uuid)
+{
+	const struct fcd_raid_array *array;
+	unsigned i;
 
-		case -1:	if (errno == ENODEV)
-					return fcd_raid_close_array_fd(array);
-				FCD_PERROR("read");
-				return -1;
+	for (i = fcd_raid_uuid_hash(uuid); fcd_raid_by_uuid[i] != 0;
+					i = (i + 1) & FCD_RAID_INDEX_MASK) {
 
-		default:	FCD_ABORT("read returned %zd\n", ret);
+		array = &fcd_raid_arrays[fcd_raid_by_uuid[i] - 1];
+
+		if (memcmp(array->uuid, uuid, sizeof array->uuid) == 0)
+			break;
 	}
+
+	return i;
 }
 
-static void fcd_raid_parse_uuid(uint32_t *uuid, const char *s)
+static struct fcd_raid_array *fcd_raid_find_by_substr(const char *s, size_t len)
 {
-	int i;
+	unsigned i;
 
-	/*
-	 * Called from fcd_raid_get_uuid and fcd_raid_read_mdadm_conf, both of
-	 * which use regular expressions that only match valid UUIDs.
-	 */
+	i = fcd_raid_by_name[fcd_raid_name_slot(s, len)];
 
-	for (i = 3; i >= 0; --i, s += 9)
-		uuid[i] = (uint32_t)strtoul(s, NULL, 16);
+	return (i == 0) ? NULL : &fcd_raid_arrays[i - 1];
 }
 
-static int fcd_raid_get_uuid(uint32_t *uuid, const char *c,
-			     const regmatch_t *match, const int *pipe_fds)
+static struct fcd_raid_array *fcd_raid_find_by_uuid(const uint32_t *uuid)
 {
-	static const struct fcd_raid_regex *const regex = &fcd_raid_regexes[4];
-	static regmatch_t *const matches = fcd_raid_detail_matches;
-	struct timespec timeout;
-	size_t name_len;
-	int ret, status;
-
-	/*
-	 * fcd_raid_get_uuid is only called from fcd_raid_find_array which
-	 * checks the length of the device name
-	 */
+	unsigned i;
 
-	name_len = match->rm_eo - match->rm_so;
-	memcpy(fcd_raid_mdadm_dev + 5, c + match->rm_so, name_len);
-	(fcd_raid_mdadm_dev + 5)[name_len] = 0;
+	i = fcd_raid_by_uuid[fcd_raid_uuid_slot(uuid)];
 
-	timeout.tv_sec = 2;
-	timeout.tv_nsec = 0;
+	return (i == 0) ? NULL : &fcd_raid_arrays[i - 1];
+}
 
-	ret = fcd_lib_cmd_output(&status, fcd_raid_mdadm_cmd,
-				 &fcd_raid_uuid_buf, &fcd_raid_uuid_buf_size,
-				 1000, &timeout, pipe_fds);
-	if (ret < 0) {
-		if (ret == -2)
-			FCD_WARN("mdadm command timed out\n");
-		return ret;
-	}
+/* Sets an array's name and adds it to the name index */
+static void fcd_raid_set_name(struct fcd_raid_array *array, const char *name,
+			      size_t len)
+{
+	memcpy(array->name, name, len);
+	array->name[len] = 0;
 
-	if (status != 0) {
-		FCD_WARN("Non-zero mdadm exit status: %d\n");
-		return -1;
-	}
+	fcd_raid_by_name[fcd_raid_name_slot(name, len)] =
+						array - fcd_raid_arrays + 1;
+}
 
-	ret = regexec(&regex->regex, fcd_raid_uuid_buf,
-		      regex->nmatch, matches, 0);
-	if (ret != 0) {
-		FCD_WARN("Error parsing mdadm output\n");
-		return -1;
-	}
+/* Removes an array's name from the name index and clears it */
+static void fcd_raid_clear_name(struct fcd_raid_array *array)
+{
+	unsigned i, j, k;
+	const char *n;
+	size_t len;
 
-	fcd_raid_parse_uuid(uuid, fcd_raid_uuid_buf + matches[1].rm_so);
+	len = strlen(array->name);
+	i = fcd_raid_name_slot(array->name, len);
 
-	return 0;
-}
+	if (fcd_raid_by_name[i] != 0) {
 
-static struct fcd_raid_array *fcd_raid_array_alloc(void)
-{
-	static const struct fcd_raid_array template = {
-		.sysfs_fd	= -1,
-	};
+		fcd_raid_by_name[i] = 0;
 
-	struct fcd_raid_array *array;
+		/* Move any following entries that can no longer be found */
+		for (j = (i + 1) & FCD_RAID_INDEX_MASK;
+				fcd_raid_by_name[j] != 0;
+				j = (j + 1) & FCD_RAID_INDEX_MASK) {
 
-	array = malloc(sizeof *array);
-	if (array == NULL)
-		FCD_PERROR("malloc");
-	else
-		*array = template;
+			n = fcd_raid_arrays[fcd_raid_by_name[j] - 1].name;
+			k = fcd_raid_name_hash(n, strlen(n));
 
-	return array;
-}
+			/* Is k cyclically in (i, j]?  If so, leave it. */
+			if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+				continue;
 
-static int fcd_raid_find_array_error(int fd, int ret)
-{
-	if (close(fd) == -1) {
-		FCD_PERROR("close");
-		return -1;
+			fcd_raid_by_name[i] = fcd_raid_by_name[j];
+			fcd_raid_by_name[j] = 0;
+			i = j;
+		}
 	}
 
-	return ret;
+	memset(array->name, 0, sizeof array->name);
 }
 
 /*
- * Returns 0 if array name/UUID mapping is known to have been stable since the
- * previous pass, 1 if mapping may have changed (-1 = error, -2 = timeout, -3 =
- * exit signal received, -4 = mdadm output buffer size exceeded)
+ * mismatch_cnt histories.  Kept separately from the arrays, because the history
+ * file may contain arrays that aren't (yet) known.
  */
-static int fcd_raid_find_array(struct fcd_raid_array **array, const char *buf,
-			       const regmatch_t *match, const int *pipe_fds)
-{
-	static char sysfs_file[FCD_RAID_SYSFS_FILE_SIZE];
-	int ret, sysfs_fd;
-	uint32_t uuid[4];
-	size_t name_len;
+static struct fcd_raid_mm fcd_raid_mms[FCD_RAID_MAX_ARRAYS];
+static unsigned fcd_raid_mm_count;
 
-	name_len = match->rm_eo - match->rm_so;
-	if (name_len >= FCD_RAID_DEVNAME_SIZE - 1) {
-		FCD_WARN("RAID device name '%.*s' too long\n", (int)name_len,
-			 buf + match->rm_so);
-#ifdef __OPTIMIZE_SIZE__
-		/* See https://bugzilla.redhat.com/show_bug.cgi?id=1018422 */
-		*array = NULL;
-#endif
-		return -1;
-	}
+/*
+ * Returns the mismatch_cnt history for a UUID.  If there is none, creates one
+ * (if create is set) or returns NULL.
+ */
+static struct fcd_raid_mm *fcd_raid_mm_find(const uint32_t *uuid, int create)
+{
+	struct fcd_raid_mm *mm;
+	unsigned i;
 
-	*array = fcd_raid_find_by_substr(buf + match->rm_so, name_len);
-	if (*array != NULL) {
+	for (i = 0; i < fcd_raid_mm_count; ++i) {
 
-		ret = fcd_raid_array_unchanged(*array);
-		if (ret == -1)
-			return -1;
-		if (ret == 1)
-			return 0;
-	}
+		mm = &fcd_raid_mms[i];
 
-	sprintf(sysfs_file, "/sys/devices/virtual/block/%.*s/md/array_state",
-		(int)name_len, buf + match->rm_so);
-	sysfs_fd = open(sysfs_file, O_RDONLY | O_CLOEXEC);
-	if (sysfs_fd == -1) {
-		if (errno == ENOENT)
-			return 1;
-		FCD_PERROR(sysfs_file);
-		return -1;
+		if (memcmp(mm->uuid, uuid, sizeof mm->uuid) == 0)
+			return mm;
 	}
 
-	ret = fcd_raid_get_uuid(uuid, buf, match, pipe_fds);
-	if (ret < 0)
-		return fcd_raid_find_array_error(sysfs_fd, ret);
+	if (!create)
+		return NULL;
 
-	*array = fcd_raid_find_by_uuid(uuid);
-	if (*array == NULL) {
-		*array = fcd_raid_array_alloc();
-		if (*array == NULL)
-			return fcd_raid_find_array_error(sysfs_fd, -1);
-		memcpy((*array)->uuid, uuid, sizeof uuid);
-		(*array)->transient = 1;
-		fcd_raid_list_append(*array);
-	}
-	else if ((*array)->sysfs_fd != -1 &&
-				fcd_raid_close_array_fd(*array) == -1) {
-		return fcd_raid_find_array_error(sysfs_fd, -1);
+	if (fcd_raid_mm_count == FCD_RAID_MAX_ARRAYS) {
+		FCD_WARN("Too many arrays in mismatch_cnt history\n");
+		return NULL;
 	}
 
-	memcpy((*array)->name, buf + match->rm_so, name_len);
-	(*array)->name[name_len] = 0;
-	(*array)->sysfs_fd = sysfs_fd;
+	mm = &fcd_raid_mms[fcd_raid_mm_count++];
+	memcpy(mm->uuid, uuid, sizeof mm->uuid);
+	mm->count = 0;
 
-	return 1;
+	return mm;
 }
 
-static enum fcd_raid_type fcd_raid_parse_type(const char *buf,
-					      const regmatch_t *match)
+static void fcd_raid_mm_add(struct fcd_raid_mm *mm, time_t when,
+			    uint64_t mismatches)
 {
-	const char *m;
-	size_t len;
-	unsigned i;
-
-	m = buf + match->rm_so;
-	len = match->rm_eo - match->rm_so;
-
-	for (i = 0; i < FCD_ARRAY_SIZE(fcd_raid_type_matches); ++i) {
-
-		if (strncmp(fcd_raid_type_matches[i].match, m, len) == 0)
-			return fcd_raid_type_matches[i].type;
+	if (mm->count == FCD_RAID_MM_HISTORY) {
+		memmove(mm->hist, mm->hist + 1,
+			(FCD_RAID_MM_HISTORY - 1) * sizeof mm->hist[0]);
+		--mm->count;
 	}
 
-	/* Regex should prevent this from ever happening */
-	FCD_ABORT("Unknown personality: %.20s\n", match);
+	mm->hist[mm->count].when = when;
+	mm->hist[mm->count].mismatches = mismatches;
+	++mm->count;
 }
 
 /*
- * Returns # of characters matched (0 = no match, -1 = error)
+ * Returns 1 if the most recent check found more mismatches than the threshold
+ * or than the previous check.
  */
-static regoff_t fcd_raid_parse_dev(const char *c, struct fcd_raid_array *array)
+static int fcd_raid_mm_warn(const struct fcd_raid_mm *mm)
 {
-	static const struct fcd_raid_regex *const regex = &fcd_raid_regexes[1];
-	static regmatch_t *const matches = fcd_raid_mdstat_dev_matches;
-	int i;
+	uint64_t last;
 
-	if (regexec(&regex->regex, c, regex->nmatch, matches, 0) != 0)
+	if (mm == NULL || mm->count == 0)
 		return 0;
 
-	/*
-	 * Assume that device (match 1) is either a SCSI disk (sdX) or a
-	 * partition on a SCSI disk (sdXyy), where X is in the range a-z
-	 */
+	last = mm->hist[mm->count - 1].mismatches;
 
-	i = fcd_lib_disk_index((c + matches[1].rm_so)[2]);
-	if (i == -1) {
-		FCD_WARN("Unexpected RAID array member: %.*s\n",
-			 (int)(matches[1].rm_eo - matches[1].rm_so),
-			 c + matches[1].rm_so);
-		return -1;
-	}
+	if (last > (uint64_t)fcd_raid_mm_threshold)
+		return 1;
 
-	if (matches[3].rm_so == -1) {
-		array->dev_status[i] = FCD_RAID_DEV_ACTIVE;
-	}
-	else {
-		switch (c[matches[3].rm_so + 1])
-		{
-			case 'W':
-				array->dev_status[i] = FCD_RAID_DEV_WRITEMOSTLY;
-				break;
+	return mm->count > 1 && last > mm->hist[mm->count - 2].mismatches;
+}
 
-			case 'F':
-				array->dev_status[i] = FCD_RAID_DEV_FAILED;
-				break;
+/*
+ * Adds an array with the given UUID (if it isn't already known).  Returns a
+ * pointer to the array, or NULL if the table is full.
+ */
+static struct fcd_raid_array *fcd_raid_array_add(const uint32_t *uuid)
+{
+	static const struct fcd_raid_array template = {
+		.sysfs_fd	= -1,
+		.degraded_fd	= -1,
+		.sync_action_fd	= -1,
+	};
 
-			case 'S':
-				array->dev_status[i] = FCD_RAID_DEV_SPARE;
-				break;
+	struct fcd_raid_array *array;
+	unsigned i;
 
-			case 'R':
-				array->dev_status[i] = FCD_RAID_DEV_REPLACEMENT;
-				break;
-		}
+	i = fcd_raid_uuid_slot(uuid);
+	if (fcd_raid_by_uuid[i] != 0)
+		return &fcd_raid_arrays[fcd_raid_by_uuid[i] - 1];
+
+	if (fcd_raid_count == FCD_RAID_MAX_ARRAYS) {
+		FCD_WARN("Too many RAID arrays\n");
+		return NULL;
 	}
 
-	return matches[0].rm_eo;
+	array = &fcd_raid_arrays[fcd_raid_count++];
+	*array = template;
+	memcpy(array->uuid, uuid, sizeof array->uuid);
+	array->mm = fcd_raid_mm_find(uuid, 0);
+	fcd_raid_by_uuid[i] = fcd_raid_count;
+
+	return array;
 }
 
-static int fcd_raid_parse_devs(const char *c, struct fcd_raid_array *array)
+static int fcd_raid_close_attr_fd(int *fd)
 {
-	regoff_t ret;
-	size_t i;
+	int ret;
 
-	for (i = 0; i < FCD_ARRAY_SIZE(array->dev_status); ++i) {
+	if (*fd == -1)
+		return 0;
 
-		if (array->dev_status[i] != FCD_RAID_DEV_UNKNOWN)
-			array->dev_status[i] = FCD_RAID_DEV_EXPECTED;
+	ret = close(*fd);
+	*fd = -1;
+
+	if (ret == -1) {
+		FCD_PERROR("close");
+		return -1;
 	}
 
+	return 0;
+}
+
+static int fcd_raid_close_array_fd(struct fcd_raid_array *array)
+{
+	if (close(array->sysfs_fd) == -1) {
+		FCD_PERROR("close");
+		return -1;
+	}
+
+	array->sysfs_fd = -1;
+
+	if (fcd_raid_close_attr_fd(&array->degraded_fd) == -1 ||
+			fcd_raid_close_attr_fd(&array->sync_action_fd) == -1)
+		return -1;
+
+	fcd_raid_clear_name(array);
+
+	return 0;
+}
+
+/*
+ * Reads (the first byte of) a sysfs attribute, which is required to "re-arm"
+ * it for poll.  Closes the file if the array has gone away.  Returns 0 on
+ * success, -1 on error.
+ */
+static int fcd_raid_rearm_attr(int *fd)
+{
+	char c;
+
+	if (lseek(*fd, 0, SEEK_SET) == -1) {
+		FCD_PERROR("lseek");
+		return -1;
+	}
+
+	if (read(*fd, &c, 1) == -1) {
+		if (errno == ENODEV)
+			return fcd_raid_close_attr_fd(fd);
+		FCD_PERROR("read");
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Opens (and arms) the md/degraded and md/sync_action attributes of an array.
+ * These only exist while a redundant array is running, so ENOENT is not an
+ * error.  Returns 0 on success, -1 on error.
+ */
+static int fcd_raid_open_attrs(struct fcd_raid_array *array)
+{
+	static char sysfs_file[FCD_RAID_SYSFS_FILE_SIZE];
+	static const char *const attrs[2] = { "degraded", "sync_action" };
+	int *fds[2];
+	unsigned i;
+
+	fds[0] = &array->degraded_fd;
+	fds[1] = &array->sync_action_fd;
+
+	for (i = 0; i < FCD_ARRAY_SIZE(attrs); ++i) {
+
+		if (*fds[i] != -1)
+			continue;
+
+		sprintf(sysfs_file, "/sys/devices/virtual/block/%s/md/%s",
+			array->name, attrs[i]);
+
+		*fds[i] = open(sysfs_file, O_RDONLY | O_CLOEXEC);
+		if (*fds[i] == -1) {
+			if (errno == ENOENT)
+				continue;
+			FCD_PERROR(sysfs_file);
+			return -1;
+		}
+
+		if (fcd_raid_rearm_attr(fds[i]) == -1)
+			return -1;
+	}
+
+	return 0;
+}
+
+static int fcd_raid_array_unchanged(struct fcd_raid_array *array)
+{
+	ssize_t ret;
+	char c;
+
+	if (lseek(array->sysfs_fd, SEEK_SET, 0) == -1) {
+		FCD_PERROR("lseek");
+		return -1;
+	}
+
+	ret = read(array->sysfs_fd, &c, 1);
+
+	switch (ret) {
+
+		case 1:		return 1;
+
+		case 0:		FCD_ERR("Unexpected EOF\n");
+				return -1;
+
+		case -1:	if (errno == ENODEV)
+					return fcd_raid_close_array_fd(array);
+				FCD_PERROR("read");
+				return -1;
+
+		default:	FCD_ABORT("read returned %zd\n", ret);
+	}
+}
+
+static void fcd_raid_parse_uuid(uint32_t *uuid, const char *s)
+{
+	int i;
+
+	/*
+	 * Called from fcd_raid_get_uuid and fcd_raid_read_mdadm_conf, both of
+	 * which use regular expressions that only match valid UUIDs.
+	 */
+
+	for (i = 3; i >= 0; --i, s += 9)
+		uuid[i] = (uint32_t)strtoul(s, NULL, 16);
+}
+
+/*
+ * Checks that a string (from a symlink name) is a valid UUID, so that it can be
+ * passed to fcd_raid_parse_uuid
+ */
+static int fcd_raid_uuid_valid(const char *s)
+{
+	int i;
+
+	for (i = 0; i < FCD_RAID_UUID_BUF_SIZE - 1; ++i) {
+
+		if (i % 9 == 8) {
+			if (s[i] != ':')
+				return 0;
+		}
+		else if (!isxdigit((unsigned char)s[i])) {
+			return 0;
+		}
+	}
+
+	return s[i] == 0;
+}
+
+/*
+ * Looks for a /dev/disk/by-id/md-uuid-<UUID> symlink (created by mdadm's udev
+ * rules) that points to the array.  Returns 0 if found, 1 if not found, or -1
+ * on error.
+ */
+static int fcd_raid_uuid_by_id(uint32_t *uuid, const char *name,
+			       size_t name_len)
+{
+	static const char path[] = "/dev/disk/by-id";
+	static const char prefix[] = "md-uuid-";
+	char target[FCD_RAID_DEVNAME_SIZE + 8];
+	struct dirent *d;
+	const char *base;
+	ssize_t len;
+	DIR *dir;
+	int ret;
+
+	dir = opendir(path);
+	if (dir == NULL) {
+		if (errno == ENOENT)
+			return 1;
+		FCD_PERROR(path);
+		return -1;
+	}
+
+	ret = 1;
+
+	while (errno = 0, (d = readdir(dir)) != NULL) {
+
+		if (strncmp(d->d_name, prefix, sizeof prefix - 1) != 0 ||
+			    !fcd_raid_uuid_valid(d->d_name + sizeof prefix - 1))
+			continue;
+
+		/* Target is "../../mdX" */
+		len = readlinkat(dirfd(dir), d->d_name, target, sizeof target);
+		if (len == -1) {
+			if (errno == ENOENT)	/* removed by udev */
+				continue;
+			FCD_PERROR(d->d_name);
+			ret = -1;
+			break;
+		}
+
+		if ((size_t)len >= sizeof target)
+			continue;
+
+		target[len] = 0;
+		base = strrchr(target, '/');
+		base = (base == NULL) ? target : base + 1;
+
+		if (strlen(base) == name_len &&
+				memcmp(base, name, name_len) == 0) {
+			fcd_raid_parse_uuid(uuid,
+					    d->d_name + sizeof prefix - 1);
+			ret = 0;
+			break;
+		}
+	}
+
+	if (d == NULL && errno != 0) {
+		FCD_PERROR("readdir");
+		ret = -1;
+	}
+
+	if (closedir(dir) == -1)
+		FCD_PERROR("closedir");
+
+	return ret;
+}
+
+/*
+ * Fallback for systems without the md-uuid-* symlinks (or if udev hasn't
+ * created the symlink for a newly assembled array yet)
+ */
+static int fcd_raid_mdadm_uuid(uint32_t *uuid, const char *name,
+			       size_t name_len)
+{
+	static const struct fcd_raid_regex *const regex = &fcd_raid_regexes[1];
+	static regmatch_t *const matches = fcd_raid_detail_matches;
+	struct timespec timeout;
+	int ret, status;
+
+	memcpy(fcd_raid_mdadm_dev + 5, name, name_len);
+	(fcd_raid_mdadm_dev + 5)[name_len] = 0;
+
+	timeout.tv_sec = 2;
+	timeout.tv_nsec = 0;
+
+	ret = fcd_lib_cmd_output(&status, fcd_raid_mdadm_cmd,
+				 &fcd_raid_uuid_buf, &timeout);
+	if (ret < 0) {
+		if (ret == -2)
+			FCD_WARN("mdadm command timed out\n");
+		return ret;
+	}
+
+	if (status != 0) {
+		FCD_WARN("Non-zero mdadm exit status: %d\n", status);
+		return -1;
+	}
+
+	ret = regexec(&regex->regex, fcd_raid_uuid_buf.data,
+		      regex->nmatch, matches, 0);
+	if (ret != 0) {
+		FCD_WARN("Error parsing mdadm output\n");
+		return -1;
+	}
+
+	fcd_raid_parse_uuid(uuid, fcd_raid_uuid_buf.data + matches[1].rm_so);
+
+	return 0;
+}
+
+static int fcd_raid_get_uuid(uint32_t *uuid, const char *name,
+			     size_t name_len)
+{
+	int ret;
+
+	/*
+	 * fcd_raid_get_uuid is only called from fcd_raid_find_array which
+	 * checks the length of the device name
+	 */
+
+	ret = fcd_raid_uuid_by_id(uuid, name, name_len);
+	if (ret != 1)
+		return ret;
+
+	FCD_DEBUG("No md-uuid symlink for %.*s; running mdadm\n",
+		  (int)name_len, name);
+
+	return fcd_raid_mdadm_uuid(uuid, name, name_len);
+}
+
+static int fcd_raid_find_array_error(int fd, int ret)
+{
+	if (close(fd) == -1) {
+		FCD_PERROR("close");
+		return -1;
+	}
+
+	return ret;
+}
+
+/*
+ * Returns 0 if array name/UUID mapping is known to have been stable since the
+ * previous pass, 1 if mapping may have changed (-1 = error, -2 = timeout, -3 =
+ * exit signal received, -4 = mdadm output buffer size exceeded)
+ */
+static int fcd_raid_find_array(struct fcd_raid_array **array, const char *name,
+			       size_t name_len)
+{
+	static char sysfs_file[FCD_RAID_SYSFS_FILE_SIZE];
+	int ret, sysfs_fd;
+	uint32_t uuid[4];
+
+	if (name_len >= FCD_RAID_DEVNAME_SIZE - 1) {
+		FCD_WARN("RAID device name '%.*s' too long\n", (int)name_len,
+			 name);
+#ifdef __OPTIMIZE_SIZE__
+		/* See https://bugzilla.redhat.com/show_bug.cgi?id=1018422 */
+		*array = NULL;
+#endif
+		return -1;
+	}
+
+	*array = fcd_raid_find_by_substr(name, name_len);
+	if (*array != NULL) {
+
+		ret = fcd_raid_array_unchanged(*array);
+		if (ret == -1)
+			return -1;
+		if (ret == 1)
+			return 0;
+	}
+
+	sprintf(sysfs_file, "/sys/devices/virtual/block/%.*s/md/array_state",
+		(int)name_len, name);
+	sysfs_fd = open(sysfs_file, O_RDONLY | O_CLOEXEC);
+	if (sysfs_fd == -1) {
+		if (errno == ENOENT)
+			return 1;
+		FCD_PERROR(sysfs_file);
+		return -1;
+	}
+
+	ret = fcd_raid_get_uuid(uuid, name, name_len);
+	if (ret < 0)
+		return fcd_raid_find_array_error(sysfs_fd, ret);
+
+	*array = fcd_raid_find_by_uuid(uuid);
+	if (*array == NULL) {
+		*array = fcd_raid_array_add(uuid);
+		if (*array == NULL)
+			return fcd_raid_find_array_error(sysfs_fd, -1);
+		(*array)->transient = 1;
+	}
+	else if ((*array)->sysfs_fd != -1 &&
+				fcd_raid_close_array_fd(*array) == -1) {
+		return fcd_raid_find_array_error(sysfs_fd, -1);
+	}
+
+	fcd_raid_set_name(*array, name, name_len);
+	(*array)->sysfs_fd = sysfs_fd;
+
+	return 1;
+}
+
+static enum fcd_raid_type fcd_raid_parse_type(
+				const struct fcd_mdstat_array *mdstat_array)
+{
+	unsigned i;
+
+	for (i = 0; i < FCD_ARRAY_SIZE(fcd_raid_type_matches); ++i) {
+
+		if (strlen(fcd_raid_type_matches[i].match) ==
+					mdstat_array->personality_len &&
+				memcmp(fcd_raid_type_matches[i].match,
+				       mdstat_array->personality,
+				       mdstat_array->personality_len) == 0) {
+			return fcd_raid_type_matches[i].type;
+		}
+	}
+
+	/* Missing or unknown personality; treat it like "faulty" */
+	return FCD_RAID_TYPE_FAULTY;
+}
+
+/*
+ * Returns 0 on success, -1 on error
+ */
+static int fcd_raid_parse_dev(const struct fcd_mdstat_dev *dev,
+			      struct fcd_raid_array *array)
+{
+	struct fcd_raid_member *member;
+	int i;
+
+	/*
+	 * Assume that device is either a SCSI disk (sdX) or a partition on a
+	 * SCSI disk (sdXyy), where X is in the range a-z
+	 */
+
+	if (dev->name_len < 3 ||
+			(i = fcd_lib_disk_index(dev->name[2])) == -1) {
+		FCD_WARN("Unexpected RAID array member: %.*s\n",
+			 (int)dev->name_len, dev->name);
+		return -1;
+	}
+
+	switch (dev->flag) {
+
+		case 0:
+			array->dev_status[i] = FCD_RAID_DEV_ACTIVE;
+			break;
+
+		case 'W':
+			array->dev_status[i] = FCD_RAID_DEV_WRITEMOSTLY;
+			break;
+
+		case 'F':
+			array->dev_status[i] = FCD_RAID_DEV_FAILED;
+			break;
+
+		case 'S':
+			array->dev_status[i] = FCD_RAID_DEV_SPARE;
+			break;
+
+		case 'R':
+			array->dev_status[i] = FCD_RAID_DEV_REPLACEMENT;
+			break;
+	}
+
+	/* Start tracking errors afresh if the member has changed */
+	member = &array->members[i];
+
+	if (dev->name_len >= sizeof member->name) {
+		memset(member, 0, sizeof *member);
+	}
+	else if (strlen(member->name) != dev->name_len ||
+			memcmp(member->name, dev->name, dev->name_len) != 0) {
+		memset(member, 0, sizeof *member);
+		memcpy(member->name, dev->name, dev->name_len);
+	}
+
+	return 0;
+}
+
+static int fcd_raid_parse_devs(const struct fcd_mdstat_array *mdstat_array,
+			       struct fcd_raid_array *array)
+{
+	const struct fcd_mdstat_dev *dev, *end;
+	size_t i;
+
+	for (i = 0; i < FCD_ARRAY_SIZE(array->dev_status); ++i) {
+
+		if (array->dev_status[i] != FCD_RAID_DEV_UNKNOWN)
+			array->dev_status[i] = FCD_RAID_DEV_EXPECTED;
+	}
+
+	dev = &fcd_raid_mdstat.devs[mdstat_array->first_dev];
+	end = dev + mdstat_array->dev_count;
+
+	for (; dev < end; ++dev) {
+		if (fcd_raid_parse_dev(dev, array) == -1)
+			return -1;
+	}
+
+	for (i = 0; i < FCD_ARRAY_SIZE(array->dev_status); ++i) {
+
+		if (array->dev_status[i] == FCD_RAID_DEV_EXPECTED)
+			array->dev_status[i] = FCD_RAID_DEV_MISSING;
+	}
+
+	return 0;
+}
+
+/*
+ * See http://en.wikipedia.org/wiki/Non-standard_RAID_levels#Linux_MD_RAID_10
+ * for a description of the RAID-10 layout.  Also see drivers/md/raid10.c in the
+ * Linux kernel sources.
+ *
+ * The logic of this function is inspired by the RAID-10 portion of the enough()
+ * function in mdadm's util.c.
+ */
+static int fcd_raid_r10_failed(const struct fcd_mdstat_array *mdstat_array,
+			       struct fcd_raid_array *array)
+{
+	uint16_t all_disks_mask, active_disks_mask, chunk_disks_mask, mask;
+	int near, far, copies, disks;
+	unsigned i;
+
+	near = mdstat_array->near_copies;
+	far = mdstat_array->far_copies;
+
+	copies = near * far;
+	disks = array->ideal_devs;
+
+	/* uint16_t can handle any 8-disk configuration */
+	if (disks + near > (int)(sizeof mask * CHAR_BIT))
+		FCD_ABORT("Bitmask data type too small for array\n");
+
+	/* Special case when there is a copy of every chunk on every disk */
+	if (copies == disks)
+		return array->current_devs < 1;
+
+	/* Special case with no redundancy */
+	if (copies == 1)
+		return 1;
+
+	all_disks_mask = (1 << disks) - 1;
+	chunk_disks_mask = (1 << copies) - 1;	/* Starting value; see below */
+
+	active_disks_mask = 0;
+
+	for (mask = 1, i = 0; i < mdstat_array->dev_summary_len;
+							mask <<= 1, ++i) {
+		if (mdstat_array->dev_summary[i] == 'U')
+			active_disks_mask |= mask;
+	}
+
+	/* Mask for bits that get "rolled" back to bit 0 */
+	mask = ((1 << near) - 1) << disks;
+
+	do {
+		/* Array is failed if no active disk contains a given chunk */
+		if ((active_disks_mask & chunk_disks_mask) == 0)
+			return 1;
+
+		chunk_disks_mask <<= near;
+		chunk_disks_mask |= (chunk_disks_mask & mask) >> disks;
+		chunk_disks_mask &= all_disks_mask;
+
+	/* Quit when the chunk disks mask returns to its starting value */
+	} while (chunk_disks_mask != (1 << copies) - 1);
+
+	return 0;
+}
+
+static int fcd_raid_array_failed(const struct fcd_mdstat_array *mdstat_array,
+				 struct fcd_raid_array *array)
+{
+	switch (array->type) {
+
+		/* Used for testing; not really meaningful */
+		case FCD_RAID_TYPE_FAULTY:
+			return 0;
+
+		/* No redundancy, so any missing devices == failed */
+		case FCD_RAID_TYPE_LINEAR:
+		case FCD_RAID_TYPE_RAID0:
+			return 1;
+
+		/* Only 1 device required */
+		case FCD_RAID_TYPE_MULTIPATH:
+		case FCD_RAID_TYPE_RAID1:
+			return array->current_devs < 1;
+
+		/* Can tolerate 1 failure */
+		case FCD_RAID_TYPE_RAID4:
+		case FCD_RAID_TYPE_RAID5:
+			return array->ideal_devs - array->current_devs > 1;
+
+		/* Can tolerate 2 failures */
+		case FCD_RAID_TYPE_RAID6:
+			return array->ideal_devs - array->current_devs > 2;
+
+		/* It's complicated */
+		case FCD_RAID_TYPE_RAID10:
+			return fcd_raid_r10_failed(mdstat_array, array);
+	}
+
+	FCD_ABORT("Invalid enum value\n");
+}
+
+/*
+ * Returns 0 on success (-1 = error, -2 = timeout, -3 exit signal received, -4
+ * mdadm output buffer size exceeded)
+ */
+static int fcd_raid_parse_array(int *names_changed,
+				const struct fcd_mdstat_array *mdstat_array)
+{
+	struct fcd_raid_array *array;
+	int ret;
+
+	ret = fcd_raid_find_array(&array, mdstat_array->name,
+				  mdstat_array->name_len);
+	if (ret < 0)
+		return ret;
+
+	*names_changed += ret;
+	if (*names_changed)
+		return 0;
+
+	if (!mdstat_array->active) {
+		array->array_status = FCD_RAID_ARRAY_INACTIVE;
+	}
+	else {
+		if (mdstat_array->read_only == 'r')
+			array->array_status = FCD_RAID_ARRAY_READONLY;
+		else
+			array->array_status = FCD_RAID_ARRAY_ACTIVE;
+
+		array->type = fcd_raid_parse_type(mdstat_array);
+	}
+
+	if (fcd_raid_parse_devs(mdstat_array, array) == -1)
+		return -1;
+
+	if (array->array_status == FCD_RAID_ARRAY_INACTIVE)
+		return 0;
+
+	/* Linear & RAID-0 arrays don't show [ideal/current] */
+	if (mdstat_array->ideal_devs == 0) {
+		array->ideal_devs = mdstat_array->dev_count;
+		array->current_devs = mdstat_array->dev_count;
+		return 0;
+	}
+
+	/* Redundant array, so degraded & sync_action should exist */
+	if (fcd_raid_open_attrs(array) == -1)
+		return -1;
+
+	array->ideal_devs = mdstat_array->ideal_devs;
+	array->current_devs = mdstat_array->current_devs;
+
+	if (array->current_devs < array->ideal_devs) {
+		if (fcd_raid_array_failed(mdstat_array, array))
+			array->array_status = FCD_RAID_ARRAY_FAILED;
+		else
+			array->array_status = FCD_RAID_ARRAY_DEGRADED;
+	}
+
+	return 0;
+}
+
+static int fcd_raid_parse_mdstat(const char *buf)
+{
+	int names_changed, ret;
+	unsigned i;
+
+	if (fcd_mdstat_parse(&fcd_raid_mdstat, buf) == -1)
+		return -1;
+
+	for (i = 0; i < fcd_raid_count; ++i)
+		fcd_raid_arrays[i].array_status = FCD_RAID_ARRAY_STOPPED;
+
+	/*
+	 * See http://article.gmane.org/gmane.linux.raid/44417 for an
+	 * explanation of what this loop does (along with fcd_raid_parse_array
+	 * and fcd_raid_find_array)
+	 */
+
+	do {
+		names_changed = 0;
+
+		for (i = 0; i < fcd_raid_mdstat.array_count; ++i) {
+
+			ret = fcd_raid_parse_array(&names_changed,
+						   &fcd_raid_mdstat.arrays[i]);
+			if (ret == -3)
+				return -3;
+			if (ret < 0)
+				return -1;
+		}
+
+	} while (names_changed != 0);
+
+	return 0;
+}
+
+static int fcd_raid_regcomp(void)
+{
+	struct fcd_raid_regex *regex;
+	size_t errbuf_size;
+	char *errbuf;
+	int ret, i;
+
+	for (i = 0; i < (int)FCD_ARRAY_SIZE(fcd_raid_regexes); ++i) {
+
+		regex = &fcd_raid_regexes[i];
+
+		ret = regcomp(&regex->regex, regex->pattern, regex->cflags);
+		if (ret != 0)
+			goto regcomp_error;
+	}
+
+	return 0;
+
+regcomp_error:
+
+	errbuf_size = regerror(ret, &regex->regex, 0, 0);
+
+	errbuf = malloc(errbuf_size);
+	if (errbuf == NULL) {
+		FCD_PERROR("malloc");
+		FCD_WARN("Cannot format regcomp error message: code %d\n", ret);
+	}
+	else {
+		regerror(ret, &regex->regex, errbuf, errbuf_size);
+		FCD_ERR("regcomp: %s\n", errbuf);
+		free(errbuf);
+	}
+
+	for (--i; i >= 0; --i)
+		regfree(&fcd_raid_regexes[i].regex);
+
+	return -1;
+}
+
+static ssize_t fcd_raid_read_file(int fd, struct fcd_lib_buf *buf)
+{
+	struct timespec timeout;
+	ssize_t ret;
+
+	timeout.tv_sec = 0;
+	timeout.tv_nsec = 0;
+
+	ret = fcd_lib_read_all(fd, buf, &timeout);
+	if (ret == -2) {
+		FCD_WARN("Read from regular file timed out\n");
+		return -1;
+	}
+
+	return ret;
+}
+
+static int fcd_raid_read_mdadm_conf(struct fcd_lib_buf *buf)
+{
+	static const struct fcd_raid_regex *const regex = &fcd_raid_regexes[0];
+	static regmatch_t *const matches = fcd_raid_conf_array_matches;
+	static const char path[] = "/etc/mdadm.conf";
+	struct fcd_raid_array *array;
+	uint32_t uuid[4];
+	int ret, fd;
+	char *c;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		if (errno == ENOENT)
+			return 0;
+		FCD_PERROR(path);
+		return -1;
+	}
+
+	ret = fcd_raid_read_file(fd, buf);
+	if (ret < 0) {
+		if (close(fd) == -1)
+			FCD_PERROR("close");
+		return ret;
+	}
+
+	if (close(fd) == -1) {
+		FCD_PERROR("close");
+		return -1;
+	}
+
+	for (c = buf->data; *c != 0; ++c)
+	{
+		if (regexec(&regex->regex, c, regex->nmatch, matches, 0) == 0 &&
+				matches[1].rm_so == -1)	  /* not <inactive> */
+		{
+			fcd_raid_parse_uuid(uuid, c + matches[2].rm_so);
+
+			array = fcd_raid_array_add(uuid);
+			if (array == NULL)
+				return -1;
+
+			array->transient = 0;
+
+			c += matches[0].rm_eo;
+		}
+
+		c = strchr(c, '\n');
+		if (c == NULL)
+			break;
+	}
+
+	return 0;
+}
+
+/*
+ * Watches /etc for changes to mdadm.conf.  The directory is watched, rather
+ * than the file itself, because editors usually replace the file.  Failure
+ * isn't fatal; changes to the file will just be ignored until the daemon is
+ * restarted.
+ */
+static void fcd_raid_watch_conf(void)
+{
+	fcd_raid_inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (fcd_raid_inotify_fd == -1) {
+		FCD_PERROR("inotify_init1");
+		return;
+	}
+
+	if (inotify_add_watch(fcd_raid_inotify_fd, "/etc",
+			      IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM |
+			      IN_DELETE) == -1) {
+		FCD_PERROR("/etc");
+		if (close(fcd_raid_inotify_fd) == -1)
+			FCD_PERROR("close");
+		fcd_raid_inotify_fd = -1;
+	}
+}
+
+/*
+ * Reads all pending inotify events, and notes whether any of them are for
+ * mdadm.conf.  Returns 0 on success, -1 on error.
+ */
+static int fcd_raid_read_inotify(void)
+{
+	static char buf[4096]
+		__attribute__((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *event;
+	ssize_t ret;
+	char *c;
+
 	while (1) {
 
-		ret = fcd_raid_parse_dev(c, array);
-		if (ret < 1)
-			return ret;
+		ret = read(fcd_raid_inotify_fd, buf, sizeof buf);
+		if (ret == -1) {
+			if (errno == EAGAIN || errno == EINTR)
+				return 0;
+			FCD_PERROR("read");
+			return -1;
+		}
 
-		c += ret;
-		if (*c == ' ')
-			++c;
+		for (c = buf; c < buf + ret; c += sizeof *event + event->len) {
+
+			event = (const struct inotify_event *)c;
+
+			if ((event->mask & IN_Q_OVERFLOW) || (event->len != 0 &&
+					strcmp(event->name, "mdadm.conf") == 0))
+				fcd_raid_conf_changed = 1;
+		}
 	}
+}
 
-	for (i = 0; i < FCD_ARRAY_SIZE(array->dev_status); ++i) {
+/*
+ * Re-reads mdadm.conf after a change.  Only the transient flags of the arrays
+ * are updated; arrays that have been removed from the file become transient,
+ * and arrays that have been added are tracked (even if they aren't running).
+ * Returns 0 on success (-1 = error, -3 = exit signal received, -4 = file too
+ * large).
+ */
+static int fcd_raid_reread_mdadm_conf(struct fcd_lib_buf *buf)
+{
+	unsigned i;
 
-		if (array->dev_status[i] == FCD_RAID_DEV_EXPECTED)
-			array->dev_status[i] = FCD_RAID_DEV_MISSING;
+	fcd_raid_conf_changed = 0;
+
+	FCD_INFO("/etc/mdadm.conf changed; re-reading\n");
+
+	for (i = 0; i < fcd_raid_count; ++i)
+		fcd_raid_arrays[i].transient = 1;
+
+	return fcd_raid_read_mdadm_conf(buf);
+}
+
+static void fcd_raid_cleanup(struct fcd_lib_buf *mdstat_buf, int mdstat_fd)
+{
+	struct fcd_raid_array *array;
+	size_t i;
+
+	for (i = 0; i < FCD_ARRAY_SIZE(fcd_raid_regexes); ++i)
+		regfree(&fcd_raid_regexes[i].regex);
+
+	for (i = 0; i < fcd_raid_count; ++i) {
+
+		array = &fcd_raid_arrays[i];
+
+		if (array->sysfs_fd != -1 && close(array->sysfs_fd) == -1)
+			FCD_PERROR("close");
+
+		fcd_raid_close_attr_fd(&array->degraded_fd);
+		fcd_raid_close_attr_fd(&array->sync_action_fd);
 	}
+
+	if (mdstat_fd != -1 && close(mdstat_fd) == -1)
+		FCD_PERROR("close");
+
+	if (fcd_raid_inotify_fd != -1 && close(fcd_raid_inotify_fd) == -1)
+		FCD_PERROR("close");
+
+	fcd_lib_buf_free(&fcd_raid_uuid_buf);
+	fcd_lib_buf_free(mdstat_buf);
+}
+
+__attribute__((noreturn))
+static void fcd_raid_disable(struct fcd_lib_buf *mdstat_buf, int mdstat_fd,
+			     struct fcd_monitor *mon)
+{
+	fcd_raid_cleanup(mdstat_buf, mdstat_fd);
+	fcd_lib_fail_and_exit(mon);
 }
 
 /*
- * See http://en.wikipedia.org/wiki/Non-standard_RAID_levels#Linux_MD_RAID_10
- * for a description of the RAID-10 layout.  Also see drivers/md/raid10.c in the
- * Linux kernel sources.
- *
- * The logic of this function is inspired by the RAID-10 portion of the enough()
- * function in mdadm's util.c.
+ * Reads the mismatch_cnt history -- one "UUID TIME MISMATCHES" line per
+ * completed check.  Returns 0 on success (including if the file doesn't
+ * exist), -1 on error.
  */
-static int fcd_raid_r10_failed(const char *c, const regmatch_t matches[],
-			       struct fcd_raid_array *array)
+static int fcd_raid_mm_load(struct fcd_lib_buf *buf)
 {
-	uint16_t all_disks_mask, active_disks_mask, chunk_disks_mask, mask;
-	int near, far, copies, disks;
+	struct fcd_raid_mm *mm;
+	unsigned long long m;
+	uint32_t uuid[4];
+	long long when;
+	int ret, fd;
+	char *c;
 
-	if (matches[1].rm_so == -1)
-		near = 1;
-	else
-		near = atoi(c + matches[1].rm_so);
+	fd = open(FCD_RAID_MM_FILE, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		if (errno == ENOENT)
+			return 0;
+		FCD_PERROR(FCD_RAID_MM_FILE);
+		return -1;
+	}
 
-	if (matches[2].rm_so == -1)
-		far = 1;
-	else
-		far = atoi(c + matches[2].rm_so);
+	ret = fcd_raid_read_file(fd, buf);
 
-	copies = near * far;
-	disks = array->ideal_devs;
+	if (close(fd) == -1) {
+		FCD_PERROR("close");
+		return -1;
+	}
 
-	/* uint16_t can handle any 8-disk configuration */
-	if (disks + near > (int)(sizeof mask * CHAR_BIT))
-		FCD_ABORT("Bitmask data type too small for array\n");
+	/* Not worth disabling the monitor over */
+	if (ret == -4) {
+		FCD_WARN("%s: File too large; ignoring\n", FCD_RAID_MM_FILE);
+		return 0;
+	}
 
-	/* Special case when there is a copy of every chunk on every disk */
-	if (copies == disks)
-		return array->current_devs < 1;
+	if (ret < 0)
+		return ret;
 
-	/* Special case with no redundancy */
-	if (copies == 1)
-		return 1;
+	for (c = buf->data; c != NULL && *c != 0; c = strchr(c, '\n')) {
 
-	all_disks_mask = (1 << disks) - 1;
-	chunk_disks_mask = (1 << copies) - 1;	/* Starting value; see below */
+		if (*c == '\n')
+			++c;
 
-	active_disks_mask = 0;
+		if (sscanf(c, "%8" SCNx32 ":%8" SCNx32 ":%8" SCNx32 ":%8" SCNx32
+				" %lld %llu", &uuid[3], &uuid[2], &uuid[1],
+				&uuid[0], &when, &m) != 6) {
+			if (*c != 0) {
+				FCD_WARN("%s: Invalid line\n",
+					 FCD_RAID_MM_FILE);
+			}
+			continue;
+		}
 
-	for (mask = 1, c += matches[6].rm_so; *c != ']'; mask <<= 1, ++c) {
-		if (*c == 'U')
-			active_disks_mask |= mask;
+		mm = fcd_raid_mm_find(uuid, 1);
+		if (mm != NULL)
+			fcd_raid_mm_add(mm, when, m);
 	}
 
-	/* Mask for bits that get "rolled" back to bit 0 */
-	mask = ((1 << near) - 1) << disks;
+	return 0;
+}
 
-	do {
-		/* Array is failed if no active disk contains a given chunk */
-		if ((active_disks_mask & chunk_disks_mask) == 0)
-			return 1;
+/*
+ * Saves the mismatch_cnt history.  Written to a temporary file, which is then
+ * renamed, like the warm restart state.
+ */
+static void fcd_raid_mm_save(void)
+{
+	const struct fcd_raid_mm *mm;
+	unsigned i, j;
+	FILE *fp;
+	int fd;
 
-		chunk_disks_mask <<= near;
-		chunk_disks_mask |= (chunk_disks_mask & mask) >> disks;
-		chunk_disks_mask &= all_disks_mask;
+	if (mkdir(FCD_RAID_MM_DIR, 0755) == -1 && errno != EEXIST) {
+		FCD_PERROR(FCD_RAID_MM_DIR);
+		return;
+	}
 
-	/* Quit when the chunk disks mask returns to its starting value */
-	} while (chunk_disks_mask != (1 << copies) - 1);
+	fd = open(FCD_RAID_MM_TMP_FILE,
+		  O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd == -1) {
+		FCD_PERROR(FCD_RAID_MM_TMP_FILE);
+		return;
+	}
+
+	fp = fdopen(fd, "w");
+	if (fp == NULL) {
+		FCD_PERROR("fdopen");
+		if (close(fd) == -1)
+			FCD_PERROR(FCD_RAID_MM_TMP_FILE);
+		return;
+	}
+
+	for (i = 0; i < fcd_raid_mm_count; ++i) {
+
+		mm = &fcd_raid_mms[i];
+
+		for (j = 0; j < mm->count; ++j) {
+			fprintf(fp, "%08" PRIx32 ":%08" PRIx32 ":%08" PRIx32
+				":%08" PRIx32 " %lld %llu\n", mm->uuid[3],
+				mm->uuid[2], mm->uuid[1], mm->uuid[0],
+				(long long)mm->hist[j].when,
+				(unsigned long long)mm->hist[j].mismatches);
+		}
+	}
+
+	if (fclose(fp) == EOF) {
+		FCD_PERROR(FCD_RAID_MM_TMP_FILE);
+		return;
+	}
+
+	if (rename(FCD_RAID_MM_TMP_FILE, FCD_RAID_MM_FILE) == -1)
+		FCD_PERROR(FCD_RAID_MM_FILE);
+}
+
+static int fcd_raid_setup(int *mdstat_fd, struct fcd_lib_buf *mdstat_buf)
+{
+	static const char path[] = "/proc/mdstat";
+	int ret;
+
+	*mdstat_fd = -1;
+
+	if (fcd_raid_regcomp() == -1)
+		return -1;
+
+	if (fcd_lib_buf_prealloc(mdstat_buf) == -1 ||
+			fcd_lib_buf_prealloc(&fcd_raid_uuid_buf) == -1)
+		return -1;
+
+	ret = fcd_raid_mm_load(mdstat_buf);
+	if (ret < 0)
+		return ret;
+
+	/* Set up the watch first, so no changes are missed */
+	fcd_raid_watch_conf();
+
+	ret = fcd_raid_read_mdadm_conf(mdstat_buf);
+	if (ret < 0)
+		return ret;
+
+	*mdstat_fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (*mdstat_fd == -1) {
+		FCD_PERROR(path);
+		return -1;
+	}
 
 	return 0;
 }
 
-static int fcd_raid_array_failed(const char *c, const regmatch_t matches[],
-				 struct fcd_raid_array *array)
+/*
+ * Reads a sysfs attribute of an array.  Returns 0 on success, 1 if the
+ * attribute doesn't exist (array stopped, not redundant, etc.), or -1 on
+ * error.
+ */
+static int fcd_raid_read_attr(const struct fcd_raid_array *array,
+			      const char *attr, char *buf, size_t size)
 {
-	switch (array->type) {
+	static char sysfs_file[FCD_RAID_SYSFS_FILE_SIZE];
+	ssize_t ret;
+	int fd;
 
-		/* Used for testing; not really meaningful */
-		case FCD_RAID_TYPE_FAULTY:
-			return 0;
+	sprintf(sysfs_file, "/sys/devices/virtual/block/%s/md/%s",
+		array->name, attr);
 
-		/* No redundancy, so any missing devices == failed */
-		case FCD_RAID_TYPE_LINEAR:
-		case FCD_RAID_TYPE_RAID0:
+	fd = open(sysfs_file, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		if (errno == ENOENT || errno == ENODEV)
 			return 1;
+		FCD_PERROR(sysfs_file);
+		return -1;
+	}
 
-		/* Only 1 device required */
-		case FCD_RAID_TYPE_MULTIPATH:
-		case FCD_RAID_TYPE_RAID1:
-			return array->current_devs < 1;
+	ret = read(fd, buf, size - 1);
+	if (ret == -1) {
+		if (errno == ENODEV) {
+			ret = 1;
+		}
+		else {
+			FCD_PERROR(sysfs_file);
+			ret = -1;
+		}
+	}
+	else {
+		buf[ret] = 0;
+		ret = 0;
+	}
 
-		/* Can tolerate 1 failure */
-		case FCD_RAID_TYPE_RAID4:
-		case FCD_RAID_TYPE_RAID5:
-			return array->ideal_devs - array->current_devs > 1;
+	if (close(fd) == -1) {
+		FCD_PERROR("close");
+		return -1;
+	}
 
-		/* Can tolerate 2 failures */
-		case FCD_RAID_TYPE_RAID6:
-			return array->ideal_devs - array->current_devs > 2;
+	return ret;
+}
 
-		/* It's complicated */
-		case FCD_RAID_TYPE_RAID10:
-			return fcd_raid_r10_failed(c, matches, array);
+/*
+ * Reads md/sync_action through the array's (already open) file descriptor,
+ * which also re-arms it for poll.  Leaves an empty string in action if the
+ * array is idle or frozen (or the attribute doesn't exist).
+ */
+static int fcd_raid_sync_action(struct fcd_raid_array *array,
+				char action[FCD_RAID_SYNC_ACTION_SIZE])
+{
+	char buf[16];
+	ssize_t ret;
+
+	action[0] = 0;
+
+	if (array->sync_action_fd == -1)
+		return 0;
+
+	ret = pread(array->sync_action_fd, buf, sizeof buf - 1, 0);
+	if (ret == -1) {
+		if (errno == ENODEV)
+			return fcd_raid_close_attr_fd(&array->sync_action_fd);
+		FCD_PERROR("pread");
+		return -1;
+	}
+
+	buf[ret] = 0;
+	buf[strcspn(buf, "\n")] = 0;
+
+	if (strcmp(buf, "idle") != 0 && strcmp(buf, "frozen") != 0)
+		snprintf(action, FCD_RAID_SYNC_ACTION_SIZE, "%.7s", buf);
+
+	return 0;
+}
+
+static void fcd_raid_sync_reset(struct fcd_raid_sync *sync)
+{
+	memset(sync, 0, sizeof *sync);
+}
+
+/*
+ * Records the result (md/mismatch_cnt) of a completed check.  Returns 0 on
+ * success, -1 on error.
+ */
+static int fcd_raid_mm_record(struct fcd_raid_array *array)
+{
+	struct fcd_raid_mm *mm;
+	uint64_t mismatches;
+	char buf[24];
+	int ret;
+
+	ret = fcd_raid_read_attr(array, "mismatch_cnt", buf, sizeof buf);
+	if (ret != 0)
+		return (ret == 1) ? 0 : -1;
+
+	if (sscanf(buf, "%" SCNu64, &mismatches) != 1) {
+		FCD_WARN("%s: Invalid mismatch_cnt: %s\n", array->name, buf);
+		return 0;
+	}
+
+	mm = fcd_raid_mm_find(array->uuid, 1);
+	if (mm == NULL)
+		return 0;
+
+	array->mm = mm;
+
+	if (mm->count != 0 &&
+		    mismatches > mm->hist[mm->count - 1].mismatches) {
+		FCD_WARN("%s: check found %" PRIu64 " mismatches (up from %"
+			 PRIu64 ")\n", array->name, mismatches,
+			 mm->hist[mm->count - 1].mismatches);
+	}
+	else if (mismatches > (uint64_t)fcd_raid_mm_threshold) {
+		FCD_WARN("%s: check found %" PRIu64 " mismatches\n",
+			 array->name, mismatches);
+	}
+	else {
+		FCD_INFO("%s: check found %" PRIu64 " mismatches\n",
+			 array->name, mismatches);
+	}
+
+	fcd_raid_mm_add(mm, time(NULL), mismatches);
+	fcd_raid_mm_save();
+
+	return 0;
+}
+
+/*
+ * Determines whether a sync that has just ended ran to completion, rather than
+ * being interrupted (by writing "idle" to sync_action, a member failure, etc.).
+ *
+ * md only updates sync_completed every 1/16 of the array (or every few
+ * minutes), and it reads "none" as soon as the sync ends, so the last sample
+ * rarely shows the very end.  md/sync_min fills the gap; md resets it to 0
+ * when a check completes, but sets it to the point reached when a check is
+ * interrupted.  (An interruption before the first sync_completed update can't
+ * be told apart from a completed check by sync_min, so some progress must
+ * have been seen.)
+ *
+ * Returns 1 if the sync completed, 0 if it didn't (or it can't be told), or
+ * -1 on error.
+ */
+static int fcd_raid_sync_complete(const struct fcd_raid_array *array)
+{
+	const struct fcd_raid_sync *sync = &array->sync;
+	char buf[24];
+	int ret;
+
+	if (sync->total != 0 && sync->last_done >= sync->total)
+		return 1;
+
+	ret = fcd_raid_read_attr(array, "sync_min", buf, sizeof buf);
+	if (ret != 0)
+		return (ret == 1) ? 0 : -1;
+
+	return sync->last_done != 0 && strtoull(buf, NULL, 10) == 0;
+}
+
+/*
+ * Logs the end of a sync, and records the result if it was a completed check
+ */
+static int fcd_raid_sync_finished(struct fcd_raid_array *array)
+{
+	const struct fcd_raid_sync *sync = &array->sync;
+	unsigned permille;
+	int ret;
+
+	if (strcmp(sync->action, "check") != 0) {
+		FCD_INFO("%s: %s finished\n", array->name, sync->action);
+		return 0;
+	}
+
+	ret = fcd_raid_sync_complete(array);
+	if (ret == -1)
+		return -1;
+
+	if (ret == 0) {
+		permille = (sync->total == 0) ? 0 :
+				sync->last_done * 1000 / sync->total;
+		FCD_INFO("%s: check interrupted at %u.%u%%; mismatch_cnt not "
+			 "recorded\n", array->name, permille / 10,
+			 permille % 10);
+		return 0;
 	}
 
-	FCD_ABORT("Invalid enum value\n");
+	FCD_INFO("%s: check finished\n", array->name);
+
+	return fcd_raid_mm_record(array);
 }
 
 /*
- * Returns 1 if array was successfully parsed (0 = no match, -1 = error, -2 =
- * timeout, -3 exit signal received, -4 mdadm output buffer size exceeded)
+ * Updates the progress, speed, and ETA of any resync/recovery/check/etc. that
+ * is running on the array.  Returns 0 on success, -1 on error.
  */
-static int fcd_raid_parse_array(int *names_changed, const char *c,
-				const int *pipe_fds)
+static int fcd_raid_sync_update(struct fcd_raid_array *array)
 {
-	const struct fcd_raid_regex *regex;
-	struct fcd_raid_array *array;
-	regmatch_t *matches;
+	struct fcd_raid_sync *sync = &array->sync;
+	char action[FCD_RAID_SYNC_ACTION_SIZE];
+	uint64_t done, total;
+	unsigned first, last;
+	char buf[48];
+	time_t now;
 	int ret;
 
-	regex = &fcd_raid_regexes[0]; matches = regex->matches;
+	if (fcd_raid_sync_action(array, action) == -1)
+		return -1;
 
-	if (regexec(&regex->regex, c, regex->nmatch, matches, 0) != 0)
+	if (action[0] == 0) {
+		if (sync->action[0] != 0 &&
+				fcd_raid_sync_finished(array) == -1)
+			return -1;
+		fcd_raid_sync_reset(sync);
 		return 0;
+	}
 
-	ret = fcd_raid_find_array(&array, c, &matches[1], pipe_fds);
-	if (ret < 0)
-		return ret;
-
-	*names_changed += ret;
-	if (*names_changed)
-		return 1;
+	now = fcd_lib_boottime();
 
-	/* Match is either "active" or "inactive" */
-	if (c[matches[2].rm_so] == 'i') {
-		array->array_status = FCD_RAID_ARRAY_INACTIVE;
+	if (strcmp(action, sync->action) != 0) {
+		if (sync->action[0] != 0 &&
+				fcd_raid_sync_finished(array) == -1)
+			return -1;
+		fcd_raid_sync_reset(sync);
+		memcpy(sync->action, action, sizeof sync->action);
+		sync->last_progress = now;
+		FCD_INFO("%s: %s started\n", array->name, action);
 	}
-	else {
-		/* Match may be "(read-only) " or "(auto-read-only) " */
-		if (matches[3].rm_so != -1 && c[matches[3].rm_so + 1] == 'r')
-			array->array_status = FCD_RAID_ARRAY_READONLY;
-		else
-			array->array_status = FCD_RAID_ARRAY_ACTIVE;
 
-		array->type = fcd_raid_parse_type(c, &matches[4]);
+	ret = fcd_raid_read_attr(array, "sync_completed", buf, sizeof buf);
+	if (ret != 0)
+		return (ret == 1) ? 0 : -1;
+
+	/* "none" or "delayed" (waiting for another array on the same disks) */
+	if (sscanf(buf, "%" SCNu64 " / %" SCNu64, &done, &total) != 2 ||
+			total == 0) {
+		sync->pending = 1;
+		sync->last_progress = now;
+		sync->count = 0;
+		return 0;
 	}
 
-	c += matches[0].rm_eo;
+	sync->pending = 0;
+	sync->last_done = done;
+	sync->total = total;
+	last = 0;
+
+	if (sync->count != 0) {
+		last = (sync->next + FCD_RAID_SYNC_SAMPLES - 1) %
+							FCD_RAID_SYNC_SAMPLES;
+		if (done < sync->done[last])		/* restarted */
+			sync->count = 0;
+		else if (done > sync->done[last])
+			sync->last_progress = now;
+	}
 
-	if (fcd_raid_parse_devs(c, array) == -1)
-		return -1;
+	/* Don't let event-driven wakeups crowd the periodic samples */
+	if (sync->count == 0 ||
+		    now - sync->time[last] >= FCD_RAID_SYNC_POLL / 2) {
+		sync->done[sync->next] = done;
+		sync->time[sync->next] = now;
+		sync->next = (sync->next + 1) % FCD_RAID_SYNC_SAMPLES;
+		if (sync->count < FCD_RAID_SYNC_SAMPLES)
+			++sync->count;
+	}
 
-	if (array->array_status == FCD_RAID_ARRAY_INACTIVE)
-		return 1;
+	sync->permille = done * 1000 / total;
+	sync->speed = 0;
 
-	c = strchr(c, '\n');
-	if (c == NULL) {
-		FCD_WARN("Error parsing /proc/mdstat\n");
-		return -1;
+	/* Average speed over the sample history, if it covers any time */
+	first = (sync->next + FCD_RAID_SYNC_SAMPLES - sync->count) %
+							FCD_RAID_SYNC_SAMPLES;
+	if (now > sync->time[first]) {
+		/* sectors -> KiB */
+		sync->speed = (done - sync->done[first]) / 2 /
+						(now - sync->time[first]);
+	}
+	else if (fcd_raid_read_attr(array, "sync_speed", buf,
+				    sizeof buf) == 0) {
+		sync->speed = strtoul(buf, NULL, 10);
 	}
 
-	regex = &fcd_raid_regexes[2]; matches = regex->matches;
+	if (fcd_raid_read_attr(array, "sync_speed_min", buf, sizeof buf) == 0)
+		sync->speed_min = strtoul(buf, NULL, 10);
+	if (fcd_raid_read_attr(array, "sync_speed_max", buf, sizeof buf) == 0)
+		sync->speed_max = strtoul(buf, NULL, 10);
 
-	if (regexec(&regex->regex, ++c, regex->nmatch, matches, 0) != 0) {
-		FCD_WARN("Error parsing /proc/mdstat\n");
-		return -1;
+	sync->eta = (sync->speed == 0) ? -1 :
+			(time_t)((total - done) / 2 / sync->speed);
+
+	ret = (now - sync->last_progress >= FCD_RAID_STALL_TIME);
+	if (ret && !sync->stalled) {
+		FCD_WARN("%s: %s stalled at %u.%u%%\n", array->name, action,
+			 sync->permille / 10, sync->permille % 10);
+	}
+	sync->stalled = ret;
+
+	/* md tries to sync at least speed_min, even with other I/O */
+	ret = !sync->stalled && sync->count == FCD_RAID_SYNC_SAMPLES &&
+		sync->speed < sync->speed_min / 2;
+	if (ret && !sync->slow) {
+		FCD_WARN("%s: %s slow: %u KiB/s (minimum %u KiB/s)\n",
+			 array->name, action, sync->speed, sync->speed_min);
 	}
+	sync->slow = ret;
 
-	array->ideal_devs = atoi(c + matches[4].rm_so);
-	array->current_devs = atoi(c + matches[5].rm_so);
+	FCD_DEBUG("%s: %s %u.%u%% at %u KiB/s (min %u, max %u), ETA %ld s\n",
+		  array->name, action, sync->permille / 10,
+		  sync->permille % 10, sync->speed, sync->speed_min,
+		  sync->speed_max, (long)sync->eta);
 
-	if (array->current_devs < array->ideal_devs) {
-		if (fcd_raid_array_failed(c, matches, array))
-			array->array_status = FCD_RAID_ARRAY_FAILED;
-		else
-			array->array_status = FCD_RAID_ARRAY_DEGRADED;
+	return 0;
+}
+
+/*
+ * Parses the contents of md/dev-XXX/state -- a comma-separated list of flags
+ */
+static unsigned fcd_raid_member_state(const char *c)
+{
+	static const struct {
+		const char *flag;
+		unsigned value;
+	} flags[] = {
+		{ "faulty",		FCD_RAID_MEMBER_FAULTY		},
+		{ "write_error",	FCD_RAID_MEMBER_WRITE_ERROR	},
+		{ "want_replacement",	FCD_RAID_MEMBER_WANT_REPLACE	},
+		{ "blocked",		FCD_RAID_MEMBER_BLOCKED		},
+	};
+	unsigned i, len, state;
+
+	state = 0;
+
+	while (*c != 0 && *c != '\n') {
+
+		len = strcspn(c, ",\n");
+
+		for (i = 0; i < FCD_ARRAY_SIZE(flags); ++i) {
+
+			if (strlen(flags[i].flag) == len &&
+					memcmp(flags[i].flag, c, len) == 0) {
+				state |= flags[i].value;
+				break;
+			}
+		}
+
+		c += len;
+		if (*c == ',')
+			++c;
 	}
 
-	return 1;
+	return state;
 }
 
-static int fcd_raid_parse_mdstat(const char *buf, const int *pipe_fds)
+/*
+ * Reads the corrected read error count and state of each member of the array.
+ * Returns 0 on success, -1 on error.
+ */
+static int fcd_raid_member_update(struct fcd_raid_array *array)
 {
-	struct fcd_raid_array *array;
-	int names_changed, ret;
-	const char *c;
+	static char attr[sizeof "dev-/errors" + FCD_RAID_MEMBER_SIZE - 1];
+	struct fcd_raid_member *member;
+	unsigned i, errors, state;
+	char buf[64];
+	int ret;
 
-	for (array = fcd_raid_list; array != NULL; array = array->next)
-		array->array_status = FCD_RAID_ARRAY_STOPPED;
+	for (i = 0; i < fcd_conf_disk_count; ++i) {
 
-	/*
-	 * See http://article.gmane.org/gmane.linux.raid/44417 for an
-	 * explanation of what this loop does (along with fcd_raid_parse_array
-	 * and fcd_raid_find_array)
-	 */
+		member = &array->members[i];
 
-	do {
-		names_changed = 0;
-		c = buf;
+		switch (array->dev_status[i]) {
 
-		do {
-			ret = fcd_raid_parse_array(&names_changed, c, pipe_fds);
-			if (ret == -3)
-				return -3;
-			if (ret < 0)
-				return -1;
+			case FCD_RAID_DEV_ACTIVE:
+			case FCD_RAID_DEV_FAILED:
+			case FCD_RAID_DEV_WRITEMOSTLY:
+			case FCD_RAID_DEV_REPLACEMENT:
+				break;
 
-			/*
-			* If we just parsed an array, skip the next two lines
-			* (i.e. move past 3 newlines).  Otherwise, move to the
-			* next line (past 1 newline).
-			*/
+			default:
+				member->state = 0;
+				continue;
+		}
 
-			for (ret *= 2; ret >= 0; --ret)	{
+		if (member->name[0] == 0)
+			continue;
 
-				c = strchr(c, '\n');
-				if (c == NULL)
-					break;
-				++c;
-			}
+		sprintf(attr, "dev-%s/errors", member->name);
 
-		} while (c != NULL);
+		ret = fcd_raid_read_attr(array, attr, buf, sizeof buf);
+		if (ret == -1)
+			return -1;
 
-	} while (names_changed != 0);
+		if (ret == 0 && sscanf(buf, "%u", &errors) == 1) {
 
-	return 0;
-}
+			/* Counter is reset when a device is re-added */
+			if (!member->known || errors < member->errors) {
+				member->baseline = errors;
+				member->known = 1;
+			}
+			else if (errors > member->errors) {
+				FCD_WARN("%s: %s: corrected read errors "
+					 "increased from %u to %u\n",
+					 array->name, member->name,
+					 member->errors, errors);
+			}
 
-static int fcd_raid_regcomp(void)
-{
-	struct fcd_raid_regex *regex;
-	size_t errbuf_size;
-	char *errbuf;
-	int ret, i;
+			member->errors = errors;
+		}
 
-	for (i = 0; i < (int)FCD_ARRAY_SIZE(fcd_raid_regexes); ++i) {
+		sprintf(attr, "dev-%s/state", member->name);
 
-		regex = &fcd_raid_regexes[i];
+		ret = fcd_raid_read_attr(array, attr, buf, sizeof buf);
+		if (ret == -1)
+			return -1;
 
-		ret = regcomp(&regex->regex, regex->pattern, regex->cflags);
-		if (ret != 0)
-			goto regcomp_error;
+		state = (ret == 0) ? fcd_raid_member_state(buf) : 0;
+
+		if (state & ~member->state) {
+			FCD_WARN("%s: %s: state is %.*s\n", array->name,
+				 member->name, (int)strcspn(buf, "\n"), buf);
+		}
+
+		member->state = state;
 	}
 
 	return 0;
+}
 
-regcomp_error:
+/*
+ * Flags the disks of array members whose corrected read error count has grown
+ * since the daemon started, or whose state indicates a problem.  Returns the
+ * number of such members.
+ */
+static int fcd_raid_member_result(int *disks,
+				  const struct fcd_raid_array *array)
+{
+	const struct fcd_raid_member *member;
+	unsigned i;
+	int bad;
 
-	errbuf_size = regerror(ret, &regex->regex, 0, 0);
+	for (bad = 0, i = 0; i < fcd_conf_disk_count; ++i) {
 
-	errbuf = malloc(errbuf_size);
-	if (errbuf == NULL) {
-		FCD_PERROR("malloc");
-		FCD_WARN("Cannot format regcomp error message: code %d\n", ret);
-	}
-	else {
-		regerror(ret, &regex->regex, errbuf, errbuf_size);
-		FCD_ERR("regcomp: %s\n", errbuf);
-		free(errbuf);
-	}
+		member = &array->members[i];
 
-	for (--i; i >= 0; --i)
-		regfree(&fcd_raid_regexes[i].regex);
+		if (member->state != 0 || (member->known &&
+					member->errors > member->baseline)) {
+			++disks[i];
+			++bad;
+		}
+	}
 
-	return -1;
+	return bad;
 }
 
-static ssize_t fcd_raid_read_file(int fd, char **buf, size_t *buf_size)
+/*
+ * Formats the progress of the slowest running sync for the LCD.  Returns 1 if
+ * a sync is running, 0 if not.
+ */
+static int fcd_raid_sync_display(char *upper, char *lower)
 {
-	struct timespec timeout;
-	ssize_t ret;
+	static const struct {
+		const char *action;
+		const char *display;
+	} names[] = {
+		{ "resync",	"RESYNC" },
+		{ "recover",	"RECOVER" },
+		{ "check",	"CHECK" },
+		{ "repair",	"REPAIR" },
+		{ "reshape",	"RESHAPE" },
+	};
 
-	timeout.tv_sec = 0;
-	timeout.tv_nsec = 0;
+	const struct fcd_raid_array *array, *slowest;
+	const struct fcd_raid_sync *sync;
+	const char *display;
+	char eta[8], speed[16], buf[48];
+	unsigned i;
 
-	ret = fcd_lib_read_all(fd, buf, buf_size, FCD_RAID_FILE_BUF_SIZE,
-			       &timeout);
-	if (ret == -2) {
-		FCD_WARN("Read from regular file timed out\n");
-		return -1;
-	}
+	slowest = NULL;
 
-	return ret;
-}
+	for (i = 0; i < fcd_raid_count; ++i) {
 
-static int fcd_raid_read_mdadm_conf(char **buf, size_t *buf_size)
-{
-	static const struct fcd_raid_regex *const regex = &fcd_raid_regexes[3];
-	static regmatch_t *const matches = fcd_raid_conf_array_matches;
-	static const char path[] = "/etc/mdadm.conf";
-	struct fcd_raid_array *array;
-	int ret, fd;
-	char *c;
+		array = &fcd_raid_arrays[i];
 
-	fd = open(path, O_RDONLY | O_CLOEXEC);
-	if (fd == -1) {
-		if (errno == ENOENT)
-			return 0;
-		FCD_PERROR(path);
-		return -1;
-	}
+		if (array->sync.action[0] == 0)
+			continue;
 
-	ret = fcd_raid_read_file(fd, buf, buf_size);
-	if (ret < 0) {
-		if (close(fd) == -1)
-			FCD_PERROR("close");
-		return ret;
+		if (slowest == NULL || (!array->sync.pending &&
+				(slowest->sync.pending ||
+				 array->sync.eta > slowest->sync.eta))) {
+			slowest = array;
+		}
 	}
 
-	if (close(fd) == -1) {
-		FCD_PERROR("close");
-		return -1;
+	if (slowest == NULL)
+		return 0;
+
+	sync = &slowest->sync;
+	display = sync->action;
+
+	for (i = 0; i < FCD_ARRAY_SIZE(names); ++i) {
+		if (strcmp(names[i].action, sync->action) == 0) {
+			display = names[i].display;
+			break;
+		}
 	}
 
-	for (c = *buf; *c != 0; ++c)
-	{
-		if (regexec(&regex->regex, c, regex->nmatch, matches, 0) == 0 &&
-				matches[1].rm_so == -1)	  /* not <inactive> */
-		{
-			array = fcd_raid_array_alloc();
-			if (array == NULL)
-				return -1;
+	if (sync->pending) {
+		snprintf(buf, sizeof buf, "%-7.7s PENDING %s", display,
+			 slowest->name);
+		memcpy(upper, buf, 20);
+		memcpy(lower, "                    ", 20);
+		return 1;
+	}
 
-			fcd_raid_parse_uuid(array->uuid, c + matches[2].rm_so);
-			fcd_raid_list_append(array);
+	snprintf(buf, sizeof buf, "%-7.7s %3u.%u%% %-20s", display,
+		 sync->permille / 10, sync->permille % 10, slowest->name);
+	memcpy(upper, buf, 20);
 
-			c += matches[0].rm_eo;
+	if (sync->stalled) {
+		snprintf(buf, sizeof buf, "%-20s", "STALLED");
+	}
+	else {
+		if (sync->eta < 0 || sync->eta / 3600 > 99) {
+			strcpy(eta, "--:--");
+		}
+		else {
+			snprintf(eta, sizeof eta, "%u:%02u",
+				 (unsigned)(sync->eta / 3600),
+				 (unsigned)(sync->eta / 60 % 60));
 		}
 
-		c = strchr(c, '\n');
-		if (c == NULL)
-			break;
+		if (sync->speed < 1024)
+			snprintf(speed, sizeof speed, "%uKB/s", sync->speed);
+		else if (sync->speed / 1024 > 999)
+			strcpy(speed, "999MB/s");
+		else
+			snprintf(speed, sizeof speed, "%uMB/s",
+				 sync->speed / 1024);
+
+		snprintf(buf, sizeof buf, "%s%s %s%-20s",
+			 sync->slow ? "SLOW " : "", speed,
+			 sync->slow ? "" : "ETA ", eta);
 	}
 
-	return 0;
+	memcpy(lower, buf, 20);
+
+	return 1;
 }
 
-static void fcd_raid_cleanup(char *mdstat_buf, int mdstat_fd, int *pipe_fds)
+/*
+ * Waits for an md event -- signaled by POLLPRI on /proc/mdstat or on the sysfs
+ * attributes of any known array -- or for the next multiple of period seconds.
+ * Returns the thread-local value of fcd_thread_exit_flag (or -1 on error).
+ */
+static int fcd_raid_wait(int mdstat_fd, time_t period)
 {
-	struct fcd_raid_array *array, *next;
-	size_t i;
+	static struct pollfd pfds[FCD_RAID_MAX_POLL_FDS];
+	static int *fds[FCD_RAID_MAX_POLL_FDS];
+	struct fcd_raid_array *array;
+	struct timespec ts;
+	int ret, *afds[2];
+	unsigned i, n;
 
-	for (i = 0; i < FCD_ARRAY_SIZE(fcd_raid_regexes); ++i)
-		regfree(&fcd_raid_regexes[i].regex);
+	pfds[0].fd = mdstat_fd;
+	pfds[0].events = POLLPRI;
 
-	for (array = fcd_raid_list; array != NULL; array = next) {
+	/* fd is ignored by ppoll if it's -1 */
+	pfds[1].fd = fcd_raid_inotify_fd;
+	pfds[1].events = POLLIN;
+	n = 2;
 
-		if (array->sysfs_fd != -1 && close(array->sysfs_fd) == -1)
-			FCD_PERROR("close");
+	for (array = fcd_raid_arrays;
+			array < fcd_raid_arrays + fcd_raid_count; ++array) {
 
-		next = array->next;
-		free(array);
+		afds[0] = &array->degraded_fd;
+		afds[1] = &array->sync_action_fd;
+
+		for (i = 0; i < 2 && n < FCD_RAID_MAX_POLL_FDS; ++i) {
+
+			if (*afds[i] == -1)
+				continue;
+
+			pfds[n].fd = *afds[i];
+			pfds[n].events = POLLPRI;
+			fds[n] = afds[i];
+			++n;
+		}
 	}
 
-	if (mdstat_fd != -1 && close(mdstat_fd) == -1)
-		FCD_PERROR("close");
-	if (pipe_fds[0] != -1 && close(pipe_fds[0]) == -1)
-		FCD_PERROR("close");
-	if (pipe_fds[1] != -1 && close(pipe_fds[1]) == -1)
-		FCD_PERROR("close");
+	/*
+	 * The inotify watch covers all of /etc.  Go back to sleep (until the
+	 * same deadline) if nothing but another file in /etc has changed.
+	 */
 
-	free(fcd_raid_uuid_buf);
-	free(mdstat_buf);
-}
+	do {
+		if (fcd_lib_tick_timeout(&ts, period) == -1)
+			return -1;
 
-__attribute__((noreturn))
-static void fcd_raid_disable(char *mdstat_buf, int mdstat_fd, int *pipe_fds,
-			     struct fcd_monitor *mon)
-{
-	fcd_raid_cleanup(mdstat_buf, mdstat_fd, pipe_fds);
-	fcd_lib_fail_and_exit(mon);
-}
+		ret = ppoll(pfds, n, &ts, &fcd_mon_ppoll_sigmask);
+		if (ret == -1) {
+			if (errno != EINTR) {
+				FCD_PERROR("ppoll");
+				return -1;
+			}
+			return fcd_thread_exit_flag;
+		}
 
-static int fcd_raid_setup(int *pipe_fds, int *mdstat_fd, char **mdstat_buf,
-			  size_t *mdstat_size)
-{
-	static const char path[] = "/proc/mdstat";
-	int ret;
+		fcd_lib_count_wakeup();
 
-	*mdstat_buf = NULL;
-	*mdstat_size = 0;
-	*mdstat_fd = -1;
-	pipe_fds[0] = -1;
-	pipe_fds[1] = -1;
+		if (ret == 0)
+			return fcd_thread_exit_flag;
 
-	if (fcd_raid_regcomp() == -1)
-		return -1;
+		if ((pfds[1].revents & POLLIN) &&
+				fcd_raid_read_inotify() == -1)
+			return -1;
 
-	if (pipe2(pipe_fds, O_CLOEXEC) == -1)
-		return -1;
+	} while (ret == 1 && pfds[1].revents != 0 && !fcd_raid_conf_changed);
 
-	ret = fcd_raid_read_mdadm_conf(mdstat_buf, mdstat_size);
-	if (ret < 0)
-		return ret;
+	/*
+	 * Re-arm the attributes that fired.  (/proc/mdstat is re-armed when
+	 * it is read.)
+	 */
 
-	*mdstat_fd = open(path, O_RDONLY | O_CLOEXEC);
-	if (*mdstat_fd == -1) {
-		FCD_PERROR(path);
+	for (i = 2; i < n; ++i) {
+
+		if (!(pfds[i].revents & (POLLPRI | POLLERR)))
+			continue;
+
+		if (*fds[i] != -1 && fcd_raid_rearm_attr(fds[i]) == -1)
+			return -1;
+	}
+
+	FCD_DEBUG("md event or mdadm.conf change; re-reading /proc/mdstat\n");
+
+	/* md events tend to come in bursts */
+	ts.tv_sec = 0;
+	ts.tv_nsec = FCD_RAID_SETTLE_MS * 1000000L;
+
+	if (ppoll(NULL, 0, &ts, &fcd_mon_ppoll_sigmask) == -1 &&
+			errno != EINTR) {
+		FCD_PERROR("ppoll");
 		return -1;
 	}
 
-	return 0;
+	return fcd_thread_exit_flag;
 }
 
+/*
+ * Counts an array (once) as OK, WARN, or FAIL.  An active array with problems
+ * (slow or stalled sync, mismatches, or member errors) is counted as WARN.
+ */
 static void fcd_raid_result(int *ok, int *warn, int *fail, int *disks,
-			    const struct fcd_raid_array *array)
+			    const struct fcd_raid_array *array,
+			    const _Bool problems)
 {
 	unsigned i;
 
 	switch (array->array_status) {
 
-		case FCD_RAID_ARRAY_ACTIVE:	++(*ok);
+		case FCD_RAID_ARRAY_ACTIVE:	if (problems)
+							++(*warn);
+						else
+							++(*ok);
 						return;
 
 		case FCD_RAID_ARRAY_DEGRADED:	++(*warn);
@@ -1000,67 +2324,118 @@ __attribute__((noreturn))
 static void *fcd_raid_fn(void *arg)
 {
 	struct fcd_monitor *mon = arg;
-	int ret, fd, ok, warn, fail, disks[FCD_MAX_DISK_COUNT], pipe_fds[2];
-	const struct fcd_raid_array *array;
-	char buf[21], *mdstat_buf;
-	size_t mdstat_size;
+	int ret, fd, ok, warn, fail, disks[FCD_MAX_DISK_COUNT];
+	_Bool problems;
+	struct fcd_raid_array *array;
+	unsigned i;
+	struct fcd_lib_buf mdstat_buf =
+		FCD_LIB_BUF_INIT("/proc/mdstat", FCD_RAID_FILE_BUF_SIZE);
+	char upper[20], progress[20], buf[21];
+	time_t period;
 
-	if (fcd_raid_setup(pipe_fds, &fd, &mdstat_buf, &mdstat_size) != 0)
-		fcd_raid_disable(mdstat_buf, fd, pipe_fds, mon);
+	if (fcd_raid_setup(&fd, &mdstat_buf) != 0)
+		fcd_raid_disable(&mdstat_buf, fd, mon);
 
 	do {
 		memset(buf, ' ', sizeof buf);
 
+		if (fcd_raid_conf_changed) {
+			ret = fcd_raid_reread_mdadm_conf(&mdstat_buf);
+			if (ret == -3)
+				break;
+			if (ret < 0)
+				fcd_raid_disable(&mdstat_buf, fd, mon);
+		}
+
 		if (lseek(fd, SEEK_SET, 0) == -1) {
 			FCD_PERROR("lseek");
-			fcd_raid_disable(mdstat_buf, fd, pipe_fds, mon);
+			fcd_raid_disable(&mdstat_buf, fd, mon);
 		}
 
-		ret = fcd_raid_read_file(fd, &mdstat_buf, &mdstat_size);
+		ret = fcd_raid_read_file(fd, &mdstat_buf);
 		if (ret == -3)
 			break;
 		if (ret < 0)
-			fcd_raid_disable(mdstat_buf, fd, pipe_fds, mon);
+			fcd_raid_disable(&mdstat_buf, fd, mon);
 
-		ret = fcd_raid_parse_mdstat(mdstat_buf, pipe_fds);
+		ret = fcd_raid_parse_mdstat(mdstat_buf.data);
 		if (ret == -3)
 			break;
 		if (ret < 0)
-			fcd_raid_disable(mdstat_buf, fd, pipe_fds, mon);
+			fcd_raid_disable(&mdstat_buf, fd, mon);
 
 		ok = warn = fail = 0;
 		memset(disks, 0, sizeof disks);
 
-		for (array = fcd_raid_list; array != NULL;
-					    array = array->next) {
+		for (i = 0; i < fcd_raid_count; ++i) {
+
+			array = &fcd_raid_arrays[i];
+			problems = 0;
+
+			if (array->array_status == FCD_RAID_ARRAY_STOPPED ||
+			    array->array_status == FCD_RAID_ARRAY_INACTIVE) {
+				fcd_raid_sync_reset(&array->sync);
+			}
+			else {
+				if (fcd_raid_sync_update(array) == -1 ||
+					fcd_raid_member_update(array) == -1) {
+					fcd_raid_disable(&mdstat_buf, fd,
+							 mon);
+				}
+				problems =
+					fcd_raid_member_result(disks, array) ||
+					array->sync.stalled ||
+					array->sync.slow ||
+					fcd_raid_mm_warn(array->mm);
+			}
 
-			fcd_raid_result(&ok, &warn, &fail, disks, array);
+			fcd_raid_result(&ok, &warn, &fail, disks, array,
+					problems);
 		}
 
 		ret = fcd_lib_snprintf(buf, sizeof buf, "OK:%d WARN:%d FAIL:%d",
 				       ok, warn, fail);
 		if (ret < 0)
-			fcd_raid_disable(mdstat_buf, fd, pipe_fds, mon);
+			fcd_raid_disable(&mdstat_buf, fd, mon);
+
+		memcpy(upper, "RAID STATUS         ", 20);
+		period = fcd_raid_poll_interval;
+
+		/* Show sync progress, unless an array has failed */
+		if (fcd_raid_sync_display(upper, progress)) {
+			period = FCD_RAID_SYNC_POLL;
+			if (fail == 0)
+				memcpy(buf, progress, 20);
+		}
 
-		fcd_lib_set_mon_status(mon, buf, warn, fail, disks, 0);
+		fcd_lib_set_mon_status2(mon, upper, buf, warn, fail, disks, 0);
 
-		ret = fcd_lib_monitor_sleep(30);
+		ret = fcd_raid_wait(fd, period);
 		if (ret == -1)
-			fcd_raid_disable(mdstat_buf, fd, pipe_fds, mon);
+			fcd_raid_disable(&mdstat_buf, fd, mon);
 
 	} while (ret == 0);
 
-	fcd_raid_cleanup(mdstat_buf, fd, pipe_fds);
+	fcd_raid_cleanup(&mdstat_buf, fd);
 	pthread_exit(NULL);
 }
 
+static void fcd_raid_dump_cfg(void)
+{
+	FCD_DUMP("\tsafety poll interval: %d seconds\n",
+		 fcd_raid_poll_interval);
+	FCD_DUMP("\tmismatch threshold: %d\n", fcd_raid_mm_threshold);
+}
+
 struct fcd_monitor fcd_raid_monitor = {
 	.mutex			= PTHREAD_MUTEX_INITIALIZER,
 	.name			= "RAID status",
 	.monitor_fn		= fcd_raid_fn,
+	.cfg_dump_fn		= fcd_raid_dump_cfg,
 	.buf			= "....."
 				  "RAID STATUS         "
 				  "                    ",
 	.enabled		= true,
 	.enabled_opt_name	= "enable_raid_monitor",
+	.freecusd_opts		= fcd_raid_opts,
 };
@@ -0,0 +1,325 @@
+/*
+ * Copyright 2026 Ian Pilcher <arequipeno@gmail.com>
+ *
+ * This program is free software.  You can redistribute it or modify it under
+ * the terms of version 2 of the GNU General Public License (GPL), as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY -- without even the implied warranty of MERCHANTIBILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the text of the GPL for more details.
+ *
+ * Version 2 of the GNU General Public License is available at:
+ *
+ *   http://www.gnu.org/licenses/old-licenses/gpl-2.0.html
+ */
+
+/*
+ * SATA link speed monitor.  A bad cable or backplane slot can cause a disk's
+ * link to fall back to a lower speed, which slows down every rebuild and
+ * scrub of its array.  For each RAID disk, the monitor reads the negotiated
+ * speed of its link (sata_spd) and compares it with the highest speed that
+ * both the controller (hw_sata_spd_limit) and the disk (word 76 of its
+ * IDENTIFY DEVICE data) support.  sata_spd_limit -- which the kernel lowers
+ * when it "slows down" a link after errors -- is logged when a downgrade is
+ * detected.
+ *
+ * The attributes are in /sys/class/ata_link/linkN and
+ * /sys/class/ata_device/devN.0, where N is the kernel's ID of the disk's port
+ * (see fcd_disk_detect()).
+ */
+
+#include "freecusd.h"
+
+#include <string.h>
+#include <fcntl.h>
+
+/* Seconds between checks */
+#define FCD_SATA_INTERVAL	60
+
+/* IDENTIFY DEVICE word with the supported SATA speeds (bits 1-3) */
+#define FCD_SATA_ID_CAP_WORD	76
+
+struct fcd_sata_attr {
+	int fd;
+	char path[48];
+};
+
+enum fcd_sata_attr_idx {
+	FCD_SATA_SPD = 0,
+	FCD_SATA_SPD_LIMIT,
+	FCD_SATA_HW_SPD_LIMIT,
+	FCD_SATA_ID,
+	FCD_SATA_ATTR_COUNT,
+};
+
+struct fcd_sata_port {
+	struct fcd_sata_attr attrs[FCD_SATA_ATTR_COUNT];
+	unsigned gen;		/* negotiated; 0 = unknown/no link */
+	unsigned max_gen;	/* 0 = unknown */
+	_Bool downgraded;
+};
+
+/* Indexed like fcd_conf_disks */
+static struct fcd_sata_port fcd_sata_ports[FCD_MAX_DISK_COUNT];
+
+/* Speeds of SATA generations 1 - 3, as shown in sysfs (and on the LCD) */
+static const char *const fcd_sata_speeds[] = { "---", "1.5", "3.0", "6.0" };
+
+/* Size of the IDENTIFY DEVICE data in sysfs - 256 words as "xxxx " */
+#define FCD_SATA_ID_SIZE	(256 * 5 + 1)
+
+/* Returns the SATA generation of a speed (e.g. "3.0 Gbps"); 0 if unknown */
+static unsigned fcd_sata_parse_spd(const char *const s)
+{
+	unsigned i;
+
+	for (i = 1; i < FCD_ARRAY_SIZE(fcd_sata_speeds); ++i) {
+		if (strncmp(s, fcd_sata_speeds[i], 3) == 0 &&
+				strncmp(s + 3, " Gbps", 5) == 0)
+			return i;
+	}
+
+	return 0;
+}
+
+/*
+ * Returns the highest SATA generation supported by a disk, from its IDENTIFY
+ * DEVICE data (hex words, separated by whitespace); 0 if unknown.
+ */
+static unsigned fcd_sata_parse_id(const char *c)
+{
+	unsigned long word;
+	unsigned i;
+	char *end;
+
+	for (i = 0; i <= FCD_SATA_ID_CAP_WORD; ++i) {
+		word = strtoul(c, &end, 16);
+		if (end == c)
+			return 0;
+		c = end;
+	}
+
+	/* 0000h or FFFFh means the word isn't supported */
+	if (word == 0xffff)
+		return 0;
+
+	for (i = FCD_ARRAY_SIZE(fcd_sata_speeds) - 1; i > 0; --i) {
+		if (word & (1 << i))
+			return i;
+	}
+
+	return 0;
+}
+
+static void fcd_sata_close_all(void)
+{
+	struct fcd_sata_attr *attr;
+	unsigned i, j;
+
+	for (i = 0; i < fcd_conf_disk_count; ++i) {
+
+		for (j = 0; j < FCD_SATA_ATTR_COUNT; ++j) {
+
+			attr = &fcd_sata_ports[i].attrs[j];
+
+			if (attr->fd != -1 && close(attr->fd) == -1)
+				FCD_PERROR(attr->path);
+
+			attr->fd = -1;
+		}
+	}
+}
+
+__attribute__((noreturn))
+static void fcd_sata_disable(struct fcd_monitor *const mon)
+{
+	fcd_sata_close_all();
+	fcd_lib_fail_and_exit(mon);
+}
+
+/* Opens the sysfs attributes of every RAID disk.  Returns 0 or -1 on error. */
+static int fcd_sata_open_all(void)
+{
+	static const char *const formats[FCD_SATA_ATTR_COUNT] = {
+		[FCD_SATA_SPD]		= "/sys/class/ata_link/link%u/sata_spd",
+		[FCD_SATA_SPD_LIMIT]	= "/sys/class/ata_link/link%u/"
+						"sata_spd_limit",
+		[FCD_SATA_HW_SPD_LIMIT]	= "/sys/class/ata_link/link%u/"
+						"hw_sata_spd_limit",
+		[FCD_SATA_ID]		= "/sys/class/ata_device/dev%u.0/id",
+	};
+	struct fcd_sata_attr *attr;
+	unsigned i, j;
+
+	for (i = 0; i < fcd_conf_disk_count; ++i) {
+		for (j = 0; j < FCD_SATA_ATTR_COUNT; ++j)
+			fcd_sata_ports[i].attrs[j].fd = -1;
+	}
+
+	for (i = 0; i < fcd_conf_disk_count; ++i) {
+
+		for (j = 0; j < FCD_SATA_ATTR_COUNT; ++j) {
+
+			attr = &fcd_sata_ports[i].attrs[j];
+
+			sprintf(attr->path, formats[j],
+				fcd_conf_disks[i].ata_id);
+
+			attr->fd = open(attr->path, O_RDONLY | O_CLOEXEC);
+			if (attr->fd == -1) {
+				FCD_PERROR(attr->path);
+				return -1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Reads a speed attribute.  Returns the SATA generation (0 if unknown), or -1
+ * on error.
+ */
+static int fcd_sata_read_spd(const struct fcd_sata_attr *const attr)
+{
+	char buf[32];
+
+	if (fcd_lib_read_attr(attr->fd, attr->path, buf, sizeof buf) == -1)
+		return -1;
+
+	return fcd_sata_parse_spd(buf);
+}
+
+/*
+ * Reads the current and maximum speeds of a disk's link, and logs any change
+ * in its downgraded status.  Returns 0 on success, -1 on error.
+ */
+static int fcd_sata_update(const unsigned d)
+{
+	struct fcd_sata_port *const port = &fcd_sata_ports[d];
+	char id[FCD_SATA_ID_SIZE];
+	int gen, limit, hw, disk;
+	_Bool downgraded;
+
+	gen = fcd_sata_read_spd(&port->attrs[FCD_SATA_SPD]);
+	limit = fcd_sata_read_spd(&port->attrs[FCD_SATA_SPD_LIMIT]);
+	hw = fcd_sata_read_spd(&port->attrs[FCD_SATA_HW_SPD_LIMIT]);
+	if (gen == -1 || limit == -1 || hw == -1)
+		return -1;
+
+	/* No device (e.g. disk removed) is logged, but isn't fatal */
+	if (fcd_lib_read_attr(port->attrs[FCD_SATA_ID].fd,
+			      port->attrs[FCD_SATA_ID].path,
+			      id, sizeof id) == -1)
+		disk = 0;
+	else
+		disk = fcd_sata_parse_id(id);
+
+	port->gen = gen;
+
+	if (hw == 0 || (disk != 0 && disk < hw))
+		port->max_gen = disk;
+	else
+		port->max_gen = hw;
+
+	downgraded = (gen != 0 && gen < (int)port->max_gen);
+
+	if (downgraded && !port->downgraded) {
+		FCD_WARN("%s: SATA link at %s Gbps (max %s Gbps, limit %s)\n",
+			 fcd_conf_disks[d].name, fcd_sata_speeds[gen],
+			 fcd_sata_speeds[port->max_gen],
+			 limit == 0 ? "none" : fcd_sata_speeds[limit]);
+	}
+	else if (!downgraded && port->downgraded) {
+		FCD_INFO("%s: SATA link back to %s Gbps\n",
+			 fcd_conf_disks[d].name, fcd_sata_speeds[gen]);
+	}
+
+	port->downgraded = downgraded;
+
+	return 0;
+}
+
+/*
+ * Formats the LCD display -- the link speed of each disk bay, in order, with
+ * downgraded links marked.  E.g. "3.0 3.0 1.5*3.0 --- ".
+ */
+static int fcd_sata_format(char *const buf)
+{
+	const struct fcd_sata_port *port;
+	unsigned bay, d;
+
+	memset(buf, ' ', 21);
+
+	for (bay = 0; bay < FCD_MAX_DISK_COUNT; ++bay) {
+
+		for (d = 0; d < fcd_conf_disk_count; ++d) {
+			if (fcd_conf_disks[d].port_no - 2 == bay)
+				break;
+		}
+
+		if (d == fcd_conf_disk_count) {
+			memcpy(buf + 4 * bay, fcd_sata_speeds[0], 3);
+			continue;
+		}
+
+		port = &fcd_sata_ports[d];
+
+		if (fcd_lib_snprintf(buf + 4 * bay, 5, "%s%c",
+				     fcd_sata_speeds[port->gen],
+				     port->downgraded ? '*' : ' ') < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+__attribute__((noreturn))
+static void *fcd_sata_fn(void *arg)
+{
+	int ret, warn, disks[FCD_MAX_DISK_COUNT];
+	struct fcd_monitor *mon = arg;
+	char buf[21];
+	unsigned d;
+
+	if (fcd_sata_open_all() == -1)
+		fcd_sata_disable(mon);
+
+	do {
+		memset(disks, 0, sizeof disks);
+
+		for (warn = 0, d = 0; d < fcd_conf_disk_count; ++d) {
+
+			if (fcd_sata_update(d) == -1)
+				fcd_sata_disable(mon);
+
+			disks[d] = fcd_sata_ports[d].downgraded;
+			warn += disks[d];
+		}
+
+		if (fcd_sata_format(buf) == -1)
+			fcd_sata_disable(mon);
+
+		fcd_lib_set_mon_status(mon, buf, warn, 0, disks, 0);
+
+		ret = fcd_lib_monitor_sleep(FCD_SATA_INTERVAL);
+		if (ret == -1)
+			fcd_sata_disable(mon);
+
+	} while (ret == 0);
+
+	fcd_sata_close_all();
+	pthread_exit(NULL);
+}
+
+struct fcd_monitor fcd_sata_monitor = {
+	.mutex			= PTHREAD_MUTEX_INITIALIZER,
+	.name			= "SATA link speed",
+	.monitor_fn		= fcd_sata_fn,
+	.buf			= "....."
+				  "SATA LINKS (Gbps)   "
+				  "                    ",
+	.enabled		= true,
+	.enabled_opt_name	= "enable_sata_link_monitor",
+};
@@ -0,0 +1,434 @@
+/*
+ * Copyright 2026 Ian Pilcher <arequipeno@gmail.com>
+ *
+ * This program is free software.  You can redistribute it or modify it under
+ * the terms of version 2 of the GNU General Public License (GPL), as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY -- without even the implied warranty of MERCHANTIBILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the text of the GPL for more details.
+ *
+ * Version 2 of the GNU General Public License is available at:
+ *
+ *   http://www.gnu.org/licenses/old-licenses/gpl-2.0.html
+ */
+
+/*
+ * Low-impact scheduling.  Monitor threads and helper processes (smartctl,
+ * mdadm, etc.) can be given a lower CPU priority (nice or SCHED_IDLE), and
+ * helpers can also be given a lower I/O priority.  The whole daemon can be
+ * bound to a single CPU.
+ *
+ * If helper_cgroup is enabled, the daemon creates two cgroup (v2) sub-groups
+ * within its own cgroup (which must be delegated to it; see the Delegate
+ * setting in freecusd.service) -- "daemon", to which it moves itself, and
+ * "helpers", into which each helper process moves itself before it execs.
+ * The helpers group can be limited with cpu.max and io.max, and the CPU time
+ * used by each group is logged when the daemon exits.
+ *
+ * The main thread (which controls the LEDs and fan) always runs with the
+ * daemon's original priority.
+ */
+
+#include "freecusd.h"
+
+#include <sys/sysmacros.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/stat.h>
+#include <string.h>
+#include <limits.h>
+#include <sched.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#define FCD_SCHED_CGROUP_ROOT	"/sys/fs/cgroup"
+
+/* cpu.max period (microseconds) */
+#define FCD_SCHED_CPU_PERIOD	100000
+
+/* ioprio_set(2) -- no glibc wrapper */
+#define FCD_SCHED_IOPRIO_WHO_PROCESS	1
+#define FCD_SCHED_IOPRIO_CLASS_SHIFT	13
+
+/* Directory file descriptors for the sub-groups */
+static int fcd_sched_daemon_cg = -1;
+static int fcd_sched_helpers_cg = -1;
+
+/* helpers/cgroup.procs; written by each helper process before it execs */
+static int fcd_sched_helpers_procs = -1;
+
+/* Sets the scheduling policy of the calling thread to SCHED_IDLE */
+static int fcd_sched_set_idle(void)
+{
+	static const struct sched_param param = { .sched_priority = 0 };
+
+	/* For a thread, the "pid" argument is its TID (0 = caller) */
+	return sched_setscheduler(0, SCHED_IDLE, &param);
+}
+
+/* Sets the nice value of the calling thread (not the whole process) */
+static int fcd_sched_set_nice(const int nice)
+{
+	return setpriority(PRIO_PROCESS, syscall(SYS_gettid), nice);
+}
+
+/*
+ * Called at the start of each monitor thread
+ */
+void fcd_sched_monitor(void)
+{
+	if (fcd_conf_monitor_sched_idle && fcd_sched_set_idle() == -1)
+		FCD_PERROR("sched_setscheduler");
+
+	if (fcd_conf_monitor_nice != INT_MIN &&
+			fcd_sched_set_nice(fcd_conf_monitor_nice) == -1)
+		FCD_PERROR("setpriority");
+}
+
+/*
+ * Called in a child process before it execs a helper program.  Aborts (the
+ * child) on error.
+ */
+void fcd_sched_child(void)
+{
+	static const char zero[] = "0";
+	int ioprio;
+
+	if (fcd_sched_helpers_procs != -1 &&
+			write(fcd_sched_helpers_procs, zero, 1) != 1)
+		FCD_CHILD_PABORT("cgroup.procs");
+
+	if (fcd_conf_helper_sched_idle && fcd_sched_set_idle() == -1)
+		FCD_CHILD_PABORT("sched_setscheduler");
+
+	if (fcd_conf_helper_nice != INT_MIN &&
+			fcd_sched_set_nice(fcd_conf_helper_nice) == -1)
+		FCD_CHILD_PABORT("setpriority");
+
+	if (fcd_conf_helper_io_class != 0) {
+
+		ioprio = fcd_conf_helper_io_class
+					<< FCD_SCHED_IOPRIO_CLASS_SHIFT;
+		if (fcd_conf_helper_io_class != 3)	/* idle has no level */
+			ioprio |= fcd_conf_helper_io_priority;
+
+		if (syscall(SYS_ioprio_set, FCD_SCHED_IOPRIO_WHO_PROCESS, 0,
+			    ioprio) == -1) {
+			FCD_CHILD_PABORT("ioprio_set");
+		}
+	}
+}
+
+/*
+ * Writes a string to a file in a cgroup directory.  Returns 0 on success or -1
+ * on error.
+ */
+static int fcd_sched_cg_write(const int dirfd, const char *const file,
+			      const char *const value)
+{
+	size_t len;
+	int fd;
+
+	fd = openat(dirfd, file, O_WRONLY | O_CLOEXEC);
+	if (fd == -1) {
+		FCD_PERROR(file);
+		return -1;
+	}
+
+	len = strlen(value);
+
+	if (write(fd, value, len) != (ssize_t)len) {
+		FCD_PERROR(file);
+		if (close(fd) == -1)
+			FCD_PERROR("close");
+		return -1;
+	}
+
+	if (close(fd) == -1) {
+		FCD_PERROR("close");
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Creates (if necessary) and opens a sub-group.  Returns the directory file
+ * descriptor, or -1 on error.
+ */
+static int fcd_sched_cg_open(const int parent, const char *const name)
+{
+	int fd;
+
+	if (mkdirat(parent, name, 0755) == -1 && errno != EEXIST) {
+		FCD_PERROR(name);
+		return -1;
+	}
+
+	fd = openat(parent, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd == -1)
+		FCD_PERROR(name);
+
+	return fd;
+}
+
+/*
+ * Finds the daemon's cgroup (v2) directory and opens it.  Returns the
+ * directory file descriptor, or -1 on error.
+ */
+static int fcd_sched_cg_self(void)
+{
+	static const char path[] = "/proc/self/cgroup";
+	char buf[PATH_MAX], dir[PATH_MAX + sizeof FCD_SCHED_CGROUP_ROOT];
+	struct timespec timeout;
+	ssize_t ret;
+	char *c;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		FCD_PERROR(path);
+		return -1;
+	}
+
+	timeout.tv_sec = 0;
+	timeout.tv_nsec = 0;
+
+	ret = fcd_lib_read(fd, buf, sizeof buf - 1, &timeout);
+	if (close(fd) == -1)
+		FCD_PERROR("close");
+	if (ret < 0)
+		return -1;
+
+	buf[ret] = 0;
+
+	/* The unified hierarchy is the "0::" entry */
+	if (strncmp(buf, "0::", 3) == 0)
+		c = buf;
+	else if ((c = strstr(buf, "\n0::")) != NULL)
+		++c;
+	else {
+		FCD_WARN("Not using cgroup v2\n");
+		return -1;
+	}
+
+	c += 3;
+	c[strcspn(c, "\n")] = 0;
+
+	/* We may have been restarted after moving ourselves */
+	ret = strlen(c) - (sizeof "/daemon" - 1);
+	if (ret >= 0 && strcmp(c + ret, "/daemon") == 0)
+		c[ret] = 0;
+
+	if (snprintf(dir, sizeof dir, FCD_SCHED_CGROUP_ROOT "%s", c)
+							>= (int)sizeof dir) {
+		FCD_WARN("cgroup path too long\n");
+		return -1;
+	}
+
+	fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd == -1) {
+		FCD_PERROR(dir);
+		return -1;
+	}
+
+	/* On a "hybrid" system, /sys/fs/cgroup isn't the unified hierarchy */
+	if (faccessat(fd, "cgroup.controllers", F_OK, 0) == -1) {
+		FCD_WARN("%s is not a cgroup v2 directory\n", dir);
+		if (close(fd) == -1)
+			FCD_PERROR("close");
+		return -1;
+	}
+
+	return fd;
+}
+
+/*
+ * Sets io.max for the helpers group -- a read & write IOPS limit for each RAID
+ * disk.
+ */
+static int fcd_sched_cg_io_max(void)
+{
+	char buf[64];
+	struct stat st;
+	unsigned i;
+
+	for (i = 0; i < fcd_conf_disk_count; ++i) {
+
+		if (stat(fcd_conf_disks[i].name, &st) == -1) {
+			FCD_PERROR(fcd_conf_disks[i].name);
+			return -1;
+		}
+
+		snprintf(buf, sizeof buf, "%u:%u riops=%d wiops=%d",
+			 major(st.st_rdev), minor(st.st_rdev),
+			 fcd_conf_helper_io_max, fcd_conf_helper_io_max);
+
+		if (fcd_sched_cg_write(fcd_sched_helpers_cg, "io.max", buf)
+									== -1)
+			return -1;
+	}
+
+	return 0;
+}
+
+static int fcd_sched_cg_setup(void)
+{
+	char buf[32];
+	int self;
+
+	self = fcd_sched_cg_self();
+	if (self == -1)
+		return -1;
+
+	fcd_sched_daemon_cg = fcd_sched_cg_open(self, "daemon");
+	if (fcd_sched_daemon_cg == -1)
+		goto error;
+
+	/* A cgroup with sub-groups can't contain any processes itself */
+	snprintf(buf, sizeof buf, "%ld", (long)getpid());
+	if (fcd_sched_cg_write(fcd_sched_daemon_cg, "cgroup.procs", buf) == -1)
+		goto error;
+
+	if (fcd_sched_cg_write(self, "cgroup.subtree_control", "+cpu +io")
+									== -1)
+		goto error;
+
+	fcd_sched_helpers_cg = fcd_sched_cg_open(self, "helpers");
+	if (fcd_sched_helpers_cg == -1)
+		goto error;
+
+	if (fcd_conf_helper_cpu_max != 0) {
+		snprintf(buf, sizeof buf, "%d %d",
+			 fcd_conf_helper_cpu_max * (FCD_SCHED_CPU_PERIOD / 100),
+			 FCD_SCHED_CPU_PERIOD);
+		if (fcd_sched_cg_write(fcd_sched_helpers_cg, "cpu.max", buf)
+									== -1)
+			goto error;
+	}
+
+	if (fcd_conf_helper_io_max != 0 && fcd_sched_cg_io_max() == -1)
+		goto error;
+
+	fcd_sched_helpers_procs = openat(fcd_sched_helpers_cg, "cgroup.procs",
+					 O_WRONLY | O_CLOEXEC);
+	if (fcd_sched_helpers_procs == -1) {
+		FCD_PERROR("cgroup.procs");
+		goto error;
+	}
+
+	if (close(self) == -1)
+		FCD_PERROR("close");
+
+	return 0;
+
+error:
+	if (close(self) == -1)
+		FCD_PERROR("close");
+	return -1;
+}
+
+/*
+ * Logs the CPU time (usage_usec in cpu.stat) used by a sub-group
+ */
+static void fcd_sched_cg_log_usage(const int dirfd, const char *const name)
+{
+	struct timespec timeout;
+	char buf[256], *c;
+	ssize_t ret;
+	int fd;
+
+	fd = openat(dirfd, "cpu.stat", O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		FCD_PERROR("cpu.stat");
+		return;
+	}
+
+	timeout.tv_sec = 0;
+	timeout.tv_nsec = 0;
+
+	ret = fcd_lib_read(fd, buf, sizeof buf - 1, &timeout);
+	if (close(fd) == -1)
+		FCD_PERROR("close");
+	if (ret < 0)
+		return;
+
+	buf[ret] = 0;
+
+	if (strncmp(buf, "usage_usec ", sizeof "usage_usec " - 1) != 0) {
+		FCD_WARN("Unexpected cpu.stat format\n");
+		return;
+	}
+
+	c = buf + sizeof "usage_usec " - 1;
+	c[strcspn(c, "\n")] = 0;
+
+	FCD_INFO("CPU time used by %s: %s microseconds\n", name, c);
+}
+
+/*
+ * Closes the sub-group file descriptors, optionally logging the CPU time used
+ * by each group.
+ */
+static void fcd_sched_cg_close(const _Bool log_usage)
+{
+	if (fcd_sched_helpers_procs != -1 && close(fcd_sched_helpers_procs)
+									== -1)
+		FCD_PERROR("close");
+
+	if (fcd_sched_helpers_cg != -1) {
+		if (log_usage) {
+			fcd_sched_cg_log_usage(fcd_sched_helpers_cg,
+					       "helper processes");
+		}
+		if (close(fcd_sched_helpers_cg) == -1)
+			FCD_PERROR("close");
+	}
+
+	if (fcd_sched_daemon_cg != -1) {
+		if (log_usage)
+			fcd_sched_cg_log_usage(fcd_sched_daemon_cg, "daemon");
+		if (close(fcd_sched_daemon_cg) == -1)
+			FCD_PERROR("close");
+	}
+
+	fcd_sched_helpers_procs = -1;
+	fcd_sched_helpers_cg = -1;
+	fcd_sched_daemon_cg = -1;
+}
+
+/*
+ * Called by the main thread (before any monitor threads are started).
+ * Settings that can't be applied are logged and ignored.
+ */
+void fcd_sched_init(void)
+{
+	cpu_set_t cpus;
+
+	if (fcd_conf_cpu_affinity != -1) {
+
+		CPU_ZERO(&cpus);
+		CPU_SET(fcd_conf_cpu_affinity, &cpus);
+
+		/* Inherited by monitor threads and helper processes */
+		if (sched_setaffinity(0, sizeof cpus, &cpus) == -1) {
+			FCD_PERROR("sched_setaffinity");
+			FCD_WARN("Failed to set CPU affinity\n");
+		}
+	}
+
+	if (fcd_conf_helper_cgroup && fcd_sched_cg_setup() == -1) {
+		FCD_WARN("Failed to set up helper cgroup\n");
+		fcd_sched_cg_close(0);
+	}
+}
+
+/*
+ * Called by the main thread after the monitor threads have stopped.
+ */
+void fcd_sched_fini(void)
+{
+	fcd_sched_cg_close(1);
+}
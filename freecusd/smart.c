@@ -1,5 +1,5 @@
 /*
- * Copyright 2013-2014, 2016-2017, 2020, 2022 Ian Pilcher <arequipeno@gmail.com>
+ * Copyright 2013-2014, 2016-2017, 2020, 2022, 2026 Ian Pilcher <arequipeno@gmail.com>
  *
  * This program is free software.  You can redistribute it or modify it under
  * the terms of version 2 of the GNU General Public License (GPL), as published
@@ -25,6 +25,12 @@
 
 #define FCD_SMART_BUF_MAX	100
 
+/* S.M.A.R.T. results saved for warm restarts */
+struct fcd_smart_state {
+	int status[FCD_MAX_DISK_COUNT];
+	int temps[FCD_MAX_DISK_COUNT];
+};
+
 static char *fcd_smart_cmd[] = {
 	[0] = "/usr/local/libexec/freecusd-smart-helper",
 	[1] = "freecusd-smart-helper",
@@ -388,18 +394,13 @@ static int fcd_smart_ignore_cb(cip_err_ctx *const ctx,
 }
 
 __attribute__((noreturn))
-static void fcd_smart_disable(char *restrict cmd_buf,
-			      const int *const restrict pipe_fds)
+static void fcd_smart_disable(struct fcd_lib_buf *cmd_buf)
 {
 	fcd_lib_fail(&fcd_hddtemp_monitor);
-	fcd_lib_parent_fail_and_exit(&fcd_smart_monitor, pipe_fds, cmd_buf);
+	fcd_lib_parent_fail_and_exit(&fcd_smart_monitor, cmd_buf);
 }
 
-static int fcd_smart_exec(const int disk,
-			  char **const restrict cmd_buf,
-			  size_t *const restrict buf_size,
-			  const int *const restrict pipe_fds)
-
+static int fcd_smart_exec(const int disk, struct fcd_lib_buf *const cmd_buf)
 {
 	struct timespec timeout;
 	int ret, status;
@@ -409,18 +410,12 @@ static int fcd_smart_exec(const int disk,
 
 	fcd_smart_cmd[2] = fcd_conf_disks[disk].name;
 
-	ret = fcd_lib_cmd_output(&status,
-				 fcd_smart_cmd,
-				 cmd_buf,
-				 buf_size,
-				 FCD_SMART_BUF_MAX,
-				 &timeout,
-				 pipe_fds);
+	ret = fcd_lib_cmd_output(&status, fcd_smart_cmd, cmd_buf, &timeout);
 
 	switch (ret) {
 
 		case -4:		/* Max buffer size exceeded */
-			fcd_smart_disable(*cmd_buf, pipe_fds);
+			fcd_smart_disable(cmd_buf);
 
 		case -3:		/* Got exit signal */
 			return -3;
@@ -430,7 +425,7 @@ static int fcd_smart_exec(const int disk,
 			return -2;
 
 		case -1:		/* Error spawning helper */
-			fcd_smart_disable(*cmd_buf, pipe_fds);
+			fcd_smart_disable(cmd_buf);
 	}
 
 	if (status != 0) {
@@ -446,13 +441,12 @@ static int fcd_smart_exec(const int disk,
 static void fcd_smart_parse(const int disk,
 			    int *const restrict status,
 			    int *const restrict temps,
-			    char *const restrict cmd_buf,
-			    const int *const restrict pipe_fds)
+			    struct fcd_lib_buf *const restrict cmd_buf)
 {
 	int ret;
 
 	errno = 0;
-	ret = sscanf(cmd_buf, "%d\n%d\n", &status[disk], &temps[disk]);
+	ret = sscanf(cmd_buf->data, "%d\n%d\n", &status[disk], &temps[disk]);
 	if (ret == 2 && errno == 0)
 		return;
 
@@ -463,7 +457,7 @@ static void fcd_smart_parse(const int disk,
 	else
 		FCD_ABORT("Error parsing %s output\n", fcd_smart_cmd[1]);
 
-	fcd_smart_disable(cmd_buf, pipe_fds);
+	fcd_smart_disable(cmd_buf);
 }
 
 static void process_status(int *const restrict status)
@@ -513,8 +507,7 @@ static void process_status(int *const restrict status)
 
 static void process_temps(int *const restrict status,
 			  int *const restrict temps,
-			  char *const restrict cmd_buf,
-			  const int *const restrict pipe_fds)
+			  struct fcd_lib_buf *const restrict cmd_buf)
 {
 	int alerts[FCD_MAX_DISK_COUNT], warn, fail;
 	char buf[21], *c;
@@ -557,7 +550,7 @@ static void process_temps(int *const restrict status,
 			ret = sprintf(c, "%d", temps[i]);
 			if (ret < 0) {
 				FCD_PERROR("sprintf");
-				fcd_smart_disable(cmd_buf, pipe_fds);
+				fcd_smart_disable(cmd_buf);
 			}
 
 			c[ret] = ' ';	/* sprintf 0-terminates */
@@ -584,21 +577,35 @@ static void process_temps(int *const restrict status,
 __attribute__((noreturn))
 static void *fcd_smart_fn(void *arg __attribute__((unused)))
 {
-	int status[FCD_MAX_DISK_COUNT], temps[FCD_MAX_DISK_COUNT];
-	int pipe_fds[2];
+	struct fcd_smart_state state;
+	int *const status = state.status, *const temps = state.temps;
 	int ret;
-	char *cmd_buf;
-	size_t buf_size;
+	struct fcd_lib_buf cmd_buf =
+			FCD_LIB_BUF_INIT(fcd_smart_cmd[1], FCD_SMART_BUF_MAX);
+	time_t age;
 	unsigned i;
 
-	if (pipe2(pipe_fds, O_CLOEXEC) == -1) {
-		FCD_PERROR("pipe2");
-		fcd_lib_fail(&fcd_hddtemp_monitor);
-		fcd_lib_fail_and_exit(&fcd_smart_monitor);
-	}
+	if (fcd_lib_buf_prealloc(&cmd_buf) == -1)
+		fcd_smart_disable(&cmd_buf);
 
-	cmd_buf = NULL;
-	buf_size = 0;
+	/*
+	 * If fresh results were saved by a previous run, use them rather than
+	 * immediately running the helper for every disk.  (Wait for the next
+	 * 30-second tick, which is never more than 30 seconds away.)
+	 */
+	memset(&state, 0, sizeof state);
+	age = fcd_state_get_priv(&fcd_smart_monitor, &state, sizeof state);
+	if (age >= 0) {
+		process_status(status);
+		process_temps(status, temps, &cmd_buf);
+		if (age < 30) {
+			ret = fcd_lib_monitor_sleep(30);
+			if (ret == -1)
+				fcd_smart_disable(&cmd_buf);
+			if (ret != 0)
+				goto break_outer_loop;
+		}
+	}
 
 	do {
 		for (i = 0; i < fcd_conf_disk_count; ++i) {
@@ -606,7 +613,7 @@ static void *fcd_smart_fn(void *arg __attribute__((unused)))
 			if (fcd_conf_disks[i].smart_ignore && fcd_conf_disks[i].temp_ignore)
 				continue;
 
-			ret = fcd_smart_exec(i,	&cmd_buf, &buf_size, pipe_fds);
+			ret = fcd_smart_exec(i, &cmd_buf);
 			if (ret == -3) {
 				goto break_outer_loop;
 			}
@@ -615,21 +622,21 @@ static void *fcd_smart_fn(void *arg __attribute__((unused)))
 				continue;
 			}
 
-			fcd_smart_parse(i, status, temps, cmd_buf, pipe_fds);
+			fcd_smart_parse(i, status, temps, &cmd_buf);
 		}
 
 		process_status(status);
-		process_temps(status, temps, cmd_buf, pipe_fds);
+		process_temps(status, temps, &cmd_buf);
+		fcd_state_set_priv(&fcd_smart_monitor, &state, sizeof state);
 
 		ret = fcd_lib_monitor_sleep(30);
 		if (ret == -1)
-			fcd_smart_disable(cmd_buf, pipe_fds);
+			fcd_smart_disable(&cmd_buf);
 
 	} while (ret == 0);
 
 break_outer_loop:
-	free(cmd_buf);
-	fcd_proc_close_pipe(pipe_fds);
+	fcd_lib_buf_free(&cmd_buf);
 	pthread_exit(NULL);
 }
 
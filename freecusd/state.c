@@ -0,0 +1,492 @@
+/*
+ * Copyright 2026 Ian Pilcher <arequipeno@gmail.com>
+ *
+ * This program is free software.  You can redistribute it or modify it under
+ * the terms of version 2 of the GNU General Public License (GPL), as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY -- without even the implied warranty of MERCHANTIBILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the text of the GPL for more details.
+ *
+ * Version 2 of the GNU General Public License is available at:
+ *
+ *   http://www.gnu.org/licenses/old-licenses/gpl-2.0.html
+ */
+
+/*
+ * Warm restart support.  The main thread periodically saves the state of every
+ * monitor (front-panel message, alerts, PWM flags, and an optional monitor-
+ * specific blob) and the fan speed to a file in /run.  At startup, any state
+ * that is still fresh is restored before the monitor threads are started, so
+ * a restart doesn't cause a burst of fan noise or a period of "no data".
+ */
+
+#include "freecusd.h"
+
+#include <sys/stat.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#define FCD_STATE_DIR		"/run/freecusd"
+#define FCD_STATE_FILE		FCD_STATE_DIR "/state"
+#define FCD_STATE_TMP_FILE	FCD_STATE_DIR "/state.tmp"
+
+#define FCD_STATE_MAGIC		"FCDSTATE"
+#define FCD_STATE_VERSION	1
+
+/* Enough for every monitor in fcd_monitors[] */
+#define FCD_STATE_MAX_RECS	16
+
+/* Monitor name is used to match saved state to monitors */
+#define FCD_STATE_NAME_SIZE	32
+
+/* Alert slots - sys_warn, sys_fail, and disk_alerts[] */
+#define FCD_STATE_ALERT_COUNT	(2 + FCD_MAX_DISK_COUNT)
+
+struct fcd_state_hdr {
+	char magic[8];
+	uint32_t version;
+	uint32_t count;
+	int32_t pwm_state;		/* -1 if PWM monitor disabled */
+	time_t saved;
+};
+
+struct fcd_state_rec {
+	char name[FCD_STATE_NAME_SIZE];
+	time_t updated;
+	time_t priv_time;
+	uint32_t priv_size;
+	uint8_t pwm_flags;
+	uint8_t alerts[FCD_STATE_ALERT_COUNT];
+	uint8_t buf[66];
+	uint8_t priv[FCD_STATE_PRIV_SIZE];
+};
+
+/* Maximum age (seconds) of saved state that will be restored */
+static int fcd_state_max_age = 120;		/* warm_restart_max_age */
+
+static int fcd_state_age_cb();
+
+static const cip_opt_info fcd_state_opts[] = {
+	{
+		.name			= "warm_restart_max_age",
+		.type			= CIP_OPT_TYPE_INT,
+		.post_parse_fn		= fcd_state_age_cb,
+		.post_parse_data	= &fcd_state_max_age,
+	},
+	{	.name			= NULL		}
+};
+
+/* Restored fan speed, or -1 if nothing was restored */
+static int fcd_state_pwm = -1;
+
+/*
+ * Monitor-specific state blobs.  Written by monitor threads, read by the main
+ * thread when saving state, so protected by a mutex.
+ */
+static pthread_mutex_t fcd_state_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct fcd_state_rec fcd_state_recs[FCD_STATE_MAX_RECS];
+
+/*
+ * Configuration callback for the maximum state age
+ */
+static int fcd_state_age_cb(cip_err_ctx *ctx, const cip_ini_value *value,
+			    const cip_ini_sect *sect __attribute__((unused)),
+			    const cip_ini_file *file __attribute__((unused)),
+			    void *post_parse_data)
+{
+	int age;
+
+	memcpy(&age, value->value, sizeof age);
+
+	if (age < 0) {
+		cip_err(ctx, "Invalid warm restart maximum age: %d", age);
+		return -1;
+	}
+
+	*(int *)post_parse_data = age;
+
+	return 0;
+}
+
+/*
+ * Returns the index of mon in fcd_monitors (and fcd_state_recs)
+ */
+static int fcd_state_mon_index(const struct fcd_monitor *const mon)
+{
+	int i;
+
+	for (i = 0; fcd_monitors[i] != NULL; ++i) {
+
+		if (fcd_monitors[i] != mon)
+			continue;
+
+		if (i >= FCD_STATE_MAX_RECS)
+			FCD_ABORT("Too many monitors for state records\n");
+
+		return i;
+	}
+
+	FCD_ABORT("Unknown monitor: %s\n", mon->name);
+}
+
+/*
+ * Returns pointers to a monitor's alert messages, in the order that they are
+ * stored in a state record.
+ */
+static void fcd_state_mon_alerts(struct fcd_monitor *const mon,
+				 enum fcd_alert_msg **const alerts)
+{
+	unsigned i;
+
+	alerts[0] = &mon->sys_warn;
+	alerts[1] = &mon->sys_fail;
+
+	for (i = 0; i < FCD_MAX_DISK_COUNT; ++i)
+		alerts[i + 2] = &mon->disk_alerts[i];
+}
+
+/*
+ * Called by a monitor thread to save its monitor-specific state.
+ */
+void fcd_state_set_priv(const struct fcd_monitor *const mon,
+			const void *const data, const size_t size)
+{
+	struct fcd_state_rec *rec;
+	int ret;
+
+	if (!fcd_state_monitor.enabled)
+		return;
+
+	if (size > FCD_STATE_PRIV_SIZE)
+		FCD_ABORT("%s monitor state too large\n", mon->name);
+
+	rec = &fcd_state_recs[fcd_state_mon_index(mon)];
+
+	if ((ret = pthread_mutex_lock(&fcd_state_mutex)) != 0)
+		FCD_PT_ABRT("pthread_mutex_lock", ret);
+
+	memcpy(rec->priv, data, size);
+	rec->priv_size = size;
+	rec->priv_time = fcd_lib_boottime();
+
+	if ((ret = pthread_mutex_unlock(&fcd_state_mutex)) != 0)
+		FCD_PT_ABRT("pthread_mutex_unlock", ret);
+}
+
+/*
+ * Called by a monitor thread to retrieve monitor-specific state that was
+ * restored at startup.  Returns the age (in seconds) of the state or -1 if no
+ * (fresh) state of the expected size was restored.  Restored state is only
+ * returned once.
+ */
+time_t fcd_state_get_priv(const struct fcd_monitor *const mon,
+			  void *const data, const size_t size)
+{
+	struct fcd_state_rec *rec;
+	time_t age;
+	int ret;
+
+	if (!fcd_state_monitor.enabled)
+		return -1;
+
+	rec = &fcd_state_recs[fcd_state_mon_index(mon)];
+
+	if ((ret = pthread_mutex_lock(&fcd_state_mutex)) != 0)
+		FCD_PT_ABRT("pthread_mutex_lock", ret);
+
+	if (rec->priv_size != size || rec->priv_time == 0) {
+		age = -1;
+	}
+	else {
+		age = fcd_lib_boottime() - rec->priv_time;
+		if (age < 0 || age > fcd_state_max_age)
+			age = -1;
+		else
+			memcpy(data, rec->priv, size);
+	}
+
+	rec->priv_size = 0;
+
+	if ((ret = pthread_mutex_unlock(&fcd_state_mutex)) != 0)
+		FCD_PT_ABRT("pthread_mutex_unlock", ret);
+
+	return age;
+}
+
+/*
+ * Returns the restored fan speed (or -1 if none was restored).
+ */
+int fcd_state_pwm_state(void)
+{
+	return fcd_state_pwm;
+}
+
+static void fcd_state_restore_mon(struct fcd_monitor *const mon,
+				  const struct fcd_state_rec *const rec,
+				  const time_t now)
+{
+	enum fcd_alert_msg *alerts[FCD_STATE_ALERT_COUNT];
+	unsigned i;
+
+	/* Restore monitor-specific blob, even if the display state is stale */
+
+	if (rec->priv_size <= FCD_STATE_PRIV_SIZE && rec->priv_time <= now)
+		fcd_state_recs[fcd_state_mon_index(mon)] = *rec;
+
+	if (rec->updated > now || now - rec->updated > fcd_state_max_age)
+		return;
+
+	/*
+	 * No other threads are running yet, so there's no need to lock the
+	 * monitor's mutex.
+	 */
+
+	memcpy(mon->buf, rec->buf, sizeof mon->buf);
+	mon->current_pwm_flags = rec->pwm_flags;
+	mon->new_pwm_flags = rec->pwm_flags;
+	mon->updated = rec->updated;
+
+	fcd_state_mon_alerts(mon, alerts);
+
+	for (i = 0; i < FCD_STATE_ALERT_COUNT; ++i) {
+		if (rec->alerts[i])
+			*alerts[i] = FCD_ALERT_SET_ACK;
+	}
+
+	fcd_alert_restore(mon);
+
+	FCD_INFO("Restored %s monitor state (%lds old)\n",
+		 mon->name, (long)(now - rec->updated));
+}
+
+/*
+ * Restores saved state.  Must be called before any monitor threads are
+ * started.
+ */
+void fcd_state_load(void)
+{
+	struct fcd_state_rec rec;
+	struct fcd_state_hdr hdr;
+	struct fcd_monitor **mon;
+	ssize_t ret;
+	uint32_t i;
+	time_t now;
+	int fd;
+
+	if (!fcd_state_monitor.enabled)
+		return;
+
+	fd = open(FCD_STATE_FILE, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		if (errno != ENOENT)
+			FCD_PERROR(FCD_STATE_FILE);
+		return;
+	}
+
+	ret = read(fd, &hdr, sizeof hdr);
+	if (ret != (ssize_t)sizeof hdr) {
+		if (ret == -1)
+			FCD_PERROR(FCD_STATE_FILE);
+		else
+			FCD_WARN("%s: Unexpected end of file\n",
+				 FCD_STATE_FILE);
+		goto close_fd;
+	}
+
+	if (memcmp(hdr.magic, FCD_STATE_MAGIC, sizeof hdr.magic) != 0 ||
+			hdr.version != FCD_STATE_VERSION ||
+			hdr.count > FCD_STATE_MAX_RECS) {
+		FCD_WARN("%s: Unknown format; ignoring\n", FCD_STATE_FILE);
+		goto close_fd;
+	}
+
+	now = fcd_lib_boottime();
+
+	/* Saved in a previous boot, or just too old? */
+	if (hdr.saved > now || now - hdr.saved > fcd_state_max_age) {
+		FCD_INFO("Not restoring stale state\n");
+		goto close_fd;
+	}
+
+	if (fcd_pwm_monitor.enabled && hdr.pwm_state >= 0 &&
+				hdr.pwm_state < FCD_PWM_STATE_ARRAY_SIZE) {
+		fcd_state_pwm = hdr.pwm_state;
+	}
+
+	for (i = 0; i < hdr.count; ++i) {
+
+		ret = read(fd, &rec, sizeof rec);
+		if (ret != (ssize_t)sizeof rec) {
+			if (ret == -1)
+				FCD_PERROR(FCD_STATE_FILE);
+			else
+				FCD_WARN("%s: Unexpected end of file\n",
+					 FCD_STATE_FILE);
+			break;
+		}
+
+		rec.name[sizeof rec.name - 1] = 0;
+
+		for (mon = fcd_monitors; *mon != NULL; ++mon) {
+
+			if ((*mon)->name == NULL || !(*mon)->enabled)
+				continue;
+
+			if (strcmp((*mon)->name, rec.name) == 0) {
+				fcd_state_restore_mon(*mon, &rec, now);
+				break;
+			}
+		}
+	}
+
+close_fd:
+	if (close(fd) == -1)
+		FCD_PERROR(FCD_STATE_FILE);
+}
+
+static int fcd_state_write(const int fd, const void *const buf,
+			   const size_t count)
+{
+	ssize_t ret;
+
+	ret = write(fd, buf, count);
+	if (ret == -1) {
+		FCD_PERROR(FCD_STATE_TMP_FILE);
+		return -1;
+	}
+
+	if ((size_t)ret != count) {
+		FCD_ERR("Incomplete write (%zd bytes)\n", ret);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Copies a monitor's state into a state record.  Called in the main thread,
+ * which "owns" the current PWM flags and alert ACKs.
+ */
+static void fcd_state_save_mon(struct fcd_monitor *const mon,
+			       struct fcd_state_rec *const rec)
+{
+	enum fcd_alert_msg *alerts[FCD_STATE_ALERT_COUNT];
+	unsigned i;
+	int ret;
+
+	memset(rec, 0, sizeof *rec);
+	strncpy(rec->name, mon->name, sizeof rec->name - 1);
+
+	if ((ret = pthread_mutex_lock(&mon->mutex)) != 0)
+		FCD_PT_ABRT("pthread_mutex_lock", ret);
+
+	fcd_state_mon_alerts(mon, alerts);
+
+	for (i = 0; i < FCD_STATE_ALERT_COUNT; ++i) {
+		rec->alerts[i] = (*alerts[i] == FCD_ALERT_SET_ACK ||
+					*alerts[i] == FCD_ALERT_CLR_REQ);
+	}
+
+	memcpy(rec->buf, mon->buf, sizeof rec->buf);
+	rec->pwm_flags = mon->current_pwm_flags;
+	rec->updated = mon->updated;
+
+	if ((ret = pthread_mutex_unlock(&mon->mutex)) != 0)
+		FCD_PT_ABRT("pthread_mutex_unlock", ret);
+
+	if ((ret = pthread_mutex_lock(&fcd_state_mutex)) != 0)
+		FCD_PT_ABRT("pthread_mutex_lock", ret);
+
+	i = fcd_state_mon_index(mon);
+	rec->priv_size = fcd_state_recs[i].priv_size;
+	rec->priv_time = fcd_state_recs[i].priv_time;
+	memcpy(rec->priv, fcd_state_recs[i].priv, rec->priv_size);
+
+	if ((ret = pthread_mutex_unlock(&fcd_state_mutex)) != 0)
+		FCD_PT_ABRT("pthread_mutex_unlock", ret);
+}
+
+/*
+ * Saves the current state.  Called periodically by the main thread (and when
+ * exiting).  State is written to a temporary file, which is then renamed, so
+ * a crash never leaves a partial state file behind.
+ */
+void fcd_state_save(void)
+{
+	struct fcd_state_rec rec;
+	struct fcd_state_hdr hdr;
+	struct fcd_monitor **mon;
+	int fd;
+
+	if (!fcd_state_monitor.enabled)
+		return;
+
+	if (mkdir(FCD_STATE_DIR, 0755) == -1 && errno != EEXIST) {
+		FCD_PERROR(FCD_STATE_DIR);
+		return;
+	}
+
+	fd = open(FCD_STATE_TMP_FILE, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+		  0644);
+	if (fd == -1) {
+		FCD_PERROR(FCD_STATE_TMP_FILE);
+		return;
+	}
+
+	memset(&hdr, 0, sizeof hdr);
+	memcpy(hdr.magic, FCD_STATE_MAGIC, sizeof hdr.magic);
+	hdr.version = FCD_STATE_VERSION;
+	hdr.pwm_state = fcd_pwm_monitor.enabled ? (int32_t)fcd_pwm_state() : -1;
+	hdr.saved = fcd_lib_boottime();
+
+	for (mon = fcd_monitors; *mon != NULL; ++mon) {
+		if ((*mon)->name != NULL && (*mon)->enabled)
+			++hdr.count;
+	}
+
+	if (fcd_state_write(fd, &hdr, sizeof hdr) == -1)
+		goto close_fd;
+
+	for (mon = fcd_monitors; *mon != NULL; ++mon) {
+
+		if ((*mon)->name == NULL || !(*mon)->enabled)
+			continue;
+
+		fcd_state_save_mon(*mon, &rec);
+
+		if (fcd_state_write(fd, &rec, sizeof rec) == -1)
+			goto close_fd;
+	}
+
+	if (close(fd) == -1) {
+		FCD_PERROR(FCD_STATE_TMP_FILE);
+		return;
+	}
+
+	if (rename(FCD_STATE_TMP_FILE, FCD_STATE_FILE) == -1)
+		FCD_PERROR(FCD_STATE_FILE);
+
+	return;
+
+close_fd:
+	if (close(fd) == -1)
+		FCD_PERROR(FCD_STATE_TMP_FILE);
+}
+
+static void fcd_state_dump_cfg(void)
+{
+	FCD_DUMP("\tmaximum age: %d seconds\n", fcd_state_max_age);
+}
+
+struct fcd_monitor fcd_state_monitor = {
+	.mutex			= PTHREAD_MUTEX_INITIALIZER,
+	.name			= "warm restart",
+	.cfg_dump_fn		= fcd_state_dump_cfg,
+	.enabled		= 1,
+	.silent			= 1,
+	.enabled_opt_name	= "enable_warm_restart",
+	.freecusd_opts		= fcd_state_opts,
+};
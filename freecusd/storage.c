@@ -0,0 +1,907 @@
+/*
+ * Copyright 2026 Ian Pilcher <arequipeno@gmail.com>
+ *
+ * This program is free software.  You can redistribute it or modify it under
+ * the terms of version 2 of the GNU General Public License (GPL), as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY -- without even the implied warranty of MERCHANTIBILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the text of the GPL for more details.
+ *
+ * Version 2 of the GNU General Public License is available at:
+ *
+ *   http://www.gnu.org/licenses/old-licenses/gpl-2.0.html
+ */
+
+/*
+ * Storage throughput monitor.  Samples /proc/diskstats (through a persistent
+ * file descriptor) and computes the throughput, IOPS, and utilization of each
+ * RAID disk and md array from the differences between samples.  A line in
+ * /proc/diskstats looks like this (see Documentation/iostats.txt in the
+ * kernel sources):
+ *
+ *    8  0 sda 2213 17 113486 1441 1154 912 43024 3019 0 2876 4460 ...
+ *
+ * The fields after the device name are reads completed, reads merged, sectors
+ * read, milliseconds spent reading, the same 4 fields for writes, I/Os in
+ * progress, milliseconds spent doing I/O, and weighted milliseconds spent
+ * doing I/O.  Newer kernels append discard and flush fields, which are
+ * ignored.
+ *
+ * The monitor also looks for slow disks.  The average latency of each RAID
+ * disk (milliseconds spent reading and writing divided by completed I/Os) is
+ * compared with the median latency of the other members of the same md
+ * array(s) -- taken from /proc/mdstat.  A disk that stays well above the
+ * median has its alert LED lit, since one slow member drags down the whole
+ * array.
+ *
+ * If freecusd is built with FCD_BPF (and the kernel supports it), the 99th
+ * percentile latency from the block I/O latency histograms (see bpf.c) is used
+ * instead of the average, which hides occasional very slow I/Os.
+ */
+
+#include "freecusd.h"
+
+#include <string.h>
+#include <fcntl.h>
+
+/* Max number of md arrays tracked */
+#define FCD_STORAGE_MAX_MDS	FCD_MDSTAT_MAX_ARRAYS
+
+/* Max size of a device name - e.g. "md127" (11 chars + terminating 0) */
+#define FCD_STORAGE_NAME_SIZE	12
+
+/* Seconds between samples */
+#define FCD_STORAGE_INTERVAL	30
+
+/* Size of the /proc/diskstats and /proc/mdstat buffers */
+#define FCD_STORAGE_BUF_SIZE	20000
+
+/* Min # of I/Os in a sample for a disk's latency to be meaningful */
+#define FCD_STORAGE_SLOW_MIN_IOS	30
+
+/* A disk's latency isn't considered slow if it is below this (ms) */
+#define FCD_STORAGE_SLOW_FLOOR		10
+
+/* Min # of array members with meaningful latencies needed for a median */
+#define FCD_STORAGE_SLOW_MIN_DEVS	3
+
+/* Cumulative counters from /proc/diskstats */
+struct fcd_storage_stat {
+	unsigned long long rd_ios;
+	unsigned long long rd_sectors;
+	unsigned long long rd_ticks;		/* ms */
+	unsigned long long wr_ios;
+	unsigned long long wr_sectors;
+	unsigned long long wr_ticks;		/* ms */
+	unsigned long long io_ticks;		/* ms */
+};
+
+struct fcd_storage_dev {
+	char name[FCD_STORAGE_NAME_SIZE];	/* empty if unused */
+	unsigned devnum;			/* (major << 20) | minor */
+	struct fcd_storage_stat stat;		/* last sample */
+	_Bool seen;				/* in current sample */
+	_Bool valid;				/* stat is from last pass */
+	unsigned rd_kbps;
+	unsigned wr_kbps;
+	unsigned iops;
+	unsigned util;				/* permille */
+	unsigned busy;				/* # of saturated samples */
+	unsigned latency;			/* us; 0 = too few I/Os */
+	unsigned slow;				/* # of outlier samples */
+#ifdef FCD_BPF
+	uint64_t hist[FCD_BPF_HIST_SLOTS];	/* last histogram read */
+	unsigned p50;				/* us; 0 = too few I/Os */
+	unsigned p99;
+	unsigned p999;
+#endif
+};
+
+/* RAID disks (indexed like fcd_conf_disks) and md arrays */
+static struct fcd_storage_dev fcd_storage_disks[FCD_MAX_DISK_COUNT];
+static struct fcd_storage_dev fcd_storage_mds[FCD_STORAGE_MAX_MDS];
+
+/* Warn if a disk's utilization (%) stays at or above this; 0 = never */
+static int fcd_storage_util_warn = 0;		/* storage_util_warn */
+
+/* ... for at least this many seconds */
+static int fcd_storage_util_time = 300;		/* storage_util_warn_time */
+
+/* A disk is slow if its latency is this many times its array's median ... */
+static int fcd_storage_slow_ratio = 3;		/* slow_disk_ratio */
+
+/* ... for at least this many seconds */
+static int fcd_storage_slow_time = 600;		/* slow_disk_time */
+
+/* /proc/mdstat, for array membership; fd is -1 if slow disk check disabled */
+static int fcd_storage_mdstat_fd = -1;
+static struct fcd_lib_buf fcd_storage_mdstat_buf =
+		FCD_LIB_BUF_INIT("/proc/mdstat", FCD_STORAGE_BUF_SIZE);
+static struct fcd_mdstat fcd_storage_mdstat;
+
+#ifdef FCD_BPF
+/* Are the BPF latency histograms available? */
+static _Bool fcd_storage_bpf;
+#endif
+
+static int fcd_storage_cb();
+
+static const cip_opt_info fcd_storage_opts[] = {
+	{
+		.name			= "storage_util_warn",
+		.type			= CIP_OPT_TYPE_INT,
+		.post_parse_fn		= fcd_storage_cb,
+		.post_parse_data	= &fcd_storage_util_warn,
+	},
+	{
+		.name			= "storage_util_warn_time",
+		.type			= CIP_OPT_TYPE_INT,
+		.post_parse_fn		= fcd_storage_cb,
+		.post_parse_data	= &fcd_storage_util_time,
+	},
+	{
+		.name			= "slow_disk_ratio",
+		.type			= CIP_OPT_TYPE_INT,
+		.post_parse_fn		= fcd_storage_cb,
+		.post_parse_data	= &fcd_storage_slow_ratio,
+	},
+	{
+		.name			= "slow_disk_time",
+		.type			= CIP_OPT_TYPE_INT,
+		.post_parse_fn		= fcd_storage_cb,
+		.post_parse_data	= &fcd_storage_slow_time,
+	},
+	{	.name			= NULL		}
+};
+
+/*
+ * Configuration callback for the utilization & slow disk thresholds and times
+ */
+static int fcd_storage_cb(cip_err_ctx *ctx, const cip_ini_value *value,
+			  const cip_ini_sect *sect __attribute__((unused)),
+			  const cip_ini_file *file __attribute__((unused)),
+			  void *post_parse_data)
+{
+	int i;
+
+	memcpy(&i, value->value, sizeof i);
+
+	if (post_parse_data == &fcd_storage_util_warn && (i < 0 || i > 100)) {
+		cip_err(ctx, "Invalid utilization threshold: %d", i);
+		return -1;
+	}
+
+	if (post_parse_data == &fcd_storage_slow_ratio &&
+			(i < 0 || i == 1 || i > 100)) {
+		cip_err(ctx, "Invalid slow disk ratio: %d", i);
+		return -1;
+	}
+
+	if ((post_parse_data == &fcd_storage_util_time ||
+			post_parse_data == &fcd_storage_slow_time) &&
+			(i < FCD_STORAGE_INTERVAL || i > 86400)) {
+		cip_err(ctx, "Invalid warning time: %d", i);
+		return -1;
+	}
+
+	*(int *)post_parse_data = i;
+
+	return 0;
+}
+
+/* Returns the current CLOCK_BOOTTIME in milliseconds */
+static long long fcd_storage_now_ms(void)
+{
+	struct timespec now;
+
+	if (clock_gettime(CLOCK_BOOTTIME, &now) == -1)
+		FCD_PABORT("clock_gettime");
+
+	return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/*
+ * Returns the record for a device, or NULL if it isn't a RAID disk or an md
+ * array (or there are too many md arrays).  md partitions (e.g. md126p1) are
+ * ignored; their I/O is already counted in the array's totals.
+ */
+static struct fcd_storage_dev *fcd_storage_find(const char *const name)
+{
+	static _Bool overflow_warned = 0;
+	struct fcd_storage_dev *dev, *unused;
+	const char *c;
+	unsigned i;
+	int disk;
+
+	if (name[0] == 's' && name[1] == 'd' && name[2] != 0 && name[3] == 0) {
+
+		disk = fcd_lib_disk_index(name[2]);
+		if (disk == -1)
+			return NULL;
+
+		dev = &fcd_storage_disks[disk];
+		if (dev->name[0] == 0)
+			strcpy(dev->name, name);
+
+		return dev;
+	}
+
+	if (name[0] != 'm' || name[1] != 'd' || name[2] == 0 ||
+			strlen(name) >= FCD_STORAGE_NAME_SIZE)
+		return NULL;
+
+	for (c = name + 2; *c != 0; ++c) {
+		if (*c < '0' || *c > '9')
+			return NULL;
+	}
+
+	unused = NULL;
+
+	for (i = 0; i < FCD_STORAGE_MAX_MDS; ++i) {
+
+		dev = &fcd_storage_mds[i];
+
+		if (dev->name[0] == 0) {
+			if (unused == NULL)
+				unused = dev;
+		}
+		else if (strcmp(dev->name, name) == 0) {
+			return dev;
+		}
+	}
+
+	if (unused != NULL) {
+		strcpy(unused->name, name);
+		unused->valid = 0;
+	}
+	else if (!overflow_warned) {
+		FCD_WARN("Too many md arrays; %s not included in totals\n",
+			 name);
+		overflow_warned = 1;
+	}
+
+	return unused;
+}
+
+/*
+ * Updates a device's rates from a new sample.  elapsed is the time since the
+ * last sample (ms).
+ */
+static void fcd_storage_update(struct fcd_storage_dev *const dev,
+			       const struct fcd_storage_stat *const stat,
+			       const long long elapsed)
+{
+	const struct fcd_storage_stat *const old = &dev->stat;
+	unsigned long long ios, io_ticks, ticks;
+
+	/* Counters go backwards if the device has been re-created */
+	if (!dev->valid || elapsed <= 0 || stat->rd_ios < old->rd_ios ||
+			stat->wr_ios < old->wr_ios ||
+			stat->io_ticks < old->io_ticks ||
+			stat->rd_sectors < old->rd_sectors ||
+			stat->wr_sectors < old->wr_sectors) {
+		dev->rd_kbps = 0;
+		dev->wr_kbps = 0;
+		dev->iops = 0;
+		dev->util = 0;
+		dev->latency = 0;
+	}
+	else {
+		/* Sectors are always 512 bytes in /proc/diskstats */
+		dev->rd_kbps = (stat->rd_sectors - old->rd_sectors) * 500 /
+								elapsed;
+		dev->wr_kbps = (stat->wr_sectors - old->wr_sectors) * 500 /
+								elapsed;
+
+		ios = stat->rd_ios - old->rd_ios + stat->wr_ios - old->wr_ios;
+		dev->iops = ios * 1000 / elapsed;
+
+		io_ticks = stat->io_ticks - old->io_ticks;
+		dev->util = (io_ticks >= (unsigned long long)elapsed) ?
+					1000 : io_ticks * 1000 / elapsed;
+
+		/* Ticks can lag I/O counts slightly; don't underflow */
+		ticks = stat->rd_ticks + stat->wr_ticks;
+		if (ios < FCD_STORAGE_SLOW_MIN_IOS ||
+				ticks < old->rd_ticks + old->wr_ticks) {
+			dev->latency = 0;
+		}
+		else {
+			ticks -= old->rd_ticks + old->wr_ticks;
+			dev->latency = ticks * 1000 / ios;
+			if (dev->latency == 0)
+				dev->latency = 1;
+		}
+	}
+
+	dev->stat = *stat;
+	dev->valid = 1;
+}
+
+/*
+ * Parses the contents of /proc/diskstats and updates every RAID disk and md
+ * array.  Returns 0 on success, -1 on error.
+ */
+static int fcd_storage_parse(const char *c, const long long elapsed)
+{
+	struct fcd_storage_stat stat;
+	struct fcd_storage_dev *dev;
+	unsigned i, major, minor;
+	char name[32];
+
+	for (i = 0; i < FCD_MAX_DISK_COUNT; ++i)
+		fcd_storage_disks[i].seen = 0;
+	for (i = 0; i < FCD_STORAGE_MAX_MDS; ++i)
+		fcd_storage_mds[i].seen = 0;
+
+	for (; *c != 0; c = (*c == '\n') ? c + 1 : c) {
+
+		if (sscanf(c, "%u %u %31s %llu %*u %llu %llu %llu %*u %llu "
+				"%llu %*u %llu", &major, &minor, name,
+				&stat.rd_ios, &stat.rd_sectors, &stat.rd_ticks,
+				&stat.wr_ios, &stat.wr_sectors, &stat.wr_ticks,
+				&stat.io_ticks) != 10) {
+			FCD_WARN("Failed to parse /proc/diskstats\n");
+			return -1;
+		}
+
+		c = strchr(c, '\n');
+		if (c == NULL)
+			c = "";
+
+		dev = fcd_storage_find(name);
+		if (dev == NULL)
+			continue;
+
+		fcd_storage_update(dev, &stat, elapsed);
+		dev->devnum = (major << 20) | minor;
+		dev->seen = 1;
+	}
+
+	/* Forget arrays that have been stopped */
+	for (i = 0; i < FCD_STORAGE_MAX_MDS; ++i) {
+
+		dev = &fcd_storage_mds[i];
+
+		if (dev->name[0] != 0 && !dev->seen)
+			memset(dev, 0, sizeof *dev);
+	}
+
+	for (i = 0; i < FCD_MAX_DISK_COUNT; ++i) {
+
+		dev = &fcd_storage_disks[i];
+
+		if (!dev->seen) {
+			dev->valid = 0;
+			dev->util = 0;
+			dev->busy = 0;
+			dev->latency = 0;
+		}
+	}
+
+	return 0;
+}
+
+#ifdef FCD_BPF
+
+/*
+ * Returns the upper bound (us) of the histogram slot that holds a percentile
+ * (given in permille).  Slot n holds latencies of 2^n to 2^(n+1) - 1
+ * microseconds (slot 0 also holds 0).
+ */
+static unsigned fcd_storage_pctl(const uint64_t *const delta,
+				 const uint64_t total, const unsigned permille)
+{
+	uint64_t rank, sum;
+	unsigned i;
+
+	rank = (total * permille + 999) / 1000;
+
+	for (sum = 0, i = 0; i < FCD_BPF_HIST_SLOTS - 1; ++i) {
+		sum += delta[i];
+		if (sum >= rank)
+			break;
+	}
+
+	return UINT32_MAX >> (FCD_BPF_HIST_SLOTS - 1 - i);
+}
+
+/*
+ * Reads a disk's latency histogram and computes its percentiles for the last
+ * sample period.  Returns 0 on success, -1 on error.
+ */
+static int fcd_storage_hist(struct fcd_storage_dev *const disk)
+{
+	uint64_t counts[FCD_BPF_HIST_SLOTS], delta[FCD_BPF_HIST_SLOTS], total;
+	unsigned i;
+	int ret;
+
+	ret = fcd_bpf_read(disk->devnum, counts);
+	if (ret == -1)
+		return -1;
+	if (ret == 1)
+		memset(counts, 0, sizeof counts);
+
+	for (total = 0, i = 0; i < FCD_BPF_HIST_SLOTS; ++i) {
+		delta[i] = (counts[i] >= disk->hist[i]) ?
+						counts[i] - disk->hist[i] : 0;
+		total += delta[i];
+	}
+
+	memcpy(disk->hist, counts, sizeof disk->hist);
+
+	if (total < FCD_STORAGE_SLOW_MIN_IOS) {
+		disk->p50 = disk->p99 = disk->p999 = 0;
+	}
+	else {
+		disk->p50 = fcd_storage_pctl(delta, total, 500);
+		disk->p99 = fcd_storage_pctl(delta, total, 990);
+		disk->p999 = fcd_storage_pctl(delta, total, 999);
+	}
+
+	return 0;
+}
+
+#endif	/* FCD_BPF */
+
+/* Latency used for the slow disk check -- 99th percentile, if available */
+static unsigned fcd_storage_latency(const struct fcd_storage_dev *const disk)
+{
+#ifdef FCD_BPF
+	if (fcd_storage_bpf)
+		return disk->p99;
+#endif
+	return disk->latency;
+}
+
+/* Returns the median of a (small) list of latencies; sorts the list */
+static unsigned fcd_storage_median(unsigned *const list, const unsigned count)
+{
+	unsigned i, j, tmp;
+
+	for (i = 1; i < count; ++i) {
+		for (j = i; j > 0 && list[j - 1] > list[j]; --j) {
+			tmp = list[j];
+			list[j] = list[j - 1];
+			list[j - 1] = tmp;
+		}
+	}
+
+	if (count % 2 == 1)
+		return list[count / 2];
+
+	return (list[count / 2 - 1] + list[count / 2]) / 2;
+}
+
+/*
+ * Checks each md array's members for a latency outlier.  A disk's outlier
+ * count is incremented if it is slow relative to any array of which it is a
+ * member, and reset if it is a member of an array against which it can be
+ * compared and isn't slow.  (If it can't be compared, its count is left as
+ * is.)  Sets disks[] for disks that have been slow for too long, and returns
+ * the number of such disks.
+ */
+static int fcd_storage_slow(const char *const mdstat, int *const disks)
+{
+	unsigned latencies[FCD_MAX_DISK_COUNT], median, i, j, count;
+	_Bool member[FCD_MAX_DISK_COUNT], outlier[FCD_MAX_DISK_COUNT];
+	_Bool compared[FCD_MAX_DISK_COUNT];
+	const struct fcd_mdstat_array *array;
+	const struct fcd_mdstat_dev *dev;
+	struct fcd_storage_dev *disk;
+	unsigned latency;
+	int d, slow;
+
+	memset(outlier, 0, sizeof outlier);
+	memset(compared, 0, sizeof compared);
+
+	if (fcd_mdstat_parse(&fcd_storage_mdstat, mdstat) == -1)
+		return -1;
+
+	for (i = 0; i < fcd_storage_mdstat.array_count; ++i) {
+
+		array = &fcd_storage_mdstat.arrays[i];
+		dev = &fcd_storage_mdstat.devs[array->first_dev];
+		memset(member, 0, sizeof member);
+		count = 0;
+
+		/* Spares & failed devices don't do the array's I/O */
+		for (j = 0; j < array->dev_count; ++j, ++dev) {
+
+			if (dev->flag == 'S' || dev->flag == 'F' ||
+				    dev->name_len < 3 || dev->name[0] != 's')
+				continue;
+
+			d = fcd_lib_disk_index(dev->name[2]);
+			if (d == -1 || member[d] ||
+				fcd_storage_latency(&fcd_storage_disks[d]) == 0)
+				continue;
+
+			member[d] = 1;
+			latencies[count++] =
+				fcd_storage_latency(&fcd_storage_disks[d]);
+		}
+
+		if (count < FCD_STORAGE_SLOW_MIN_DEVS)
+			continue;
+
+		median = fcd_storage_median(latencies, count);
+
+		for (d = 0; d < (int)fcd_conf_disk_count; ++d) {
+
+			if (!member[d])
+				continue;
+
+			disk = &fcd_storage_disks[d];
+			latency = fcd_storage_latency(disk);
+			compared[d] = 1;
+
+			if (latency < FCD_STORAGE_SLOW_FLOOR * 1000 ||
+				    latency < median *
+					(unsigned)fcd_storage_slow_ratio)
+				continue;
+
+			FCD_DEBUG("%s: latency %u us; %.*s median %u us\n",
+				  disk->name, latency,
+				  (int)array->name_len, array->name, median);
+			outlier[d] = 1;
+		}
+	}
+
+	for (slow = 0, d = 0; d < (int)fcd_conf_disk_count; ++d) {
+
+		disk = &fcd_storage_disks[d];
+
+		if (outlier[d]) {
+			++disk->slow;
+		}
+		else if (compared[d]) {
+			if (disk->slow * FCD_STORAGE_INTERVAL >=
+					(unsigned)fcd_storage_slow_time) {
+				FCD_INFO("%s: latency back to normal\n",
+					 disk->name);
+			}
+			disk->slow = 0;
+		}
+
+		if (disk->slow * FCD_STORAGE_INTERVAL <
+				(unsigned)fcd_storage_slow_time)
+			continue;
+
+		if (disk->slow * FCD_STORAGE_INTERVAL <
+				(unsigned)fcd_storage_slow_time +
+							FCD_STORAGE_INTERVAL) {
+			latency = fcd_storage_latency(disk);
+			FCD_WARN("%s: latency %u.%03u ms is %d+ times the "
+				 "median of its array(s)\n", disk->name,
+				 latency / 1000, latency % 1000,
+				 fcd_storage_slow_ratio);
+		}
+
+		++disks[d];
+		++slow;
+	}
+
+	return slow;
+}
+
+/*
+ * Formats the LCD display -- total IOPS and throughput of the md arrays (or of
+ * the RAID disks, if there are no arrays) and the utilization of the busiest
+ * disk.  Returns the number of disks that have been saturated for too long.
+ */
+static int fcd_storage_format(char *const upper, char *const lower)
+{
+	unsigned i, count, iops, rd_kbps, wr_kbps, util;
+	const struct fcd_storage_dev *devs, *dev;
+	struct fcd_storage_dev *disk;
+	int saturated;
+
+	iops = rd_kbps = wr_kbps = util = 0;
+	saturated = 0;
+
+	for (i = 0; i < fcd_conf_disk_count; ++i) {
+
+		disk = &fcd_storage_disks[i];
+
+		if (disk->util > util)
+			util = disk->util;
+
+		if (fcd_storage_util_warn == 0 ||
+			    disk->util < (unsigned)fcd_storage_util_warn * 10) {
+			disk->busy = 0;
+			continue;
+		}
+
+		if (++disk->busy * FCD_STORAGE_INTERVAL >=
+					(unsigned)fcd_storage_util_time) {
+			FCD_DEBUG("%s: saturated for %u seconds\n",
+				  disk->name,
+				  disk->busy * FCD_STORAGE_INTERVAL);
+			++saturated;
+		}
+	}
+
+	for (i = 0; i < FCD_STORAGE_MAX_MDS; ++i) {
+		if (fcd_storage_mds[i].valid)
+			break;
+	}
+
+	if (i < FCD_STORAGE_MAX_MDS) {
+		devs = fcd_storage_mds;
+		count = FCD_STORAGE_MAX_MDS;
+	}
+	else {
+		devs = fcd_storage_disks;
+		count = fcd_conf_disk_count;
+	}
+
+	for (i = 0; i < count; ++i) {
+
+		dev = &devs[i];
+
+		if (!dev->valid)
+			continue;
+
+		iops += dev->iops;
+		rd_kbps += dev->rd_kbps;
+		wr_kbps += dev->wr_kbps;
+	}
+
+	rd_kbps /= 1000;
+	wr_kbps /= 1000;
+
+	memset(upper, ' ', 20);
+	memset(lower, ' ', 21);
+
+	if (fcd_lib_snprintf(upper, 21, "DISK I/O %6u IOPS",
+			     iops > 999999 ? 999999 : iops) < 0)
+		return -1;
+
+	/* "R123 W 45 MB/s 100%" */
+	if (fcd_lib_snprintf(lower, 21, "R%3u W%3u MB/s %3u%%",
+			     rd_kbps > 999 ? 999 : rd_kbps,
+			     wr_kbps > 999 ? 999 : wr_kbps,
+			     (util + 5) / 10) < 0)
+		return -1;
+
+	return saturated;
+}
+
+/*
+ * Reads the entire contents of a /proc file into buf.  Returns 0 on success (-1
+ * = error, -3 = exit signal received, -4 = buffer size exceeded).
+ */
+static int fcd_storage_read(const int fd, struct fcd_lib_buf *const buf)
+{
+	struct timespec ts;
+	ssize_t ret;
+
+	if (lseek(fd, 0, SEEK_SET) == -1) {
+		FCD_PERROR(buf->name);
+		return -1;
+	}
+
+	ts.tv_sec = 0;
+	ts.tv_nsec = 0;
+
+	ret = fcd_lib_read_all(fd, buf, &ts);
+
+	return (ret < 0) ? ret : 0;
+}
+
+static void fcd_storage_close(const int fd, struct fcd_lib_buf *const buf)
+{
+	if (close(fd) == -1)
+		FCD_PERROR("close");
+
+	fcd_lib_buf_free(buf);
+
+	if (fcd_storage_mdstat_fd != -1 && close(fcd_storage_mdstat_fd) == -1)
+		FCD_PERROR("close");
+
+	fcd_storage_mdstat_fd = -1;
+	fcd_lib_buf_free(&fcd_storage_mdstat_buf);
+
+#ifdef FCD_BPF
+	if (fcd_storage_bpf)
+		fcd_bpf_fini();
+	fcd_storage_bpf = 0;
+#endif
+}
+
+__attribute__((noreturn))
+static void fcd_storage_disable(struct fcd_monitor *const mon, const int fd,
+				struct fcd_lib_buf *const buf)
+{
+	fcd_storage_close(fd, buf);
+	fcd_lib_fail_and_exit(mon);
+}
+
+/*
+ * Opens /proc/mdstat for the slow disk check.  Failure isn't fatal; the check
+ * is just skipped.
+ */
+static void fcd_storage_open_mdstat(void)
+{
+	static const char path[] = "/proc/mdstat";
+
+	if (fcd_storage_slow_ratio == 0)
+		return;
+
+	fcd_storage_mdstat_fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fcd_storage_mdstat_fd == -1) {
+		FCD_PERROR(path);
+		FCD_WARN("Slow disk detection disabled\n");
+		return;
+	}
+
+	if (fcd_lib_buf_prealloc(&fcd_storage_mdstat_buf) == -1) {
+		if (close(fcd_storage_mdstat_fd) == -1)
+			FCD_PERROR("close");
+		fcd_storage_mdstat_fd = -1;
+	}
+}
+
+#ifdef FCD_BPF
+
+/* Failure isn't fatal; the average latencies are used instead */
+static void fcd_storage_bpf_init(void)
+{
+	if (fcd_storage_slow_ratio == 0)
+		return;
+
+	fcd_storage_bpf = (fcd_bpf_init() == 0);
+	if (!fcd_storage_bpf)
+		FCD_INFO("Latency histograms not available; using averages\n");
+}
+
+/* Updates the percentiles of every RAID disk */
+static void fcd_storage_bpf_update(void)
+{
+	struct fcd_storage_dev *disk;
+	unsigned i;
+
+	if (!fcd_storage_bpf)
+		return;
+
+	for (i = 0; i < fcd_conf_disk_count; ++i) {
+
+		disk = &fcd_storage_disks[i];
+
+		if (!disk->valid)
+			continue;
+
+		if (fcd_storage_hist(disk) == -1) {
+			FCD_WARN("Latency histograms disabled\n");
+			fcd_bpf_fini();
+			fcd_storage_bpf = 0;
+			return;
+		}
+
+		FCD_DEBUG("%s: latency p50 %u us, p99 %u us, p99.9 %u us\n",
+			  disk->name, disk->p50, disk->p99, disk->p999);
+	}
+}
+
+#endif	/* FCD_BPF */
+
+__attribute__((noreturn))
+static void *fcd_storage_fn(void *arg)
+{
+	static const char path[] = "/proc/diskstats";
+	struct fcd_lib_buf buf = FCD_LIB_BUF_INIT(path, FCD_STORAGE_BUF_SIZE);
+	int fd, ret, warn, slow, disks[FCD_MAX_DISK_COUNT];
+	struct fcd_monitor *mon = arg;
+	char upper[21], lower[21];
+	long long now, last;
+	unsigned i;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		FCD_PERROR(path);
+		fcd_lib_fail_and_exit(mon);
+	}
+
+	if (fcd_lib_buf_prealloc(&buf) == -1)
+		fcd_storage_disable(mon, fd, &buf);
+
+	fcd_storage_open_mdstat();
+#ifdef FCD_BPF
+	fcd_storage_bpf_init();
+#endif
+
+	last = 0;
+
+	do {
+		ret = fcd_storage_read(fd, &buf);
+		if (ret == -3)
+			break;
+		if (ret < 0)
+			fcd_storage_disable(mon, fd, &buf);
+
+		now = fcd_storage_now_ms();
+
+		if (fcd_storage_parse(buf.data, now - last) == -1)
+			fcd_storage_disable(mon, fd, &buf);
+
+		last = now;
+
+		for (i = 0; i < fcd_conf_disk_count; ++i) {
+
+			if (!fcd_storage_disks[i].valid)
+				continue;
+
+			FCD_DEBUG("%s: %u kB/s read, %u kB/s write, %u IOPS, "
+				  "%u.%u%% util, %u us latency\n",
+				  fcd_storage_disks[i].name,
+				  fcd_storage_disks[i].rd_kbps,
+				  fcd_storage_disks[i].wr_kbps,
+				  fcd_storage_disks[i].iops,
+				  fcd_storage_disks[i].util / 10,
+				  fcd_storage_disks[i].util % 10,
+				  fcd_storage_disks[i].latency);
+		}
+
+#ifdef FCD_BPF
+		fcd_storage_bpf_update();
+#endif
+
+		memset(disks, 0, sizeof disks);
+		slow = 0;
+
+		if (fcd_storage_mdstat_fd != -1) {
+
+			ret = fcd_storage_read(fcd_storage_mdstat_fd,
+					       &fcd_storage_mdstat_buf);
+			if (ret == -3)
+				break;
+			if (ret < 0)
+				fcd_storage_disable(mon, fd, &buf);
+
+			slow = fcd_storage_slow(fcd_storage_mdstat_buf.data,
+						disks);
+			if (slow < 0)
+				fcd_storage_disable(mon, fd, &buf);
+		}
+
+		warn = fcd_storage_format(upper, lower);
+		if (warn < 0)
+			fcd_storage_disable(mon, fd, &buf);
+
+		fcd_lib_set_mon_status2(mon, upper, lower, warn + slow, 0,
+					disks, 0);
+
+		ret = fcd_lib_monitor_sleep(FCD_STORAGE_INTERVAL);
+		if (ret == -1)
+			fcd_storage_disable(mon, fd, &buf);
+
+	} while (ret == 0);
+
+	fcd_storage_close(fd, &buf);
+	pthread_exit(NULL);
+}
+
+static void fcd_storage_dump_cfg(void)
+{
+	FCD_DUMP("\tutilization warning: %d%%\n", fcd_storage_util_warn);
+	FCD_DUMP("\tutilization warning time: %d seconds\n",
+		 fcd_storage_util_time);
+	FCD_DUMP("\tslow disk ratio: %d\n", fcd_storage_slow_ratio);
+	FCD_DUMP("\tslow disk time: %d seconds\n", fcd_storage_slow_time);
+}
+
+struct fcd_monitor fcd_storage_monitor = {
+	.mutex			= PTHREAD_MUTEX_INITIALIZER,
+	.name			= "storage I/O",
+	.monitor_fn		= fcd_storage_fn,
+	.cfg_dump_fn		= fcd_storage_dump_cfg,
+	.buf			= "....."
+				  "DISK I/O            "
+				  "                    ",
+	.enabled		= true,
+	.enabled_opt_name	= "enable_storage_monitor",
+	.freecusd_opts		= fcd_storage_opts,
+};
@@ -1,5 +1,5 @@
 /*
- * Copyright 2013-2014, 2020 Ian Pilcher <arequipeno@gmail.com>
+ * Copyright 2013-2014, 2020, 2026 Ian Pilcher <arequipeno@gmail.com>
  *
  * This program is free software.  You can redistribute it or modify it under
  * the terms of version 2 of the GNU General Public License (GPL), as published
@@ -17,11 +17,15 @@
 #include "freecusd.h"
 
 #include <string.h>
+#include <fcntl.h>
 
 /* Alert thresholds */
 static int fcd_sysfan_warn = 1200;	/* sysfan_rpm_warn */
 static int fcd_sysfan_fail = 500;	/* sysfan_rpm_crit */
 
+/* it87 fan input (fanN_input) */
+static int fcd_sysfan_channel = 3;	/* sysfan_rpm_channel */
+
 static int fcd_sysfan_rpm_cb();
 
 static const cip_opt_info fcd_sysfan_opts[] = {
@@ -37,11 +41,15 @@ static const cip_opt_info fcd_sysfan_opts[] = {
 		.post_parse_fn		= fcd_sysfan_rpm_cb,
 		.post_parse_data	= &fcd_sysfan_fail,
 	},
+	{
+		.name			= "sysfan_rpm_channel",
+		.type			= CIP_OPT_TYPE_INT,
+		.post_parse_fn		= fcd_hwmon_channel_cb,
+		.post_parse_data	= &fcd_sysfan_channel,
+	},
 	{	.name			= NULL		}
 };
 
-static const char fcd_sysfan_input[] = "/run/n5550/it87/fan3_input";
-
 /*
  * Configuration callback for alert thresholds
  */
@@ -67,10 +75,11 @@ static int fcd_sysfan_rpm_cb(cip_err_ctx *ctx, const cip_ini_value *value,
 }
 
 __attribute__((noreturn))
-static void fcd_sysfan_close_and_disable(FILE *fp, struct fcd_monitor *mon)
+static void fcd_sysfan_close_and_disable(const int fd, const char *const name,
+					 struct fcd_monitor *const mon)
 {
-	if (fclose(fp) != 0)
-		FCD_PERROR("fclose");
+	if (close(fd) != 0)
+		FCD_PERROR(name);
 	fcd_lib_fail_and_exit(mon);
 
 }
@@ -79,52 +88,56 @@ __attribute__((noreturn))
 static void *fcd_sysfan_fn(void *arg)
 {
 	struct fcd_monitor *mon = arg;
-	int warn, fail, rpm, ret;
-	char buf[21];
-	FILE *fp;
+	char buf[21], name[FCD_HWMON_ATTR_SIZE];
+	int warn, fail, rpm, raw, ret, fd, samples, period;
+	struct fcd_filter filter;
 
-	fp = fopen(fcd_sysfan_input, "re");
-	if (fp == NULL) {
-		FCD_PERROR(fcd_sysfan_input);
+	sprintf(name, "fan%d_input", fcd_sysfan_channel);
+
+	fd = fcd_hwmon_open(FCD_HWMON_IT87, name, O_RDONLY);
+	if (fd == -1)
 		fcd_lib_fail_and_exit(mon);
-	}
 
-	if (setvbuf(fp, NULL, _IONBF, 0) != 0) {
-		FCD_PERROR("setvbuf");
-		fcd_sysfan_close_and_disable(fp, mon);
-	}
+	fcd_lib_filter_init(&filter);
+	period = 30 / fcd_conf_sample_interval;
+	samples = 0;
 
 	do {
-		rewind(fp);
 		memset(buf, ' ', sizeof buf);
 
-		ret = fscanf(fp, "%d", &rpm);
-		if (ret == EOF) {
-			FCD_PERROR("fscanf");
-			fcd_sysfan_close_and_disable(fp, mon);
-		}
-		else if (ret != 1) {
-			FCD_WARN("Failed to parse contents of %s\n",
-				 fcd_sysfan_input);
-			fcd_sysfan_close_and_disable(fp, mon);
+		if (fcd_lib_read_int(fd, name, &raw) == -1)
+			fcd_sysfan_close_and_disable(fd, name, mon);
+
+		rpm = fcd_lib_filter_add(&filter, raw);
+
+		/* A fan that's slowing down shows up as a trough */
+		if (++samples == period) {
+			if (filter.trough <= fcd_sysfan_warn &&
+						rpm > fcd_sysfan_warn) {
+				FCD_INFO("Minimum system fan speed %d RPM "
+					 "(filtered %d RPM)\n",
+					 filter.trough, rpm);
+			}
+			fcd_lib_filter_reset_peaks(&filter);
+			samples = 0;
 		}
 
 		fail = (rpm <= fcd_sysfan_fail);
 		warn = fail ? 0 : (rpm <= fcd_sysfan_warn);
 
 		if (fcd_lib_snprintf(buf, sizeof buf, "%'d RPM", rpm) < 0)
-			fcd_sysfan_close_and_disable(fp, mon);
+			fcd_sysfan_close_and_disable(fd, name, mon);
 
 		fcd_lib_set_mon_status(mon, buf, warn, fail, NULL, 0);
 
-		ret = fcd_lib_monitor_sleep(30);
+		ret = fcd_lib_monitor_sleep(fcd_conf_sample_interval);
 		if (ret == -1)
-			fcd_sysfan_close_and_disable(fp, mon);
+			fcd_sysfan_close_and_disable(fd, name, mon);
 
 	} while (ret == 0);
 
-	if (fclose(fp) != 0)
-		FCD_PERROR("fclose");
+	if (close(fd) != 0)
+		FCD_PERROR(name);
 
 	pthread_exit(NULL);
 }
@@ -133,6 +146,7 @@ static void fcd_sysfan_dump_cfg(void)
 {
 	FCD_DUMP("\twarning: %d RPM\n", fcd_sysfan_warn);
 	FCD_DUMP("\tcritical: %d RPM\n", fcd_sysfan_fail);
+	FCD_DUMP("\tit87 channel: %d\n", fcd_sysfan_channel);
 }
 
 struct fcd_monitor fcd_sysfan_monitor = {
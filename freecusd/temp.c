@@ -1,5 +1,5 @@
 /*
- * Copyright 2013-2014, 2016, 2020 Ian Pilcher <arequipeno@gmail.com>
+ * Copyright 2013-2014, 2016, 2020, 2026 Ian Pilcher <arequipeno@gmail.com>
  *
  * This program is free software.  You can redistribute it or modify it under
  * the terms of version 2 of the GNU General Public License (GPL), as published
@@ -18,6 +18,7 @@
 
 #include <string.h>
 #include <limits.h>
+#include <fcntl.h>
 
 /* Alert & PWM thresholds */
 static int fcd_temp_core_cfg[FCD_CONF_TEMP_ARRAY_SIZE] = {
@@ -56,6 +57,56 @@ static int fcd_temp_ich_cfg[FCD_CONF_TEMP_ARRAY_SIZE] = {
 	[FCD_CONF_TEMP_FAN_HIGH_HYST]	= 36000		/* ich_temp_fan_high_hyst */
 };
 
+struct fcd_temp_input {
+	char name[FCD_HWMON_ATTR_SIZE];
+	int fd;
+	int channel;		/* it87 channel (tempN_input) */
+	const int *cfg;
+	struct fcd_monitor *mon;
+	struct fcd_filter filter;
+};
+
+/*
+ * The it87 inputs come first, followed by however many CPU core inputs the
+ * coretemp chip has.
+ */
+enum fcd_temp_id {
+	FCD_TEMP_ID_CPU		= 0,
+	FCD_TEMP_ID_ICH,
+	FCD_TEMP_ID_SYS,
+	FCD_TEMP_ID_CORE0
+};
+
+#define FCD_TEMP_ID_ARRAY_SIZE	(FCD_TEMP_ID_CORE0 + FCD_HWMON_MAX_CORES)
+
+static struct fcd_temp_input fcd_temp_inputs[FCD_TEMP_ID_ARRAY_SIZE] = {
+	[FCD_TEMP_ID_CPU] = {
+		.fd		= -1,
+		.channel	= 1,	/* cpu_temp_channel */
+		.cfg		= fcd_temp_cpu_cfg,
+		.mon		= &fcd_temp_it87_monitor,
+	},
+	[FCD_TEMP_ID_ICH] = {
+		.fd		= -1,
+		.channel	= 2,	/* ich_temp_channel */
+		.cfg		= fcd_temp_ich_cfg,
+		.mon		= &fcd_temp_it87_monitor,
+	},
+	[FCD_TEMP_ID_SYS] = {
+		.fd		= -1,
+		.channel	= 3,	/* sys_temp_channel */
+		.cfg		= fcd_temp_sys_cfg,
+		.mon		= &fcd_temp_it87_monitor,
+	},
+	/* CPU core inputs are filled in by fcd_temp_open_cores() */
+};
+
+/* Number of inputs in use - FCD_TEMP_ID_CORE0 + number of CPU cores */
+static int fcd_temp_input_count = FCD_TEMP_ID_CORE0;
+
+/* CPU core numbers, for display */
+static unsigned fcd_temp_cores[FCD_HWMON_MAX_CORES];
+
 static int fcd_temp_cb();
 
 static const cip_opt_info fcd_temp_core_opts[] = {
@@ -210,55 +261,31 @@ static const cip_opt_info fcd_temp_it87_opts[] = {
 		.post_parse_data	= &fcd_temp_ich_cfg[FCD_CONF_TEMP_FAN_HIGH_HYST],
 	},
 	{
-		.name			= NULL
-	}
-};
-
-struct fcd_temp_input {
-	const char *path;
-	FILE *fp;
-	const int *cfg;
-	struct fcd_monitor *mon;
-};
-
-enum fcd_temp_id {
-	FCD_TEMP_ID_CORE0	= 0,
-	FCD_TEMP_ID_CORE1,
-	FCD_TEMP_ID_CPU,
-	FCD_TEMP_ID_ICH,
-	FCD_TEMP_ID_SYS
-};
-
-#define FCD_TEMP_ID_ARRAY_SIZE	(FCD_TEMP_ID_SYS + 1)
-
-static struct fcd_temp_input fcd_temp_inputs[FCD_TEMP_ID_ARRAY_SIZE] = {
-	[FCD_TEMP_ID_CORE0] = {
-		.path	= "/run/n5550/coretemp/temp2_input",
-		.cfg	= fcd_temp_core_cfg,
-		.mon	= &fcd_temp_core_monitor,
+		.name			= "cpu_temp_channel",
+		.type			= CIP_OPT_TYPE_INT,
+		.post_parse_fn		= fcd_hwmon_channel_cb,
+		.post_parse_data	= &fcd_temp_inputs[FCD_TEMP_ID_CPU].channel,
 	},
-	[FCD_TEMP_ID_CORE1] = {
-		.path	= "/run/n5550/coretemp/temp3_input",
-		.cfg	= fcd_temp_core_cfg,
-		.mon	= &fcd_temp_core_monitor,
-	},
-	[FCD_TEMP_ID_CPU] = {
-		.path	= "/run/n5550/it87/temp1_input",
-		.cfg	= fcd_temp_cpu_cfg,
-		.mon	= &fcd_temp_it87_monitor,
+	{
+		.name			= "ich_temp_channel",
+		.type			= CIP_OPT_TYPE_INT,
+		.post_parse_fn		= fcd_hwmon_channel_cb,
+		.post_parse_data	= &fcd_temp_inputs[FCD_TEMP_ID_ICH].channel,
 	},
-	[FCD_TEMP_ID_ICH] = {
-		.path	= "/run/n5550/it87/temp2_input",
-		.cfg	= fcd_temp_ich_cfg,
-		.mon	= &fcd_temp_it87_monitor,
+	{
+		.name			= "sys_temp_channel",
+		.type			= CIP_OPT_TYPE_INT,
+		.post_parse_fn		= fcd_hwmon_channel_cb,
+		.post_parse_data	= &fcd_temp_inputs[FCD_TEMP_ID_SYS].channel,
 	},
-	[FCD_TEMP_ID_SYS] = {
-		.path	= "/run/n5550/it87/temp3_input",
-		.cfg	= fcd_temp_sys_cfg,
-		.mon	= &fcd_temp_it87_monitor,
+	{
+		.name			= NULL
 	}
 };
 
+/* All of the inputs are read as a single batch */
+static struct fcd_lib_batch *fcd_temp_batch = NULL;
+
 static int fcd_temp_active_monitors;
 static _Bool fcd_temp_core_failed = 0;
 static _Bool fcd_temp_it87_failed = 0;
@@ -324,18 +351,21 @@ static void fcd_temp_close_inputs(const struct fcd_monitor *const mon)
 {
 	int i;
 
-	for (i = 0; i < FCD_TEMP_ID_ARRAY_SIZE; ++i) {
+	for (i = 0; i < fcd_temp_input_count; ++i) {
 
 		if (mon != NULL && mon != fcd_temp_inputs[i].mon)
 			continue;
 
-		if (fcd_temp_inputs[i].fp == NULL)
+		if (fcd_temp_inputs[i].fd == -1)
 			continue;
 
-		if (fclose(fcd_temp_inputs[i].fp) == EOF)
-			FCD_PERROR(fcd_temp_inputs[i].path);
+		if (fcd_temp_batch != NULL)
+			fcd_lib_batch_disable(fcd_temp_batch, i);
 
-		fcd_temp_inputs[i].fp = NULL;
+		if (close(fcd_temp_inputs[i].fd) == -1)
+			FCD_PERROR(fcd_temp_inputs[i].name);
+
+		fcd_temp_inputs[i].fd = -1;
 	}
 }
 
@@ -350,10 +380,13 @@ static void fcd_temp_fail(struct fcd_monitor *const mon)
 	else
 		FCD_ABORT("Aaaaaaaaaaaargh!\n");
 
-	if (--fcd_temp_active_monitors == 0)
+	if (--fcd_temp_active_monitors == 0) {
+		fcd_lib_batch_free(fcd_temp_batch);
 		fcd_lib_fail_and_exit(mon);
-	else
+	}
+	else {
 		fcd_lib_fail(mon);
+	}
 }
 
 static void fcd_temp_fail_both(void)
@@ -365,26 +398,48 @@ static void fcd_temp_fail_both(void)
 		fcd_temp_fail(&fcd_temp_it87_monitor);
 }
 
-static void fcd_temp_open_inputs(struct fcd_monitor *const mon)
+static void fcd_temp_open_cores(void)
 {
-	int i;
+	int fds[FCD_HWMON_MAX_CORES], count, i;
+	struct fcd_temp_input *input;
 
-	if (!mon->enabled)
+	count = fcd_hwmon_core_temps(fds, fcd_temp_cores, FCD_HWMON_MAX_CORES);
+	if (count < 1) {
+		if (count == 0)
+			FCD_WARN("No CPU core temperature sensors found\n");
+		fcd_temp_fail(&fcd_temp_core_monitor);
 		return;
+	}
 
-	for (i = 0; i < FCD_TEMP_ID_ARRAY_SIZE; ++i) {
+	for (i = 0; i < count; ++i) {
 
-		if (fcd_temp_inputs[i].mon != mon)
-			continue;
+		input = &fcd_temp_inputs[FCD_TEMP_ID_CORE0 + i];
 
-		if ((fcd_temp_inputs[i].fp = fopen(fcd_temp_inputs[i].path, "re")) == NULL) {
-			FCD_PERROR(fcd_temp_inputs[i].path);
-			fcd_temp_fail(mon);
-		}
+		sprintf(input->name, "Core %u", fcd_temp_cores[i]);
+		input->fd = fds[i];
+		input->cfg = fcd_temp_core_cfg;
+		input->mon = &fcd_temp_core_monitor;
+	}
+
+	fcd_temp_input_count = FCD_TEMP_ID_CORE0 + count;
+}
+
+static void fcd_temp_open_it87(void)
+{
+	struct fcd_temp_input *input;
+	int i;
 
-		if (setvbuf(fcd_temp_inputs[i].fp, NULL, _IONBF, 0) != 0) {
-			FCD_PERROR(fcd_temp_inputs[i].path);
-			fcd_temp_fail(mon);
+	for (i = 0; i < FCD_TEMP_ID_CORE0; ++i) {
+
+		input = &fcd_temp_inputs[i];
+
+		sprintf(input->name, "temp%d_input", input->channel);
+
+		input->fd = fcd_hwmon_open(FCD_HWMON_IT87, input->name,
+					   O_RDONLY);
+		if (input->fd == -1) {
+			fcd_temp_fail(&fcd_temp_it87_monitor);
+			return;
 		}
 	}
 }
@@ -401,7 +456,7 @@ static void fcd_temp_process(const struct fcd_monitor *const mon,
 	*warn = 0;
 	*pwm_flags = 0;
 
-	for (i = 0; i < FCD_TEMP_ID_ARRAY_SIZE; ++i) {
+	for (i = 0; i < fcd_temp_input_count; ++i) {
 
 		if (fcd_temp_inputs[i].mon != mon)
 			continue;
@@ -418,46 +473,136 @@ static void fcd_temp_process(const struct fcd_monitor *const mon,
 	}
 }
 
+/*
+ * Formats the CPU core temperatures for the LCD.  Two cores (the N5550's Atom)
+ * fit on the display; if there are more, show the range.
+ */
+static int fcd_temp_format_cores(char *const buf, const size_t size,
+				 const int *temps)
+{
+	int i, count, min, max;
+
+	memset(buf, ' ', size);
+
+	count = fcd_temp_input_count - FCD_TEMP_ID_CORE0;
+	temps += FCD_TEMP_ID_CORE0;
+
+	if (count == 1) {
+		return fcd_lib_snprintf(buf, size, "CORE%u: %d",
+					fcd_temp_cores[0], temps[0] / 1000);
+	}
+
+	if (count == 2) {
+		return fcd_lib_snprintf(buf, size, "CORE%u: %d  CORE%u: %d",
+					fcd_temp_cores[0], temps[0] / 1000,
+					fcd_temp_cores[1], temps[1] / 1000);
+	}
+
+	for (min = max = temps[0], i = 1; i < count; ++i) {
+		if (temps[i] < min)
+			min = temps[i];
+		if (temps[i] > max)
+			max = temps[i];
+	}
+
+	return fcd_lib_snprintf(buf, size, "CORE MIN: %d MAX: %d",
+				min / 1000, max / 1000);
+}
+
+/*
+ * Logs any input whose peak (raw) temperature over the last 30 seconds reached
+ * its warning threshold, even though its filtered temperature didn't.  (If
+ * filtering is disabled, the peak is always the current temperature.)
+ */
+static void fcd_temp_log_peaks(const int *const temps)
+{
+	struct fcd_temp_input *input;
+	int i;
+
+	for (i = 0; i < fcd_temp_input_count; ++i) {
+
+		input = &fcd_temp_inputs[i];
+
+		if (input->fd == -1)
+			continue;
+
+		if (input->filter.peak >= input->cfg[FCD_CONF_TEMP_WARN] &&
+				temps[i] < input->cfg[FCD_CONF_TEMP_WARN]) {
+			FCD_INFO("%s: peak temperature %.1f (filtered %.1f)\n",
+				 input->name, input->filter.peak / 1000.0,
+				 temps[i] / 1000.0);
+		}
+
+		fcd_lib_filter_reset_peaks(&input->filter);
+	}
+}
+
+static void fcd_temp_new_batch(void)
+{
+	const char *names[FCD_TEMP_ID_ARRAY_SIZE];
+	int fds[FCD_TEMP_ID_ARRAY_SIZE], i;
+
+	for (i = 0; i < fcd_temp_input_count; ++i) {
+		fds[i] = fcd_temp_inputs[i].fd;
+		names[i] = fcd_temp_inputs[i].name;
+	}
+
+	fcd_temp_batch = fcd_lib_batch_new("temperature", fds, names,
+					   fcd_temp_input_count);
+	if (fcd_temp_batch == NULL)
+		fcd_temp_fail_both();
+}
+
 __attribute__((noreturn))
 static void *fcd_temp_fn(void *const arg __attribute__((unused)))
 {
 	int warn, fail, i, ret, temps[FCD_TEMP_ID_ARRAY_SIZE];
+	int raw[FCD_TEMP_ID_ARRAY_SIZE], samples, period;
+	unsigned read;
 	uint8_t pwm_flags;
 	char upper[21], lower[21];
 
 	fcd_temp_exit_if_dupe_thread();
-	fcd_temp_open_inputs(&fcd_temp_core_monitor);
-	fcd_temp_open_inputs(&fcd_temp_it87_monitor);
+
+	if (fcd_temp_core_monitor.enabled)
+		fcd_temp_open_cores();
+	if (fcd_temp_it87_monitor.enabled)
+		fcd_temp_open_it87();
+
+	fcd_temp_new_batch();
+
+	for (i = 0; i < fcd_temp_input_count; ++i)
+		fcd_lib_filter_init(&fcd_temp_inputs[i].filter);
+
+	/* Check peaks every 30 seconds, regardless of the sampling rate */
+	period = 30 / fcd_conf_sample_interval;
+	samples = 0;
 
 	do {
-		for (i = 0; i < FCD_TEMP_ID_ARRAY_SIZE; ++i) {
+		/* A failed input disables its monitor; re-read the rest */
+		while ((read = fcd_lib_batch_read(fcd_temp_batch, raw))
+						< (unsigned)fcd_temp_input_count)
+			fcd_temp_fail(fcd_temp_inputs[read].mon);
+
+		for (i = 0; i < fcd_temp_input_count; ++i) {
 
-			if (fcd_temp_inputs[i].fp == NULL)
+			if (fcd_temp_inputs[i].fd == -1)
 				continue;
 
-			rewind(fcd_temp_inputs[i].fp);
+			temps[i] = fcd_lib_filter_add(
+					&fcd_temp_inputs[i].filter, raw[i]);
+		}
 
-			ret = fscanf(fcd_temp_inputs[i].fp, "%d", &temps[i]);
-			if (ret == EOF) {
-				FCD_PERROR(fcd_temp_inputs[i].path);
-				fcd_temp_fail(fcd_temp_inputs[i].mon);
-			}
-			else if (ret != 1) {
-				FCD_WARN("Failed to parse contents of %s\n",
-					 fcd_temp_inputs[i].path);
-				fcd_temp_fail(fcd_temp_inputs[i].mon);
-			}
+		if (++samples == period) {
+			fcd_temp_log_peaks(temps);
+			samples = 0;
 		}
 
 		if (fcd_temp_core_monitor.enabled && !fcd_temp_core_failed) {
 
 			fcd_temp_process(&fcd_temp_core_monitor, temps, &warn, &fail, &pwm_flags);
 
-			memset(lower, ' ', sizeof lower);
-
-			ret = fcd_lib_snprintf(lower, sizeof lower, "CORE0: %d  CORE1: %d",
-					       temps[FCD_TEMP_ID_CORE0] / 1000,
-					       temps[FCD_TEMP_ID_CORE1] / 1000);
+			ret = fcd_temp_format_cores(lower, sizeof lower, temps);
 			if (ret < 0) {
 				fcd_temp_fail(&fcd_temp_core_monitor);
 			}
@@ -488,12 +633,14 @@ static void *fcd_temp_fn(void *const arg __attribute__((unused)))
 			}
 		}
 
-		ret = fcd_lib_monitor_sleep(30);
+		ret = fcd_lib_monitor_sleep(fcd_conf_sample_interval);
 		if (ret == -1)
 			fcd_temp_fail_both();
 
 	} while (ret == 0);
 
+	fcd_lib_batch_free(fcd_temp_batch);
+	fcd_temp_batch = NULL;
 	fcd_temp_close_inputs(NULL);
 	pthread_exit(NULL);
 }
@@ -512,6 +659,10 @@ static void fcd_temp_dump_it87_config(void)
 	fcd_lib_dump_temp_cfg(fcd_temp_sys_cfg);
 	FCD_DUMP("\tICH temperature thresholds:\n");
 	fcd_lib_dump_temp_cfg(fcd_temp_ich_cfg);
+	FCD_DUMP("\tit87 channels (CPU/ICH/system): %d/%d/%d\n",
+		 fcd_temp_inputs[FCD_TEMP_ID_CPU].channel,
+		 fcd_temp_inputs[FCD_TEMP_ID_ICH].channel,
+		 fcd_temp_inputs[FCD_TEMP_ID_SYS].channel);
 }
 
 struct fcd_monitor fcd_temp_core_monitor = {
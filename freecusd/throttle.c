@@ -0,0 +1,439 @@
+/*
+ * Copyright 2026 Ian Pilcher <arequipeno@gmail.com>
+ *
+ * This program is free software.  You can redistribute it or modify it under
+ * the terms of version 2 of the GNU General Public License (GPL), as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY -- without even the implied warranty of MERCHANTIBILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the text of the GPL for more details.
+ *
+ * Version 2 of the GNU General Public License is available at:
+ *
+ *   http://www.gnu.org/licenses/old-licenses/gpl-2.0.html
+ */
+
+/*
+ * CPU thermal throttling & frequency monitor.  When the chassis gets hot, the
+ * CPU throttles itself long before any temperature alert is triggered, and
+ * NAS throughput quietly drops.  This monitor watches the kernel's throttle
+ * event counters (thermal_throttle/{core,package}_throttle_count) and the
+ * current CPU frequency, and it asks for more fan when throttling occurs.
+ */
+
+#include "freecusd.h"
+
+#include <sys/types.h>
+#include <dirent.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#define FCD_THROTTLE_CPU_DIR	"/sys/devices/system/cpu"
+#define FCD_THROTTLE_MAX_CPUS	16
+
+/* e.g. "cpu15/thermal_throttle/package_throttle_count" */
+#define FCD_THROTTLE_ATTR_SIZE	\
+		(sizeof "cpu/thermal_throttle/package_throttle_count" + 10)
+
+/* Per-CPU attributes that are read every pass */
+enum fcd_throttle_attr {
+	FCD_THROTTLE_CORE	= 0,	/* thermal_throttle/core_throttle_count */
+	FCD_THROTTLE_PKG,		/* thermal_throttle/package_throttle_count */
+	FCD_THROTTLE_FREQ		/* cpufreq/scaling_cur_freq */
+};
+
+#define FCD_THROTTLE_ATTR_ARRAY_SIZE	(FCD_THROTTLE_FREQ + 1)
+
+static const char *const fcd_throttle_attrs[FCD_THROTTLE_ATTR_ARRAY_SIZE] = {
+	[FCD_THROTTLE_CORE]	= "thermal_throttle/core_throttle_count",
+	[FCD_THROTTLE_PKG]	= "thermal_throttle/package_throttle_count",
+	[FCD_THROTTLE_FREQ]	= "cpufreq/scaling_cur_freq",
+};
+
+struct fcd_throttle_cpu {
+	unsigned cpu;
+	int fds[FCD_THROTTLE_ATTR_ARRAY_SIZE];
+	int max_freq;		/* cpufreq/cpuinfo_max_freq (kHz) */
+};
+
+static struct fcd_throttle_cpu fcd_throttle_cpus[FCD_THROTTLE_MAX_CPUS];
+static unsigned fcd_throttle_cpu_count;
+
+/* All of the attributes are read as a single batch */
+static struct fcd_lib_batch *fcd_throttle_batch;
+
+/* Alert thresholds (throttle events per minute) */
+static int fcd_throttle_warn = 1;	/* cpu_throttle_warn */
+static int fcd_throttle_fail = 60;	/* cpu_throttle_crit */
+
+/* How long (seconds) to keep the fan at maximum after throttling stops */
+static int fcd_throttle_fan_hold = 300;	/* cpu_throttle_fan_hold */
+
+static int fcd_throttle_cb();
+
+static const cip_opt_info fcd_throttle_opts[] = {
+	{
+		.name			= "cpu_throttle_warn",
+		.type			= CIP_OPT_TYPE_INT,
+		.post_parse_fn		= fcd_throttle_cb,
+		.post_parse_data	= &fcd_throttle_warn,
+	},
+	{
+		.name			= "cpu_throttle_crit",
+		.type			= CIP_OPT_TYPE_INT,
+		.post_parse_fn		= fcd_throttle_cb,
+		.post_parse_data	= &fcd_throttle_fail,
+	},
+	{
+		.name			= "cpu_throttle_fan_hold",
+		.type			= CIP_OPT_TYPE_INT,
+		.post_parse_fn		= fcd_throttle_cb,
+		.post_parse_data	= &fcd_throttle_fan_hold,
+	},
+	{	.name			= NULL		}
+};
+
+/*
+ * Configuration callback for alert thresholds & fan hold time
+ */
+static int fcd_throttle_cb(cip_err_ctx *ctx, const cip_ini_value *value,
+			   const cip_ini_sect *sect __attribute__((unused)),
+			   const cip_ini_file *file __attribute__((unused)),
+			   void *post_parse_data)
+{
+	int i;
+
+	memcpy(&i, value->value, sizeof i);
+
+	if (i < 0) {
+		cip_err(ctx, "Value must not be negative: %d", i);
+		return -1;
+	}
+
+	*(int *)post_parse_data = i;
+
+	return 0;
+}
+
+/*
+ * Opens a per-CPU attribute (relative to /sys/devices/system/cpu).  Returns -1
+ * (without logging anything) if the attribute doesn't exist.
+ */
+static int fcd_throttle_open(const int dirfd, const unsigned cpu,
+			     const char *const attr)
+{
+	char name[FCD_THROTTLE_ATTR_SIZE];
+	int fd;
+
+	sprintf(name, "cpu%u/%s", cpu, attr);
+
+	fd = openat(dirfd, name, O_RDONLY | O_CLOEXEC);
+	if (fd == -1 && errno != ENOENT)
+		FCD_ERR("%s/%s: %m\n", FCD_THROTTLE_CPU_DIR, name);
+
+	return fd;
+}
+
+static void fcd_throttle_close(void)
+{
+	unsigned i, j;
+	int fd;
+
+	fcd_lib_batch_free(fcd_throttle_batch);
+	fcd_throttle_batch = NULL;
+
+	for (i = 0; i < fcd_throttle_cpu_count; ++i) {
+
+		for (j = 0; j < FCD_THROTTLE_ATTR_ARRAY_SIZE; ++j) {
+
+			fd = fcd_throttle_cpus[i].fds[j];
+
+			if (fd != -1 && close(fd) == -1)
+				FCD_PERROR("close");
+		}
+	}
+
+	fcd_throttle_cpu_count = 0;
+}
+
+/*
+ * Finds the CPUs and opens their throttle counters and frequency attributes.
+ * Returns 0 if anything worth monitoring was found, -1 otherwise.
+ */
+static int fcd_throttle_open_cpus(void)
+{
+	int fds[FCD_THROTTLE_MAX_CPUS * FCD_THROTTLE_ATTR_ARRAY_SIZE];
+	const char *names[FCD_THROTTLE_MAX_CPUS * FCD_THROTTLE_ATTR_ARRAY_SIZE];
+	struct fcd_throttle_cpu *c;
+	_Bool have_counters, have_freqs;
+	struct dirent *dent;
+	unsigned cpu, i, j;
+	int fd, n;
+	DIR *dir;
+
+	dir = opendir(FCD_THROTTLE_CPU_DIR);
+	if (dir == NULL) {
+		FCD_PERROR(FCD_THROTTLE_CPU_DIR);
+		return -1;
+	}
+
+	have_counters = 0;
+	have_freqs = 0;
+
+	while (errno = 0, (dent = readdir(dir)) != NULL) {
+
+		if (sscanf(dent->d_name, "cpu%u%n", &cpu, &n) != 1 ||
+				dent->d_name[n] != 0)
+			continue;
+
+		if (fcd_throttle_cpu_count == FCD_THROTTLE_MAX_CPUS) {
+			FCD_WARN("Ignoring CPU %u (too many CPUs)\n", cpu);
+			continue;
+		}
+
+		c = &fcd_throttle_cpus[fcd_throttle_cpu_count++];
+		c->cpu = cpu;
+		c->max_freq = 0;
+
+		for (i = 0; i < FCD_THROTTLE_ATTR_ARRAY_SIZE; ++i) {
+			c->fds[i] = fcd_throttle_open(dirfd(dir), cpu,
+						      fcd_throttle_attrs[i]);
+		}
+
+		/* Maximum frequency doesn't change; read it once */
+
+		fd = fcd_throttle_open(dirfd(dir), cpu,
+				       "cpufreq/cpuinfo_max_freq");
+		if (fd != -1) {
+			if (fcd_lib_read_int(fd, "cpuinfo_max_freq",
+					     &c->max_freq) == -1)
+				c->max_freq = 0;
+			if (close(fd) == -1)
+				FCD_PERROR("close");
+		}
+
+		if (c->max_freq <= 0 && c->fds[FCD_THROTTLE_FREQ] != -1) {
+			if (close(c->fds[FCD_THROTTLE_FREQ]) == -1)
+				FCD_PERROR("close");
+			c->fds[FCD_THROTTLE_FREQ] = -1;
+		}
+
+		if (c->fds[FCD_THROTTLE_CORE] != -1 ||
+				c->fds[FCD_THROTTLE_PKG] != -1)
+			have_counters = 1;
+		if (c->fds[FCD_THROTTLE_FREQ] != -1)
+			have_freqs = 1;
+	}
+
+	if (errno != 0)
+		FCD_PERROR(FCD_THROTTLE_CPU_DIR);
+
+	if (closedir(dir) == -1)
+		FCD_PERROR(FCD_THROTTLE_CPU_DIR);
+
+	if (!have_counters)
+		FCD_WARN("No CPU thermal throttle counters found\n");
+	if (!have_freqs)
+		FCD_WARN("No CPU frequency information found\n");
+
+	if (!have_counters && !have_freqs) {
+		fcd_throttle_close();
+		return -1;
+	}
+
+	for (n = 0, i = 0; i < fcd_throttle_cpu_count; ++i) {
+		for (j = 0; j < FCD_THROTTLE_ATTR_ARRAY_SIZE; ++j, ++n) {
+			fds[n] = fcd_throttle_cpus[i].fds[j];
+			names[n] = fcd_throttle_attrs[j];
+		}
+	}
+
+	fcd_throttle_batch = fcd_lib_batch_new("CPU throttling", fds, names, n);
+	if (fcd_throttle_batch == NULL) {
+		fcd_throttle_close();
+		return -1;
+	}
+
+	FCD_INFO("Monitoring %u CPUs for thermal throttling\n",
+		 fcd_throttle_cpu_count);
+
+	return 0;
+}
+
+/*
+ * Reads the throttle counters and current frequencies.  Core counters are
+ * summed; package counters are reported identically by every CPU in the
+ * package, so only the largest is used.  (The N5550 has only one package.)
+ */
+static int fcd_throttle_read(long long *const events, int *const freq,
+			     int *const pct)
+{
+	int values[FCD_THROTTLE_MAX_CPUS][FCD_THROTTLE_ATTR_ARRAY_SIZE];
+	long long cur_sum, max_sum;
+	struct fcd_throttle_cpu *c;
+	int pkg, freqs;
+	unsigned i;
+
+	if (fcd_lib_batch_read(fcd_throttle_batch, &values[0][0]) <
+			fcd_throttle_cpu_count * FCD_THROTTLE_ATTR_ARRAY_SIZE)
+		return -1;
+
+	*events = 0;
+	cur_sum = 0;
+	max_sum = 0;
+	freqs = 0;
+	pkg = 0;
+
+	for (i = 0; i < fcd_throttle_cpu_count; ++i) {
+
+		c = &fcd_throttle_cpus[i];
+
+		if (c->fds[FCD_THROTTLE_CORE] != -1)
+			*events += values[i][FCD_THROTTLE_CORE];
+
+		if (c->fds[FCD_THROTTLE_PKG] != -1 &&
+				values[i][FCD_THROTTLE_PKG] > pkg)
+			pkg = values[i][FCD_THROTTLE_PKG];
+
+		if (c->fds[FCD_THROTTLE_FREQ] != -1) {
+			cur_sum += values[i][FCD_THROTTLE_FREQ];
+			max_sum += c->max_freq;
+			++freqs;
+		}
+	}
+
+	*events += pkg;
+
+	if (freqs == 0) {
+		*freq = -1;
+		*pct = -1;
+	}
+	else {
+		*freq = (int)(cur_sum / freqs / 1000);		/* MHz */
+		*pct = (int)(cur_sum * 100 / max_sum);
+	}
+
+	return 0;
+}
+
+static int fcd_throttle_format(char *const buf, const size_t size,
+			       const int freq, const int pct, const int rate)
+{
+	memset(buf, ' ', size);
+
+	if (freq < 0)
+		return fcd_lib_snprintf(buf, size, "THROTTLE: %d/MIN", rate);
+
+	if (rate == 0)
+		return fcd_lib_snprintf(buf, size, "%d MHz (%d%%)", freq, pct);
+
+	/* "1800 MHz 100% THR 99" just fits */
+	return fcd_lib_snprintf(buf, size, "%d MHz %d%% THR %d",
+				freq, pct, rate > 99 ? 99 : rate);
+}
+
+__attribute__((noreturn))
+static void fcd_throttle_disable(struct fcd_monitor *const mon)
+{
+	fcd_throttle_close();
+	fcd_lib_fail_and_exit(mon);
+}
+
+__attribute__((noreturn))
+static void *fcd_throttle_fn(void *arg)
+{
+	struct fcd_monitor *mon = arg;
+	int warn, fail, freq, pct, rate, ret;
+	long long events, last_events, delta;
+	time_t now, last, hold_until;
+	uint8_t pwm_flags;
+	char buf[21];
+
+	if (fcd_throttle_open_cpus() == -1)
+		fcd_lib_fail_and_exit(mon);
+
+	last_events = -1;
+	last = 0;
+	hold_until = 0;
+
+	do {
+		if (fcd_throttle_read(&events, &freq, &pct) == -1)
+			fcd_throttle_disable(mon);
+
+		now = fcd_lib_boottime();
+
+		/*
+		 * Nothing to compare against on the first pass.  Counters can
+		 * only go backwards if a CPU was hot-unplugged.
+		 */
+		if (last_events == -1 || events < last_events || now <= last)
+			delta = 0;
+		else
+			delta = events - last_events;
+
+		rate = (delta == 0) ? 0 : (int)(delta * 60 / (now - last));
+
+		if (delta != 0) {
+			FCD_DEBUG("%lld CPU throttle events in %ld seconds\n",
+				  delta, (long)(now - last));
+		}
+
+		last_events = events;
+		last = now;
+
+		fail = (fcd_throttle_fail > 0 && rate >= fcd_throttle_fail);
+		warn = !fail && fcd_throttle_warn > 0 &&
+					rate >= fcd_throttle_warn;
+
+		/*
+		 * Any throttling runs the fan at maximum, and the fan stays
+		 * there (if nothing else lowers it) for fcd_throttle_fan_hold
+		 * seconds after throttling stops.
+		 */
+		if (delta != 0) {
+			pwm_flags = FCD_FAN_MAX_ON;
+			hold_until = now + fcd_throttle_fan_hold;
+		}
+		else if (now < hold_until) {
+			pwm_flags = FCD_FAN_MAX_HYST;
+		}
+		else {
+			pwm_flags = 0;
+		}
+
+		if (fcd_throttle_format(buf, sizeof buf, freq, pct, rate) < 0)
+			fcd_throttle_disable(mon);
+
+		fcd_lib_set_mon_status(mon, buf, warn, fail, NULL, pwm_flags);
+
+		ret = fcd_lib_monitor_sleep(30);
+		if (ret == -1)
+			fcd_throttle_disable(mon);
+
+	} while (ret == 0);
+
+	fcd_throttle_close();
+	pthread_exit(NULL);
+}
+
+static void fcd_throttle_dump_cfg(void)
+{
+	FCD_DUMP("\twarning: %d events/minute\n", fcd_throttle_warn);
+	FCD_DUMP("\tcritical: %d events/minute\n", fcd_throttle_fail);
+	FCD_DUMP("\tfan hold time: %d seconds\n", fcd_throttle_fan_hold);
+}
+
+struct fcd_monitor fcd_throttle_monitor = {
+	.mutex			= PTHREAD_MUTEX_INITIALIZER,
+	.name			= "CPU throttling",
+	.monitor_fn		= fcd_throttle_fn,
+	.cfg_dump_fn		= fcd_throttle_dump_cfg,
+	.buf			= "....."
+				  "CPU THROTTLING      "
+				  "                    ",
+	.enabled		= true,
+	.enabled_opt_name	= "enable_cpu_throttle_monitor",
+	.freecusd_opts		= fcd_throttle_opts,
+};
@@ -33,6 +33,7 @@ mkdir -p %{buildroot}/usr/lib/systemd/system
 cp freecusd/freecusd.service %{buildroot}/usr/lib/systemd/system/
 mkdir %{buildroot}/etc
 cp freecusd/freecusd.conf %{buildroot}/etc/
+mkdir -p %{buildroot}/var/lib/freecusd
 # Kernel module sources
 mkdir -p %{buildroot}/usr/src/n5550/modules
 cp modules/{Makefile,n5550_ahci_leds.c,n5550_board.c} %{buildroot}/usr/src/n5550/modules/
@@ -58,6 +59,7 @@ rm -rf %{buildroot}
 %attr(0755,root,root) /usr/libexec/freecusd-smart-helper
 %attr(0644,root,root) /usr/lib/systemd/system/freecusd.service
 %attr(0644,root,root) %config /etc/freecusd.conf
+%attr(0755,root,root) %dir /var/lib/freecusd
 %attr(0755,root,root) %dir /usr/src/n5550
 %attr(0755,root,root) %dir /usr/src/n5550/modules
 %attr(0644,root,root) /usr/src/n5550/modules/Makefile